@@ -6,313 +6,2811 @@
  */
 
 #include "mymap.h"
+
+/* Rebalancing of the tree of regions is counted in statistics of the map */
+#define RB_GEN_EVENT(t, event)  MYMAP_STAT(RB_ENTRY(t, map_t, rb_tree), event)
+
+#include "rb_tree_gen.h"
+#include "mymap_btree.h"
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+
+/* Private macros ----------------------------------------------------------- */
+#define RB_REGION(node)         RB_ENTRY(node, map_region_t, rb_node)
+#define RB_MAX_GAP(node)        RB_REGION(node)->max_gap
+#define RB_GAP(node)            RB_REGION(node)->gap
+#define RB_VADDR(node)          RB_REGION(node)->vaddr
+
+/* Map the pool of region descriptors belongs to */
+#define POOL_MAP(pool)                                                      \
+    ((map_t*)((char*)(pool) - offsetof(map_t, pool)))
+
+/* Beginning of the gap before the region of the node. Computed on integers,
+ * since gaps may span most of the address space. */
+#define RB_GAP_START(node)                                                  \
+    ((void*)((uintptr_t)RB_VADDR(node) - RB_GAP(node)))
+
+#ifdef MYMAP_GAP_INDEX
+#define GAP_REGION(node)        RB_ENTRY(node, map_region_t, gap_node)
+#define GAP_SIZE(node)          GAP_REGION(node)->gap
+#define GAP_COUNT(node)                                                     \
+    (((node) != NULL) ? GAP_REGION(node)->gap_count : 0)
+
+#define MYMAP_GAP_PROPAGATE(t, node, stop)                                  \
+    mymap_gap_count_propagate(node, stop)
+#define MYMAP_GAP_COPY(t, old, new)                                         \
+    (GAP_REGION(new)->gap_count = GAP_REGION(old)->gap_count)
+#define MYMAP_GAP_ROTATE(t, old, new)       mymap_gap_count_rotate(old, new)
+#endif
+
+/* Largest gap of a subtree which has to be recomputed once deferred updates
+ * are over. Since it is greater than any real gap, it is inherited by all
+ * ancestors when largest gaps are computed in the usual way. */
+#define MYMAP_DIRTY_GAP         (MYMAP_GAP_MAX)
+
+/* Entry of the region cache for given address */
+#define MYMAP_CACHE_INDEX(addr) \
+    (((unsigned long)(addr) >> MYMAP_CACHE_SHIFT) & (MYMAP_CACHE_SIZE - 1))
+
+/* Locking of thread-safe maps (other maps are not locked at all) */
+#define MYMAP_READ_LOCK(map)                                                \
+    do {                                                                    \
+        if ((map)->thread_safe) MYMAP_RWLOCK_RDLOCK(&(map)->lock);          \
+    } while (0)
+
+#define MYMAP_WRITE_LOCK(map)                                               \
+    do {                                                                    \
+        if ((map)->thread_safe) {                                           \
+            MYMAP_RWLOCK_WRLOCK(&(map)->lock);                              \
+            (map)->generation++;                                            \
+        }                                                                   \
+    } while (0)
+
+#define MYMAP_UNLOCK(map)                                                   \
+    do {                                                                    \
+        if ((map)->thread_safe) MYMAP_RWLOCK_UNLOCK(&(map)->lock);          \
+    } while (0)
+
+/* Recording of traced maps */
+#define MYMAP_TRACE(map, ...)                                               \
+    do {                                                                    \
+        if ((map)->trace != NULL) mymap_trace(map, __VA_ARGS__);            \
+    } while (0)
+
+/* Augmentation callbacks of the tree of regions, called directly by the code
+ * generated for it */
+#define MYMAP_RB_PROPAGATE(t, node, stop)   mymap_tree_propagate(t, node, stop)
+#define MYMAP_RB_COPY(t, old, new)          mymap_augment_copy(old, new)
+#define MYMAP_RB_ROTATE(t, old, new)        mymap_augment_rotate(old, new)
+
+#define ALIGN_UP(addr, align)                                               \
+    ((void*)(((uintptr_t)(addr) + (align) - 1) & ~((uintptr_t)(align) - 1)))
+#define ALIGN_DOWN(addr, align)                                             \
+    ((void*)((uintptr_t)(addr) & ~((uintptr_t)(align) - 1)))
+
+/* Length of a line of flat dumps: three addresses, flags and separators */
+#define MYMAP_DUMP_LINE_SIZE    (3*2*sizeof(void*) + 7)
+
+/* Best gap found so far by best-fit search */
+typedef struct {
+    unsigned long size; /* Size of the area */
+    unsigned long align; /* Alignment of the area */
+    void *addr; /* Address of the area in the best gap (or MYMAP_FAILED) */
+    unsigned long gap; /* Usable size of the best gap */
+} map_best_fit_t;
+
+/* Private types ------------------------------------------------------------ */
+union map_pool_obj_u {
+    map_region_t region; /* Region descriptor (when allocated) */
+    map_pool_obj_t *next; /* Next free descriptor (when released) */
+};
+
+struct map_slab_s {
+    map_slab_t *next; /* Next slab of the pool */
+    map_pool_obj_t objs[]; /* Descriptors */
+};
+
+/* Private functions -------------------------------------------------------- */
+/**
+ * Checks if virtual address belongs to region
+ * @param vaddr Virtual address to check
+ * @param region Pointer to the region
+ * @return Returns -1, 0 or 1 if virtual address is located before, inside or
+ * after region, respectively
+ */
+static inline int mymap_belongs_to_region(void *vaddr, map_region_t *region);
+
+/**
+ * Works like mymap_mmap_aligned, but doesn't take the lock
+ */
+static void* _mymap_mmap(map_t *map, void *vaddr, size_t size,
+        unsigned long align, unsigned int flags, void *o);
+
+/**
+ * Works like mymap_find, but doesn't take the lock and always uses the cache
+ */
+static map_region_t* _mymap_find(map_t *map, void *vaddr);
+
+/**
+ * Works like mymap_munmap_range, but doesn't take the lock
+ */
+static int _mymap_munmap_range(map_t *map, void *vaddr, size_t len);
+
+/**
+ * Works like mymap_mprotect, but doesn't take the lock
+ */
+static int _mymap_mprotect(map_t *map, void *vaddr, size_t len,
+        unsigned int flags);
+
+/**
+ * Works like mymap_batch, but doesn't take the lock
+ */
+static int _mymap_batch(map_t *map, map_op_t *ops, size_t count);
+
+/**
+ * Works like mymap_build_sorted, but isn't recorded in the trace
+ */
+static int _mymap_build_sorted(map_t *map, const map_region_desc_t *regions,
+        size_t count);
+
+/**
+ * Works like mymap_create_region, but doesn't take the lock
+ */
+static map_region_t* _mymap_create_region(map_t *map, void *paddr,
+        unsigned int flags);
+
+/**
+ * Works like mymap_get_unmapped_area_aligned, but doesn't take the lock
+ */
+static void* _mymap_get_unmapped_area(map_t *map, void *vaddr,
+        size_t size, unsigned long align);
+
+/**
+ * Maps region to the area, which has to be unmapped, merging it with
+ * neighbouring regions if coalescing is enabled
+ * @param map Pointer to the map instance
+ * @param vaddr Beginning of the area
+ * @param size Size of the area
+ * @param flags Memory region flags
+ * @param o Physical address of the region
+ * @return Virtual address of the region or MYMAP_FAILED on error
+ */
+static void* mymap_map_area(map_t *map, void *vaddr, size_t size,
+        unsigned int flags, void *o);
+
+/**
+ * Extends neighbouring regions over the area, which has to be unmapped, if
+ * they can be merged with it
+ * @param map Pointer to the map instance
+ * @param vaddr Beginning of the area
+ * @param size Size of the area
+ * @param flags Memory region flags
+ * @param o Physical address of the area
+ * @return True if the area was merged with a neighbour, false otherwise
+ */
+static bool mymap_merge_area(map_t *map, void *vaddr, size_t size,
+        unsigned int flags, void *o);
+
+/**
+ * Checks whether the whole area is unmapped
+ * @param map Pointer to the map instance
+ * @param vaddr Beginning of the area
+ * @param size Size of the area
+ * @return True if no region overlaps with the area, false otherwise
+ */
+static bool mymap_is_unmapped(map_t *map, void *vaddr, size_t size);
+
+/**
+ * Releases region structure allocated by mymap_create_region
+ * @param map Pointer to the map instance the region belongs to
+ * @param region Pointer to the region structure
+ */
+static void mymap_destroy_region(map_t *map, map_region_t *region);
+
+/**
+ * Takes region descriptor from the pool of the map, allocating new slab if
+ * necessary
+ * @param pool Pointer to the pool
+ * @return Pointer to the descriptor or NULL if allocation failed
+ */
+static inline map_region_t* mymap_pool_alloc(map_pool_t *pool);
+
+/**
+ * Returns region descriptor to the pool
+ * @param pool Pointer to the pool
+ * @param region Pointer to the descriptor
+ */
+static inline void mymap_pool_free(map_pool_t *pool, map_region_t *region);
+
+/**
+ * Links region to the tree of the map, updating gaps of the region, of the
+ * region after it (or the last gap) and largest gaps in the affected subtrees
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region with virtual addresses already set
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+static int mymap_insert_region(map_t *map, map_region_t *region);
+
+/**
+ * Unlinks region from the tree of the map and merges the gap before it with
+ * the area it occupied and the gap after it
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @return Pointer to the region which followed the removed one or NULL if it
+ * was the last one
+ */
+static map_region_t* mymap_remove_region(map_t *map, map_region_t *region);
+
+/**
+ * Unlinks region together with the regions following it up to given address
+ * and merges all gaps between them. Largest gaps are fixed once, after all the
+ * regions have been removed.
+ * @param map Pointer to the map instance
+ * @param region Pointer to the first region to remove
+ * @param end Address the last removed region ends at
+ * @return Pointer to the region which followed the last removed one or NULL
+ * if there is no such region
+ */
+static map_region_t* mymap_remove_regions(map_t *map, map_region_t *region,
+        void *end);
+
+/**
+ * Splits region in two at given address. The new region, covering the part
+ * from the address to the end of the original one, is inserted into the map.
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @param vaddr Address inside the region to split at
+ * @return Pointer to the new region or NULL if it could not be allocated
+ */
+static map_region_t* mymap_split_region(map_t *map, map_region_t *region,
+        void *vaddr);
+
+/**
+ * Returns the region after given one
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @return Pointer to the next region or NULL if it's the last one
+ */
+static inline map_region_t* mymap_next(map_t *map, map_region_t *region);
+
+/**
+ * Returns the region before given one
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @return Pointer to the previous region or NULL if it's the first one
+ */
+static inline map_region_t* mymap_prev(map_t *map, map_region_t *region);
+
+/**
+ * Returns the last region of the map
+ * @param map Pointer to the map instance
+ * @return Pointer to the region or NULL if the map is empty
+ */
+static inline map_region_t* mymap_last(map_t *map);
+
+/**
+ * Checks whether there are no regions in the map
+ * @param map Pointer to the map instance
+ * @return True if the map is empty, false otherwise
+ */
+static inline bool mymap_is_empty(map_t *map);
+
+/**
+ * Finds region containing given address without using the cache
+ * @param map Pointer to the map instance
+ * @param vaddr Virtual address
+ * @return Pointer to the region or NULL if the address is not mapped
+ */
+static inline map_region_t* mymap_lookup(map_t *map, void *vaddr);
+
+/**
+ * Moves beginning of the region to given address. The region has to stay
+ * between the same neighbours and its gap has to be updated separately.
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @param vaddr New virtual address of the region
+ */
+static inline void mymap_move_region(map_t *map, map_region_t *region,
+        void *vaddr);
+
+/**
+ * Checks whether area described by arguments can be merged with the region
+ * before it, i.e. whether it starts where the region ends, has the same flags
+ * and its physical address continues physical address of the region
+ * @param region Pointer to the region before the area
+ * @param vaddr Virtual address of the area
+ * @param paddr Physical address of the area
+ * @param flags Flags of the area
+ * @return True if the area can be merged with the region, false otherwise
+ */
+static inline bool mymap_can_merge(map_region_t *region, void *vaddr,
+        void *paddr, unsigned int flags);
+
+/**
+ * Merges region with the one right after it if they have the same flags and
+ * are contiguous both in virtual and physical memory
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @return True if regions were merged, false otherwise
+ */
+static bool mymap_merge_next(map_t *map, map_region_t *region);
+
+/**
+ * Finds the first region which ends after given address
+ * @param map Pointer to the map instance
+ * @param vaddr Virtual address
+ * @return Pointer to the region or NULL if there is no such region
+ */
+static map_region_t* mymap_lower_bound(map_t *map, void *vaddr);
+
+/**
+ * Returns the first node of the subtree with gap of at least given size
+ * @param node Root of the subtree
+ * @param size Minimum size of the gap (not zero)
+ * @return Pointer to the node or NULL if there is no such node
+ */
+static rb_node_t* mymap_first_gap(rb_node_t *node, unsigned long size);
+
+/**
+ * Returns the node after given one with gap of at least given size
+ * @param node Pointer to the node
+ * @param size Minimum size of the gap (not zero)
+ * @return Pointer to the node or NULL if there is no such node
+ */
+static rb_node_t* mymap_next_gap(rb_node_t *node, unsigned long size);
+
+/**
+ * Removes region from the cache of recently found regions
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ */
+static inline void mymap_cache_invalidate(map_t *map, map_region_t *region);
+
+/**
+ * Moves physical address by given offset. NULL means the region is not
+ * backed by any physical memory and stays NULL.
+ * @param paddr Physical address
+ * @param offset Offset in bytes
+ * @return Physical address after the move
+ */
+static inline void* mymap_paddr_offset(void *paddr, unsigned long offset);
+
+/**
+ * Sets size of the gap before the region and updates largest gaps of the
+ * subtrees containing it
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @param gap New size of the gap
+ */
+static inline void mymap_set_gap(map_t *map, map_region_t *region,
+        unsigned long gap);
+
+/**
+ * Sets size of the gap between the last region and the end of the address
+ * space
+ * @param map Pointer to the map instance
+ * @param gap New size of the gap
+ */
+static inline void mymap_set_last_gap(map_t *map, unsigned long gap);
+
+/**
+ * Adds gap before the region to the index of gaps unless it's empty (does
+ * nothing unless MYMAP_GAP_INDEX is defined)
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ */
+static inline void mymap_gap_index_insert(map_t *map, map_region_t *region);
+
+/**
+ * Removes gap before the region from the index of gaps unless it's empty
+ * (does nothing unless MYMAP_GAP_INDEX is defined)
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ */
+static inline void mymap_gap_index_remove(map_t *map, map_region_t *region);
+
+/**
+ * Adds gap which has appeared in the address space to its accounting
+ * @param map Pointer to the map instance
+ * @param gap Size of the gap (empty gaps are ignored)
+ */
+static inline void mymap_space_add_gap(map_t *map, unsigned long gap);
+
+/**
+ * Removes gap which has disappeared from the address space from its
+ * accounting
+ * @param map Pointer to the map instance
+ * @param gap Size of the gap (empty gaps are ignored)
+ */
+static inline void mymap_space_remove_gap(map_t *map, unsigned long gap);
+
+/**
+ * Returns size class of a gap, i.e. floor(log2(gap))
+ * @param gap Size of the gap (nonzero)
+ * @return Class of the gap
+ */
+static inline unsigned mymap_gap_class(unsigned long gap);
+
+#ifdef MYMAP_GAP_INDEX
+/**
+ * Returns the first gap in the index of at least given size, i.e. the lowest
+ * one of the smallest such gaps
+ * @param map Pointer to the map instance
+ * @param size Minimum size of the gap
+ * @return Node of the index or NULL if there is no such gap
+ */
+static rb_node_t* mymap_gap_index_lower_bound(map_t *map, unsigned long size);
+
+/**
+ * Counts gaps in the index of at least given size
+ * @param map Pointer to the map instance
+ * @param size Minimum size of the gaps
+ * @return Number of the gaps
+ */
+static unsigned long mymap_gap_index_count(map_t *map, unsigned long size);
+
+/**
+ * Recomputes numbers of gaps in the subtrees of the node and its ancestors up
+ * to (but excluding) stop node
+ * @param node Pointer to the node
+ * @param stop Pointer to the node to stop at
+ */
+static void mymap_gap_count_propagate(rb_node_t *node, rb_node_t *stop);
+
+/**
+ * Updates numbers of gaps in the subtrees after rotation
+ * @param old Node which was the root of the rotated subtree
+ * @param new Node which took its place
+ */
+static void mymap_gap_count_rotate(rb_node_t *old, rb_node_t *new);
+#endif
+
+/**
+ * Computes size of the largest gap in the subtree from the gap of its root and
+ * largest gaps stored in its children
+ * @param node Pointer to the root of the subtree
+ * @return Size of the largest gap in the subtree
+ */
+static inline unsigned long mymap_subtree_max_gap(rb_node_t *node);
+
+/**
+ * Sorts batched operations by their addresses. Sort is stable, so operations
+ * with equal addresses stay in order of appearance in the array.
+ * @param ops Array of pointers to the operations
+ * @param tmp Temporary array of the same size
+ * @param count Number of operations
+ * @return Pointer to the sorted array (either ops or tmp)
+ */
+static map_op_t** mymap_sort_ops(map_op_t **ops, map_op_t **tmp,
+        size_t count);
+
+/**
+ * Recomputes largest gaps marked as dirty while their updates were deferred
+ * @param node Pointer to the root of the subtree to fix
+ */
+static void mymap_fix_dirty_gaps(rb_node_t *node);
+
+/**
+ * Marks largest gaps of the node and its ancestors as dirty
+ * @param node Pointer to the first node to mark
+ * @param stop Pointer to the ancestor where marking stops (NULL to mark the
+ * whole path up to the root)
+ */
+static inline void mymap_mark_dirty(rb_node_t *node, rb_node_t *stop);
+
+/**
+ * Links regions stored in consecutive pool objects into a balanced subtree.
+ * Nodes at the deepest, incomplete level are red and all other are black, so
+ * the result is a valid red-black tree.
+ * @param objs Pointer to the pool objects holding regions sorted by virtual
+ * address with gaps already set
+ * @param count Number of regions
+ * @param depth Depth of the root of the subtree
+ * @param red_depth Depth of the incomplete level of the whole tree
+ * @return Pointer to the root of the subtree or NULL if it is empty
+ */
+static rb_node_t* mymap_build_subtree(map_pool_obj_t *objs, size_t count,
+        unsigned depth, unsigned red_depth);
+
+/* Callbacks maintaining largest gaps (see rb_augment_t) */
+static void mymap_augment_propagate(rb_node_t *node, rb_node_t *stop);
+static inline void mymap_tree_propagate(rb_tree_t *tree, rb_node_t *node,
+        rb_node_t *stop);
+static void mymap_augment_copy(rb_node_t *old, rb_node_t *new);
+static void mymap_augment_rotate(rb_node_t *old, rb_node_t *new);
+
+/**
+ * Finds the lowest unmapped area of given size at or above suggested address
+ * @param map Pointer to the map instance
+ * @param vaddr Suggested virtual address
+ * @param size Size of the area (including alignment slack)
+ * @return Address of the area or MYMAP_FAILED if there is no such area
+ */
+static void* mymap_get_unmapped_area_bottomup(map_t *map, void *vaddr,
+        unsigned long size);
+
+/**
+ * Finds the highest aligned unmapped area of given size starting at or below
+ * suggested address
+ * @param map Pointer to the map instance
+ * @param vaddr Suggested virtual address (NULL if there is no limit)
+ * @param size Size of the area
+ * @param align Alignment of the area (power of two)
+ * @return Address of the area or MYMAP_FAILED if there is no such area
+ */
+static void* mymap_get_unmapped_area_topdown(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align);
+
+/**
+ * Finds aligned unmapped area of given size at suggested address or in the
+ * smallest gap it fits in
+ * @param map Pointer to the map instance
+ * @param vaddr Suggested virtual address (NULL if there is none)
+ * @param size Size of the area
+ * @param align Alignment of the area (power of two)
+ * @return Address of the area or MYMAP_FAILED if there is no such area
+ */
+static void* mymap_get_unmapped_area_best_fit(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align);
+
+/**
+ * Finds the smallest gap the area fits in (see map_best_fit_t). Every gap
+ * which could fit the area is checked in order of sizes with the index of
+ * gaps or in order of addresses otherwise.
+ * @param map Pointer to the map instance
+ * @param best Area to fit in, the best gap is stored here
+ * @param last_gap Usable size of the last gap
+ */
+static void mymap_best_gap(map_t *map, map_best_fit_t *best,
+        unsigned long last_gap);
+
+/**
+ * Checks whether the area fits in the gap better than in the best gap found
+ * so far (map_gap_fn_t used by best-fit search)
+ * @param arg Pointer to the best gap found so far
+ * @param start Beginning of the gap
+ * @param size Usable size of the gap
+ * @return Nonzero if the area fits exactly, so the search can stop
+ */
+static int mymap_best_fit_check(void *arg, void *start, size_t size);
+
+#ifndef MYMAP_GAP_INDEX
+/**
+ * Counts gaps (map_gap_fn_t used without the index of gaps)
+ * @param arg Pointer to the number of gaps
+ * @param start Beginning of the gap
+ * @param size Size of the gap
+ * @return Zero, so that all gaps are counted
+ */
+static int mymap_count_gap(void *arg, void *start, size_t size);
+#endif
+
+/**
+ * Finds the highest aligned area of given size in the gap after the last
+ * region which doesn't begin above suggested address
+ * @param map Pointer to the map instance
+ * @param vaddr Highest acceptable beginning of the area
+ * @param size Size of the area
+ * @param align Alignment of the area (power of two)
+ * @return Address of the area or MYMAP_FAILED if it doesn't fit there
+ */
+static inline void* mymap_check_last_gap_topdown(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align);
+
+/* TODO: Comment */
+static inline void* mymap_check_last_gap(map_t *map, void *vaddr,
+        unsigned long size);
+static void mymap_print_region(rb_node_t *node);
+
+/**
+ * Formats line describing the region for flat dumps
+ * @param pos Place the line is written to (at least MYMAP_DUMP_LINE_SIZE
+ * bytes long)
+ * @param region Pointer to the region
+ * @return Pointer to the first byte after the line
+ */
+static char* mymap_format_region(char *pos, map_region_t *region);
+
+/**
+ * Writes address as hexadecimal number with all digits of a pointer
+ * @param pos Place the number is written to
+ * @param addr Address
+ * @return Pointer to the first byte after the number
+ */
+static inline char* mymap_format_addr(char *pos, void *addr);
+
+/**
+ * Writer of flat dumps passing the output to a file descriptor
+ * @param arg Pointer to the file descriptor
+ * @param buf Output
+ * @param len Length of the output
+ * @return Returns zero if the whole output was written
+ */
+static int mymap_write_fd(void *arg, const char *buf, size_t len);
+
+/**
+ * Passes record of an operation to the trace function of the map
+ * @param map Pointer to the map instance
+ * @param op Operation
+ * @param vaddr Virtual address passed to the operation
+ * @param size Size or length passed to the operation
+ * @param align Alignment passed to the operation (power of two)
+ * @param flags Memory region flags or policy
+ * @param paddr Physical address passed to the operation
+ * @param result Result of the operation
+ */
+static void mymap_trace(map_t *map, map_trace_op_t op, void *vaddr,
+        size_t size, unsigned long align, unsigned int flags, void *paddr,
+        void *result);
+
+/* Private variables -------------------------------------------------------- */
+static const rb_augment_t mymap_augment = {
+    .propagate = mymap_augment_propagate,
+    .copy = mymap_augment_copy,
+    .rotate = mymap_augment_rotate,
+};
+
+/* Tree of regions specialized for map_region_t. Regions are searched by any
+ * address they contain. */
+RB_GENERATE_STATIC(mymap_rb, map_region_t, rb_node, void*,
+        mymap_belongs_to_region, MYMAP_RB_PROPAGATE, MYMAP_RB_COPY,
+        MYMAP_RB_ROTATE)
+
+#ifdef MYMAP_GAP_INDEX
+/* Index of gaps ordered by size and address. Nodes count the gaps in their
+ * subtrees. Its rebalancing isn't part of the statistics, which describe the
+ * tree of regions. */
+#undef RB_GEN_EVENT
+#define RB_GEN_EVENT(t, event)  ((void)0)
+RB_GENERATE_AUGMENTED(mymap_gap_rb, MYMAP_GAP_PROPAGATE, MYMAP_GAP_COPY,
+        MYMAP_GAP_ROTATE, static inline)
+#endif
+
+/* Exported functions ------------------------------------------------------- */
+int mymap_init(map_t *map) {
+    int i;
+
+    if (map == NULL) return MYMAP_ERR;
+
+    /* Initialize red-black tree of mapped regions. Every node keeps size of
+     * the largest gap in its subtree, which has to be maintained whenever the
+     * tree changes. */
+    if (rb_init_augmented(&map->rb_tree, &mymap_augment) != RB_OK)
+        return MYMAP_ERR;
+#ifdef MYMAP_GAP_INDEX
+    if (rb_init(&map->gap_index) != RB_OK) return MYMAP_ERR;
+#endif
+    map->backend = MYMAP_RBTREE;
+    map->btree.root = NULL;
+    map->btree.height = 0;
+    map->btree.spare = NULL;
+    map->btree.spare_count = 0;
+
+    /* Whole address space is unmapped */
+    memset(&map->space, 0, sizeof(map_space_t));
+    map->va_base = MYMAP_VA_BASE;
+    map->va_end = MYMAP_VA_END;
+    map->last_gap = 0;
+    mymap_set_last_gap(map, MYMAP_VA_END - MYMAP_VA_BASE + 1);
+
+    map->policy = MYMAP_BOTTOM_UP;
+    map->coalesce = 0;
+    map->deferred = 0;
+
+    /* Nothing has been looked up yet */
+    for (i = 0; i < MYMAP_CACHE_SIZE; i++) map->cache.regions[i] = NULL;
+    map->cache.hits = 0;
+    map->cache.misses = 0;
+
+    /* Operations are not recorded until a trace function is set */
+    map->trace = NULL;
+    map->trace_arg = NULL;
+
+    /* Maps are not thread-safe unless it's explicitly enabled */
+    map->thread_safe = 0;
+    map->generation = 0;
+
+#ifdef MYMAP_STATS
+    mymap_reset_stats(map);
+#endif
+
+    /* Region descriptors are allocated one by one unless the pool gets
+     * enabled */
+    map->pool.slabs = NULL;
+    map->pool.free = NULL;
+    map->pool.next = NULL;
+    map->pool.end = NULL;
+    map->pool.slab_size = 0;
+
+    return MYMAP_OK;
+}
+
+int mymap_init_range(map_t *map, void *va_base, void *va_end) {
+
+    if (mymap_init(map) != MYMAP_OK) return MYMAP_ERR;
+
+    return mymap_set_range(map, va_base, va_end);
+}
+
+int mymap_init_pool(map_t *map, size_t slab_size) {
+
+    if (mymap_init(map) != MYMAP_OK) return MYMAP_ERR;
+
+    map->pool.slab_size = (slab_size > 0) ? slab_size : MYMAP_POOL_SLAB_SIZE;
+
+    return MYMAP_OK;
+}
+
+int mymap_enable_locking(map_t *map) {
+
+    if (map == NULL) return MYMAP_ERR;
+    if (map->thread_safe) return MYMAP_OK;
+
+    if (MYMAP_RWLOCK_INIT(&map->lock) != 0) return MYMAP_ERR;
+    map->thread_safe = 1;
+
+    return MYMAP_OK;
+}
+
+int mymap_enable_coalescing(map_t *map) {
+
+    if (map == NULL) return MYMAP_ERR;
+
+    MYMAP_WRITE_LOCK(map);
+    map->coalesce = 1;
+    MYMAP_TRACE(map, MYMAP_TRACE_COALESCING, NULL, 0, 1, 0, NULL, NULL);
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+}
+
+void mymap_destroy(map_t *map) {
+    rb_node_t *node, *parent;
+    map_slab_t *slab;
+
+    if (map == NULL) return;
+
+    if (map->thread_safe) MYMAP_RWLOCK_DESTROY(&map->lock);
+
+    /* Nodes of the B-tree are separate from the regions. Regions which don't
+     * come from the pool are released together with them. */
+    if (map->backend == MYMAP_BTREE) {
+        mymap_btree_destroy(map, (map->pool.slab_size > 0) ?
+                NULL : mymap_destroy_region);
+    }
+
+    if (map->pool.slab_size > 0) {
+
+        /* All descriptors come from the slabs, so it's enough to release
+         * them */
+        while (map->pool.slabs != NULL) {
+            slab = map->pool.slabs;
+            map->pool.slabs = slab->next;
+            MYMAP_FREE(slab);
+        }
+
+    } else if (map->backend == MYMAP_RBTREE) {
+
+        /* Release regions in post-order, detaching each of them from its
+         * parent first, so no recursion is needed */
+        node = map->rb_tree.root;
+        while (node != NULL) {
+            if (node->left != NULL) {
+                node = node->left;
+            } else if (node->right != NULL) {
+                node = node->right;
+            } else {
+                parent = RB_PARENT(node);
+                if (parent != NULL) {
+                    if (parent->left == node) {
+                        parent->left = NULL;
+                    } else {
+                        parent->right = NULL;
+                    }
+                }
+                MYMAP_FREE(RB_REGION(node));
+                node = parent;
+            }
+        }
+    }
+
+    mymap_init(map);
+}
+
+int mymap_build_sorted(map_t *map, const map_region_desc_t *regions,
+        size_t count) {
+    size_t i;
+    int ret;
+
+    if (map == NULL) return MYMAP_ERR;
+
+    ret = _mymap_build_sorted(map, regions, count);
+    if (map->trace != NULL && (regions != NULL || count == 0)) {
+        mymap_trace(map, MYMAP_TRACE_BUILD, NULL, count, 1, 0, NULL,
+                (ret == MYMAP_OK) ? NULL : MYMAP_FAILED);
+        for (i = 0; i < count; i++) {
+            mymap_trace(map, MYMAP_TRACE_REGION, regions[i].vaddr,
+                    regions[i].vend - regions[i].vaddr, 1, regions[i].flags,
+                    regions[i].paddr, regions[i].vaddr);
+        }
+    }
+
+    return ret;
+}
+
+int mymap_set_range(map_t *map, void *va_base, void *va_end) {
+
+    if (map == NULL || !mymap_is_empty(map)) return MYMAP_ERR;
+    if (va_base == NULL || va_end < va_base) return MYMAP_ERR;
+
+    /* Every gap has to fit in the descriptors and differ from the mark of
+     * dirty largest gaps. The end of the last region has to be a valid
+     * address too. */
+    if ((unsigned long)(va_end - va_base) >= MYMAP_GAP_MAX - 1)
+        return MYMAP_ERR;
+    if ((uintptr_t)va_end == UINTPTR_MAX) return MYMAP_ERR;
+
+    map->va_base = va_base;
+    map->va_end = va_end;
+    mymap_set_last_gap(map, va_end - va_base + 1);
+
+    return MYMAP_OK;
+}
+
+int mymap_set_backend(map_t *map, map_backend_t backend) {
+
+    if (map == NULL || !mymap_is_empty(map)) return MYMAP_ERR;
+
+    switch (backend) {
+    case MYMAP_RBTREE:
+    case MYMAP_BTREE:
+        map->backend = backend;
+        return MYMAP_OK;
+    default:
+        return MYMAP_ERR;
+    }
+}
+
+int mymap_set_policy(map_t *map, map_policy_t policy) {
+
+    if (map == NULL) return MYMAP_ERR;
+
+    switch (policy) {
+    case MYMAP_BOTTOM_UP:
+    case MYMAP_TOP_DOWN:
+
+    /* Without the index of gaps best fit would have to visit every gap the
+     * area fits in */
+#ifdef MYMAP_GAP_INDEX
+    case MYMAP_BEST_FIT:
+#endif
+        MYMAP_WRITE_LOCK(map);
+        map->policy = policy;
+        MYMAP_TRACE(map, MYMAP_TRACE_POLICY, NULL, 0, 1, policy, NULL, NULL);
+        MYMAP_UNLOCK(map);
+        return MYMAP_OK;
+    default:
+        return MYMAP_ERR;
+    }
+}
+
+int mymap_set_trace(map_t *map, map_trace_fn_t trace, void *arg) {
+    map_region_t *region;
+
+    if (map == NULL) return MYMAP_ERR;
+
+    MYMAP_WRITE_LOCK(map);
+    map->trace = trace;
+    map->trace_arg = arg;
+
+    /* Start with the current state of the map, so that the trace doesn't
+     * depend on anything done before */
+    MYMAP_TRACE(map, MYMAP_TRACE_INIT, map->va_base, 0, 1, map->policy, NULL,
+            map->va_end);
+    if (trace != NULL) {
+        for (region = mymap_lower_bound(map, map->va_base); region != NULL;
+                region = mymap_next(map, region)) {
+            mymap_trace(map, MYMAP_TRACE_REGION, region->vaddr,
+                    region->vend - region->vaddr, 1, region->flags,
+                    region->paddr, region->vaddr);
+        }
+    }
+    if (map->coalesce) {
+        MYMAP_TRACE(map, MYMAP_TRACE_COALESCING, NULL, 0, 1, 0, NULL, NULL);
+    }
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+}
+
+void mymap_trace_write(void *file, const map_trace_rec_t *rec) {
+    fwrite(rec, sizeof(map_trace_rec_t), 1, file);
+}
+
+int mymap_get_stats(map_t *map, map_stats_t *stats) {
+
+    if (map == NULL || stats == NULL) return MYMAP_ERR;
+
+#ifdef MYMAP_STATS
+    MYMAP_READ_LOCK(map);
+    *stats = map->stats;
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+#else
+    return MYMAP_ERR;
+#endif
+}
+
+int mymap_reset_stats(map_t *map) {
+
+    if (map == NULL) return MYMAP_ERR;
+
+#ifdef MYMAP_STATS
+    MYMAP_WRITE_LOCK(map);
+    memset(&map->stats, 0, sizeof(map_stats_t));
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+#else
+    return MYMAP_ERR;
+#endif
+}
+
+int mymap_for_each_region_from(map_t *map, void *vaddr, map_region_fn_t fn,
+        void *arg) {
+    map_region_t *region;
+
+    if (map == NULL || fn == NULL) return MYMAP_ERR;
+
+    MYMAP_READ_LOCK(map);
+    if (map->backend == MYMAP_BTREE) {
+        mymap_btree_for_each_region(map, vaddr, fn, arg);
+    } else {
+        for (region = mymap_lower_bound(map, vaddr); region != NULL;
+                region = mymap_next(map, region)) {
+            if (fn(arg, region) != 0) break;
+        }
+    }
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+}
+
+int mymap_for_each_gap(map_t *map, size_t min_size, map_gap_fn_t fn,
+        void *arg) {
+    rb_node_t *node;
+    int ret = 0;
+
+    if (map == NULL || fn == NULL) return MYMAP_ERR;
+    if (min_size == 0) min_size = 1;
+
+    MYMAP_READ_LOCK(map);
+    if (map->backend == MYMAP_BTREE) {
+        ret = mymap_btree_for_each_gap(map, min_size, fn, arg);
+    } else {
+        for (node = mymap_first_gap(map->rb_tree.root, min_size);
+                node != NULL; node = mymap_next_gap(node, min_size)) {
+            ret = fn(arg, RB_GAP_START(node), RB_GAP(node));
+            if (ret != 0) break;
+        }
+    }
+
+    /* The last gap isn't kept in the tree */
+    if (ret == 0 && map->last_gap >= min_size) {
+        fn(arg, (void*)((uintptr_t)map->va_end - map->last_gap + 1),
+                map->last_gap);
+    }
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+}
+
+int mymap_dump(map_t *map) {
+
+    if (map == NULL) return MYMAP_ERR;
+
+    MYMAP_READ_LOCK(map);
+    if (mymap_is_empty(map)) {
+        MYMAP_PRINTF("The map is empty.\n");
+    } else if (map->backend == MYMAP_BTREE) {
+        mymap_btree_dump(map);
+    } else {
+        rb_print_subtree(map->rb_tree.root, mymap_print_region);
+    }
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+}
+
+int mymap_dump_regions(map_t *map, map_writer_t writer, void *arg) {
+    char buffer[MYMAP_DUMP_BUFFER_SIZE], *pos = buffer;
+    map_region_t *region;
+    int ret = MYMAP_OK;
+
+    if (map == NULL || writer == NULL) return MYMAP_ERR;
+
+    MYMAP_READ_LOCK(map);
+    for (region = mymap_lower_bound(map, map->va_base); region != NULL;
+            region = mymap_next(map, region)) {
+
+        /* Pass the buffer on once there's no room for another line */
+        if (pos + MYMAP_DUMP_LINE_SIZE > buffer + sizeof(buffer)) {
+            if (writer(arg, buffer, pos - buffer) != 0) {
+                ret = MYMAP_ERR;
+                break;
+            }
+            pos = buffer;
+        }
+        pos = mymap_format_region(pos, region);
+    }
+    if (ret == MYMAP_OK && pos > buffer && writer(arg, buffer, pos - buffer))
+        ret = MYMAP_ERR;
+    MYMAP_UNLOCK(map);
+
+    return ret;
+}
+
+int mymap_dump_fd(map_t *map, int fd) {
+    return mymap_dump_regions(map, mymap_write_fd, &fd);
+}
+
+void *mymap_mmap(map_t *map, void *vaddr, size_t size, unsigned int flags,
+        void *o) {
+    return mymap_mmap_aligned(map, vaddr, size, 1, flags, o);
+}
+
+void *mymap_mmap_aligned(map_t *map, void *vaddr, size_t size,
+        unsigned long align, unsigned int flags, void *o) {
+    unsigned long generation;
+    void *area;
+
+    if (map == NULL || size == 0) return MYMAP_FAILED;
+    if (!map->thread_safe) {
+        area = _mymap_mmap(map, vaddr, size, align, flags, o);
+        MYMAP_TRACE(map, MYMAP_TRACE_MMAP, vaddr, size, align, flags, o, area);
+        return area;
+    }
+
+    /* Search for unmapped area under the shared lock, so that searches don't
+     * block lookups and each other. If there's no such area, the map is full
+     * and there's no need to take the lock exclusively. */
+    MYMAP_READ_LOCK(map);
+    area = _mymap_get_unmapped_area(map, vaddr, size, align);
+    generation = map->generation;
+    if (area == MYMAP_FAILED) {
+        MYMAP_TRACE(map, MYMAP_TRACE_MMAP, vaddr, size, align, flags, o, area);
+    }
+    MYMAP_UNLOCK(map);
+    if (area == MYMAP_FAILED) return MYMAP_FAILED;
+
+    /* Another thread could have changed the map (or its policy) before the
+     * lock was taken exclusively. Even if the area is still unmapped, a better
+     * one may have been freed, so search again unless this is the first
+     * exclusive locking since the search. */
+    MYMAP_WRITE_LOCK(map);
+    if (map->generation != generation + 1) {
+        area = _mymap_get_unmapped_area(map, vaddr, size, align);
+    }
+    if (area != MYMAP_FAILED) area = mymap_map_area(map, area, size, flags, o);
+    MYMAP_TRACE(map, MYMAP_TRACE_MMAP, vaddr, size, align, flags, o, area);
+    MYMAP_UNLOCK(map);
+
+    return area;
+}
+
+map_region_t* mymap_find(map_t *map, void *vaddr) {
+    map_region_t *region;
+
+    if (map == NULL) return NULL;
+    if (!map->thread_safe) return _mymap_find(map, vaddr);
+
+    MYMAP_READ_LOCK(map);
+    region = mymap_lookup(map, vaddr);
+    MYMAP_UNLOCK(map);
+
+    return region;
+}
+
+int mymap_find_copy(map_t *map, void *vaddr, map_region_desc_t *desc) {
+    map_region_t *region;
+
+    if (map == NULL || desc == NULL) return MYMAP_ERR;
+
+    MYMAP_READ_LOCK(map);
+    region = (map->thread_safe) ? mymap_lookup(map, vaddr)
+            : _mymap_find(map, vaddr);
+    if (region != NULL) {
+        desc->paddr = region->paddr;
+        desc->vaddr = region->vaddr;
+        desc->vend = region->vend;
+        desc->flags = region->flags;
+    }
+    MYMAP_UNLOCK(map);
+
+    return (region != NULL) ? MYMAP_OK : MYMAP_ERR;
+}
+
+void mymap_munmap(map_t *map, void *vaddr) {
+    map_region_t *region;
+
+    if (map == NULL) return;
+
+    MYMAP_WRITE_LOCK(map);
+
+    /* Find region this address belongs to. If there is none, there's nothing
+     * to do. */
+    region = _mymap_find(map, vaddr);
+    if (region != NULL) {
+        MYMAP_TRACE(map, MYMAP_TRACE_MUNMAP, vaddr, 0, 1, 0, NULL,
+                region->vaddr);
+
+        /* Remove region from the tree and destroy it */
+        mymap_remove_region(map, region);
+        mymap_destroy_region(map, region);
+    } else {
+        MYMAP_TRACE(map, MYMAP_TRACE_MUNMAP, vaddr, 0, 1, 0, NULL,
+                MYMAP_FAILED);
+    }
+
+    MYMAP_UNLOCK(map);
+}
+
+int mymap_munmap_range(map_t *map, void *vaddr, size_t len) {
+    int ret;
+
+    if (map == NULL) return MYMAP_ERR;
+
+    MYMAP_WRITE_LOCK(map);
+    ret = _mymap_munmap_range(map, vaddr, len);
+    MYMAP_TRACE(map, MYMAP_TRACE_MUNMAP_RANGE, vaddr, len, 1, 0, NULL,
+            (ret == MYMAP_OK) ? NULL : MYMAP_FAILED);
+    MYMAP_UNLOCK(map);
+
+    return ret;
+}
+
+int mymap_mprotect(map_t *map, void *vaddr, size_t len,
+        unsigned int flags) {
+    int ret;
+
+    if (map == NULL) return MYMAP_ERR;
+
+    MYMAP_WRITE_LOCK(map);
+    ret = _mymap_mprotect(map, vaddr, len, flags);
+    MYMAP_TRACE(map, MYMAP_TRACE_MPROTECT, vaddr, len, 1, flags, NULL,
+            (ret == MYMAP_OK) ? NULL : MYMAP_FAILED);
+    MYMAP_UNLOCK(map);
+
+    return ret;
+}
+
+int mymap_batch(map_t *map, map_op_t *ops, size_t count) {
+    size_t i;
+    int ret;
+
+    if (map == NULL) return MYMAP_ERR;
+
+    MYMAP_WRITE_LOCK(map);
+    ret = _mymap_batch(map, ops, count);
+    if (map->trace != NULL && (ops != NULL || count == 0)) {
+        mymap_trace(map, MYMAP_TRACE_BATCH, NULL, count, 1, 0, NULL,
+                (ret == MYMAP_OK) ? NULL : MYMAP_FAILED);
+        for (i = 0; i < count; i++) {
+            mymap_trace(map, (ops[i].type == MYMAP_OP_MMAP) ? MYMAP_TRACE_MMAP
+                    : MYMAP_TRACE_MUNMAP, ops[i].vaddr, ops[i].size, 1,
+                    ops[i].flags, ops[i].paddr, ops[i].result);
+        }
+    }
+    MYMAP_UNLOCK(map);
+
+    return ret;
+}
+
+map_region_t* mymap_create_region(map_t *map, void *paddr,
+        unsigned int flags) {
+    map_region_t *region;
+
+    if (map == NULL) return NULL;
+
+    MYMAP_WRITE_LOCK(map);
+    region = _mymap_create_region(map, paddr, flags);
+    MYMAP_UNLOCK(map);
+
+    return region;
+}
+
+void* mymap_get_unmapped_area(map_t *map, void *vaddr, size_t size) {
+    return mymap_get_unmapped_area_aligned(map, vaddr, size, 1);
+}
+
+void* mymap_get_unmapped_area_aligned(map_t *map, void *vaddr,
+        size_t size, unsigned long align) {
+    void *addr;
+
+    if (map == NULL) return MYMAP_FAILED;
+
+    MYMAP_READ_LOCK(map);
+    addr = _mymap_get_unmapped_area(map, vaddr, size, align);
+    MYMAP_TRACE(map, MYMAP_TRACE_UNMAPPED_AREA, vaddr, size, align, 0, NULL,
+            addr);
+    MYMAP_UNLOCK(map);
+
+    return addr;
+}
+
+void* mymap_smallest_gap(map_t *map, size_t min_size, size_t *size) {
+    map_best_fit_t best;
+
+    if (map == NULL) return MYMAP_FAILED;
+
+    best.size = (min_size > 0) ? min_size : 1;
+    best.align = 1;
+    best.addr = MYMAP_FAILED;
+    best.gap = 0;
+
+    MYMAP_READ_LOCK(map);
+    mymap_best_gap(map, &best, map->last_gap);
+    MYMAP_UNLOCK(map);
+
+    if (size != NULL) *size = best.gap;
+
+    return best.addr;
+}
+
+void* mymap_largest_gap(map_t *map, size_t *size) {
+    map_best_fit_t best;
+
+    if (map == NULL) return MYMAP_FAILED;
+
+    best.align = 1;
+    best.addr = MYMAP_FAILED;
+    best.gap = 0;
+
+    /* Root of the tree knows the size of the largest gap, so only the first
+     * gap of that size has to be found */
+    MYMAP_READ_LOCK(map);
+    if (map->backend == MYMAP_BTREE) {
+        best.size = mymap_btree_max_gap(map);
+    } else {
+        best.size = RB_EMPTY(&map->rb_tree) ? 0
+                : RB_MAX_GAP(map->rb_tree.root);
+    }
+    if (map->last_gap > best.size) best.size = map->last_gap;
+    if (best.size > 0) mymap_best_gap(map, &best, map->last_gap);
+    MYMAP_UNLOCK(map);
+
+    if (size != NULL) *size = best.gap;
+
+    return best.addr;
+}
+
+size_t mymap_count_gaps(map_t *map, size_t min_size) {
+    size_t count = 0;
+
+    if (map == NULL) return 0;
+    if (min_size == 0) min_size = 1;
+
+#ifdef MYMAP_GAP_INDEX
+    MYMAP_READ_LOCK(map);
+    count = mymap_gap_index_count(map, min_size);
+    if (map->last_gap >= min_size) count++;
+    MYMAP_UNLOCK(map);
+#else
+    mymap_for_each_gap(map, min_size, mymap_count_gap, &count);
+#endif
+
+    return count;
+}
+
+int mymap_get_space(map_t *map, map_space_t *space) {
+
+    if (map == NULL || space == NULL) return MYMAP_ERR;
+
+    /* Only the size of the address space and the largest gap at the root of
+     * the tree are needed to complete the accounting */
+    MYMAP_READ_LOCK(map);
+    *space = map->space;
+    space->mapped = (size_t)(map->va_end - map->va_base) + 1 - space->unmapped;
+    if (map->backend == MYMAP_BTREE) {
+        space->largest_gap = mymap_btree_max_gap(map);
+    } else {
+        space->largest_gap = RB_EMPTY(&map->rb_tree) ? 0
+                : RB_MAX_GAP(map->rb_tree.root);
+    }
+    if (map->last_gap > space->largest_gap)
+        space->largest_gap = map->last_gap;
+    MYMAP_UNLOCK(map);
+
+    return MYMAP_OK;
+}
+
+/* Private functions -------------------------------------------------------- */
+static void* _mymap_mmap(map_t *map, void *vaddr, size_t size,
+        unsigned long align, unsigned int flags, void *o) {
+
+    /* Find unmapped area fulfilling all requirements */
+    vaddr = _mymap_get_unmapped_area(map, vaddr, size, align);
+    if (vaddr == MYMAP_FAILED) return MYMAP_FAILED;
+
+    return mymap_map_area(map, vaddr, size, flags, o);
+}
+
+static void* mymap_map_area(map_t *map, void *vaddr, size_t size,
+        unsigned int flags, void *o) {
+    map_region_t *region;
+
+    if (map->coalesce && mymap_merge_area(map, vaddr, size, flags, o))
+        return vaddr;
+
+    region = _mymap_create_region(map, o, flags);
+    if (region == NULL) return MYMAP_FAILED;
+
+    region->vaddr = vaddr;
+    region->vend = vaddr + size;
+
+    /* Insert new region into the tree */
+    if (mymap_insert_region(map, region) != MYMAP_OK) {
+        mymap_destroy_region(map, region); /* Clean up */
+        return MYMAP_FAILED;
+    }
+
+    /* Return virtual address the region was mapped to */
+    return region->vaddr;
+}
+
+static bool mymap_merge_area(map_t *map, void *vaddr, size_t size,
+        unsigned int flags, void *o) {
+    map_region_t *prev, *next;
+
+    /* Find regions around the area. The first region ending at or after the
+     * beginning of the area is either the one right before it or, since the
+     * area is unmapped, the first one after it. */
+    prev = mymap_lower_bound(map, vaddr - 1);
+    if (prev != NULL && prev->vend == vaddr) {
+        next = mymap_next(map, prev);
+    } else {
+        next = prev;
+        prev = NULL;
+    }
+
+    /* Keep the next region only if it continues the area */
+    if (next != NULL && (next->vaddr != vaddr + size || next->flags != flags
+            || mymap_paddr_offset(o, size) != next->paddr)) {
+        next = NULL;
+    }
+
+    if (prev != NULL && mymap_can_merge(prev, vaddr, o, flags)) {
+
+        /* Extend the previous region over the area and, if the next region
+         * continues it, over the next region too */
+        prev->vend = vaddr + size;
+        if (next != NULL) {
+            mymap_merge_next(map, prev);
+        } else {
+            next = mymap_next(map, prev);
+            if (next != NULL) {
+                mymap_set_gap(map, next, next->vaddr - prev->vend);
+            } else {
+                mymap_set_last_gap(map, map->va_end - prev->vend + 1);
+            }
+        }
+        return true;
+    }
+
+    if (next != NULL) {
+
+        /* Extend the next region downwards over the area */
+        mymap_move_region(map, next, vaddr);
+        next->paddr = o;
+        mymap_set_gap(map, next, next->gap - size);
+        return true;
+    }
+
+    return false;
+}
+
+static bool mymap_is_unmapped(map_t *map, void *vaddr, size_t size) {
+    map_region_t *region = mymap_lower_bound(map, vaddr);
+
+    return region == NULL || region->vaddr >= vaddr + size;
+}
+
+static map_region_t* _mymap_find(map_t *map, void *vaddr) {
+    map_region_t *region;
+    unsigned long index;
+
+    /* Cached region may have changed since it was found, so it has to be
+     * checked whether it still contains the address */
+    index = MYMAP_CACHE_INDEX(vaddr);
+    region = map->cache.regions[index];
+    if (region != NULL && vaddr >= region->vaddr && vaddr < region->vend) {
+        map->cache.hits++;
+        return region;
+    }
+    map->cache.misses++;
+
+    /* Search the tree */
+    region = mymap_lookup(map, vaddr);
+    if (region == NULL) return NULL;
+
+    map->cache.regions[index] = region;
+    return region;
+}
+
+static int _mymap_munmap_range(map_t *map, void *vaddr, size_t len) {
+    map_region_t *region, *prev;
+    void *end;
+    int deferred;
+
+    if (len == 0) return MYMAP_ERR;
+    if (vaddr > map->va_end) return MYMAP_OK;
+
+    /* Range may reach beyond the end of the address space, but not wrap
+     * around it */
+    end = (len - 1 > (size_t)(map->va_end - vaddr)) ?
+            map->va_end + 1 : vaddr + len;
+
+    /* Find the first region which may overlap with the range */
+    region = mymap_lower_bound(map, vaddr);
+    if (region == NULL || region->vaddr >= end) return MYMAP_OK;
+
+    /* If the range lies inside a single region, punch a hole in it */
+    if (region->vaddr < vaddr && region->vend > end) {
+        map_region_t *tail = mymap_split_region(map, region, end);
+        if (tail == NULL) return MYMAP_ERR;
+        region->vend = vaddr;
+        mymap_set_gap(map, tail, end - vaddr);
+        return MYMAP_OK;
+    }
+
+    /* Largest gaps are fixed once, after all regions inside the range have
+     * been removed */
+    deferred = map->deferred;
+    map->deferred = 1;
+
+    /* Trim the region overlapping with the beginning of the range */
+    if (region->vaddr < vaddr) {
+        region->vend = vaddr;
+        region = mymap_next(map, region);
+    }
+
+    /* Remove regions lying inside the range */
+    if (region != NULL && region->vend <= end) {
+        region = mymap_remove_regions(map, region, end);
+    }
+
+    /* Trim the region overlapping with the end of the range and update the
+     * gap after the range */
+    if (region != NULL) {
+        if (region->vaddr < end) {
+            region->paddr = mymap_paddr_offset(region->paddr,
+                    end - region->vaddr);
+            mymap_move_region(map, region, end);
+        }
+        prev = mymap_prev(map, region);
+        mymap_set_gap(map, region, region->vaddr
+                - ((prev != NULL) ? prev->vend : map->va_base));
+    } else {
+        prev = mymap_last(map);
+        mymap_set_last_gap(map, map->va_end + 1
+                - ((prev != NULL) ? prev->vend : map->va_base));
+    }
+
+    map->deferred = deferred;
+    if (!deferred) mymap_fix_dirty_gaps(map->rb_tree.root);
+
+    return MYMAP_OK;
+}
+
+static int _mymap_mprotect(map_t *map, void *vaddr, size_t len,
+        unsigned int flags) {
+    map_region_t *first, *region, *next;
+    bool split_first = false;
+    void *end;
+    int deferred;
+
+    if (len == 0 || vaddr > map->va_end) return MYMAP_ERR;
+    if (len - 1 > (size_t)(map->va_end - vaddr)) return MYMAP_ERR;
+    end = vaddr + len;
+
+    /* Whole range has to be mapped */
+    first = mymap_lower_bound(map, vaddr);
+    if (first == NULL || first->vaddr > vaddr) return MYMAP_ERR;
+    for (region = first; region->vend < end; region = next) {
+        next = mymap_next(map, region);
+        if (next == NULL || next->vaddr != region->vend) return MYMAP_ERR;
+    }
+
+    /* Split regions at the boundaries of the range. If the second split
+     * fails, the first one is reverted by merging regions back together. */
+    if (first->vaddr < vaddr) {
+        if ((first = mymap_split_region(map, first, vaddr)) == NULL)
+            return MYMAP_ERR;
+        if (region->vaddr < vaddr) region = first;
+        split_first = true;
+    }
+    if (region->vend > end && mymap_split_region(map, region, end) == NULL) {
+        if (split_first) {
+            region = mymap_prev(map, first);
+            if (region != NULL) mymap_merge_next(map, region);
+        }
+        return MYMAP_ERR;
+    }
+
+    /* Flags don't affect the gaps, so they can be changed in place */
+    for (region = first; region != NULL && region->vaddr < end;
+            region = mymap_next(map, region)) {
+        region->flags = flags;
+    }
+
+    /* Regions are merged regardless of coalescing, so changing flags back
+     * undoes the splits made by earlier calls */
+    deferred = map->deferred;
+    map->deferred = 1;
+
+    /* Merge regions in the range together with the neighbours on both
+     * sides */
+    region = mymap_prev(map, first);
+    if (region == NULL) region = first;
+    while ((next = mymap_next(map, region)) != NULL && next->vaddr <= end) {
+        if (!mymap_merge_next(map, region)) region = next;
+    }
+
+    map->deferred = deferred;
+    if (!deferred) mymap_fix_dirty_gaps(map->rb_tree.root);
+
+    return MYMAP_OK;
+}
+
+static int _mymap_batch(map_t *map, map_op_t *ops, size_t count) {
+    map_op_t *buffer[2*MYMAP_BATCH_CHUNK], **sorted, *op;
+    map_region_t *region, *last, *next;
+    size_t start, chunk, i, j;
+    int ret = MYMAP_OK;
+
+    if (ops == NULL && count > 0) return MYMAP_ERR;
+
+    /* Operations are sorted by addresses in chunks, so that the buffer doesn't
+     * have to be allocated. The array itself isn't reordered. */
+    for (start = 0; start < count; start += chunk) {
+        chunk = (count - start < MYMAP_BATCH_CHUNK) ? count - start
+                : MYMAP_BATCH_CHUNK;
+        for (i = 0; i < chunk; i++) buffer[i] = &ops[start + i];
+        sorted = mymap_sort_ops(buffer, buffer + MYMAP_BATCH_CHUNK, chunk);
+
+        for (i = 0; i < chunk; i = j) {
+            op = sorted[i];
+            j = i + 1;
+
+            switch (op->type) {
+            case MYMAP_OP_MMAP:
+                op->result = _mymap_mmap(map, op->vaddr, op->size, 1,
+                        op->flags, op->paddr);
+                break;
+
+            case MYMAP_OP_MUNMAP:
+                region = _mymap_find(map, op->vaddr);
+                if (region == NULL) {
+                    op->result = MYMAP_FAILED;
+                    break;
+                }
+
+                /* Following operations unmapping the regions right after this
+                 * one make up a run, which is removed at once */
+                op->result = region->vaddr;
+                for (last = region; j < chunk
+                        && sorted[j]->type == MYMAP_OP_MUNMAP; j++) {
+                    next = mymap_next(map, last);
+                    if (next == NULL || sorted[j]->vaddr < next->vaddr
+                            || sorted[j]->vaddr >= next->vend) {
+                        break;
+                    }
+                    sorted[j]->result = next->vaddr;
+                    last = next;
+                }
+                if (last == region) {
+                    mymap_remove_region(map, region);
+                    mymap_destroy_region(map, region);
+                } else {
+                    mymap_remove_regions(map, region, last->vend);
+                }
+                break;
+
+            default:
+                op->result = MYMAP_FAILED;
+                break;
+            }
+
+            if (op->result == MYMAP_FAILED) ret = MYMAP_ERR;
+        }
+    }
+
+    return ret;
+}
+
+static int _mymap_build_sorted(map_t *map, const map_region_desc_t *regions,
+        size_t count) {
+    map_slab_t *slab;
+    map_region_t *region;
+    void *prev_end;
+    unsigned red_depth;
+    size_t i;
+
+    if (!mymap_is_empty(map)) return MYMAP_ERR;
+    if (count == 0) return MYMAP_OK;
+    if (regions == NULL) return MYMAP_ERR;
+    prev_end = map->va_base;
+
+    /* Make sure regions are sorted, don't overlap and fit in the address
+     * space */
+    for (i = 0; i < count; i++) {
+        if (regions[i].vaddr < prev_end || regions[i].vend <= regions[i].vaddr
+                || regions[i].vend - 1 > map->va_end) {
+            return MYMAP_ERR;
+        }
+        prev_end = regions[i].vend;
+    }
+
+    /* Allocate all descriptors at once as a single slab of the pool */
+    slab = MYMAP_MALLOC(sizeof(map_slab_t) + count*sizeof(map_pool_obj_t));
+    if (slab == NULL) return MYMAP_ERR;
+    MYMAP_STAT(map, allocations);
+    slab->next = map->pool.slabs;
+    map->pool.slabs = slab;
+
+    /* Fill in the descriptors */
+    prev_end = map->va_base;
+    for (i = 0; i < count; i++) {
+        region = &slab->objs[i].region;
+        region->paddr = regions[i].paddr;
+        region->vaddr = regions[i].vaddr;
+        region->vend = regions[i].vend;
+        region->flags = regions[i].flags;
+        region->gap = regions[i].vaddr - prev_end;
+        prev_end = regions[i].vend;
+    }
+
+    /* Regions come in order, so B-tree is built by appending them one by
+     * one */
+    if (map->backend == MYMAP_BTREE) {
+        for (i = 0; i < count; i++) {
+            if (mymap_btree_insert(map, &slab->objs[i].region) != MYMAP_OK) {
+                mymap_btree_destroy(map, NULL);
+                map->pool.slabs = slab->next;
+                MYMAP_FREE(slab);
+                return MYMAP_ERR;
+            }
+        }
+    } else {
+
+        /* Nodes at depth floor(log2(count + 1)) make up the only incomplete
+         * level of the tree */
+        for (red_depth = 0; ((size_t)2 << red_depth) - 1 <= count;
+                red_depth++);
+
+        map->rb_tree.root = mymap_build_subtree(slab->objs, count, 0,
+                red_depth);
+        RB_SET_PARENT(map->rb_tree.root, NULL);
+    }
+
+    /* Pool is enabled only once the map is built, so that a failed build
+     * leaves it as it was */
+    if (map->pool.slab_size == 0) map->pool.slab_size = MYMAP_POOL_SLAB_SIZE;
+
+    for (i = 0; i < count; i++) {
+        mymap_gap_index_insert(map, &slab->objs[i].region);
+        mymap_space_add_gap(map, slab->objs[i].region.gap);
+    }
+    map->space.regions = count;
+    mymap_set_last_gap(map, map->va_end - prev_end + 1);
+
+    return MYMAP_OK;
+}
+
+static map_region_t* _mymap_create_region(map_t *map, void *paddr,
+        unsigned int flags) {
+    map_region_t *region;
+
+    /* Create and initialize region structure. Node of the red-black tree is
+     * embedded in it, so a single allocation is enough. */
+    if (map->pool.slab_size > 0) {
+        region = mymap_pool_alloc(&map->pool);
+    } else {
+        region = MYMAP_MALLOC(sizeof(map_region_t));
+        if (region != NULL) MYMAP_STAT(map, allocations);
+    }
+    if (region == NULL) return NULL;
+    region->paddr = paddr;
+    region->flags = flags;
+    rb_node_init(&region->rb_node);
+
+    return region;
+}
+
+static void* _mymap_get_unmapped_area(map_t *map, void *vaddr,
+        size_t size, unsigned long align) {
+    void *addr;
+
+    MYMAP_STAT(map, searches);
+
+    /* Alignment has to be a power of two */
+    if (align == 0) align = 1;
+    if ((align & (align - 1)) != 0) return MYMAP_FAILED;
+
+    /* Any gap at least size + align - 1 bytes long can hold aligned area, so
+     * that's what we look for. Make sure it doesn't overflow. */
+    if (align - 1 > SIZE_MAX - size) return MYMAP_FAILED;
+
+    if (map->policy == MYMAP_TOP_DOWN) {
+        return mymap_get_unmapped_area_topdown(map, vaddr, size, align);
+    } else if (map->policy == MYMAP_BEST_FIT) {
+        return mymap_get_unmapped_area_best_fit(map, vaddr, size, align);
+    }
+
+    /* Bottom-up search returns the beginning of the gap (or the suggested
+     * address), so it has to be aligned afterwards */
+    addr = mymap_get_unmapped_area_bottomup(map, vaddr, size + align - 1);
+    if (addr == MYMAP_FAILED) return MYMAP_FAILED;
+
+    return ALIGN_UP(addr, align);
+}
+
+static void* mymap_get_unmapped_area_bottomup(map_t *map, void *vaddr,
+        unsigned long size) {
+    rb_node_t *curr;
+    void *addr;
+
+    if (map->backend == MYMAP_BTREE) {
+        if (vaddr < map->va_base) vaddr = map->va_base;
+        addr = mymap_btree_unmapped_bottomup(map, vaddr, size);
+        if (addr != MYMAP_FAILED) return addr;
+        return mymap_check_last_gap(map, vaddr, size);
+    }
+
+    if (RB_EMPTY(&map->rb_tree) || RB_MAX_GAP(map->rb_tree.root) < size) {
+        /* If tree is empty or maximum gap size at the root is smaller than
+         * requested size, then the last gap is our only chance */
+        return mymap_check_last_gap(map, vaddr, size);
+    }
+
+    if (vaddr < map->va_base) vaddr = map->va_base;
+
+    /* In the first phase we analyze parts of the tree where we have to watch
+     * out both for maximum gap size in subtree and suggested virtual address.
+     * We'll make sure that suggested address is located before current region
+     * before moving to the second phase. */
+    curr = map->rb_tree.root;
+    while (true) {
+
+        int result = mymap_belongs_to_region(vaddr, RB_REGION(curr));
+
+        MYMAP_STAT(map, first_phase_nodes);
+        if (result < 0) { /* vaddr is before the current region */
+
+            if (curr->left == NULL) {
+
+                /* There is no left subtree. Check if we can insert new region
+                 * before the current one */
+                map_region_t *tmp = RB_REGION(curr);
+                if (tmp->gap >= size && (tmp->vaddr - vaddr) >= size) {
+                    return vaddr;
+                } else {
+                    /*  Won't fit here. Go to the second phase. */
+                    break;
+                }
+
+            /* Check if any gap in the left subtree is big enough */
+            } else if (RB_MAX_GAP(curr->left) >= size) {
+                curr = curr->left;
+
+            } else {
+                /* Won't fit into this subtree. Go to the seconds phase. */
+                break;
+            }
+
+        } else if (result == 0) {
+
+            /* vaddr is inside the current region. Move to the next element and
+             * go to the second phase. If no such an element exists, check if we
+             * can place new region after current one (and the last at the same
+             * time). */
+            rb_node_t *next = rb_next(curr);
+            MYMAP_STAT(map, next_calls);
+            if (next == NULL)
+                return mymap_check_last_gap(map, vaddr, size);
+            curr = next;
+            break;
+
+        } else { /* vaddr is after the current region */
+
+            if (curr->right == NULL) {
+
+                /* There is no right subtree. Move to the next element and go to
+                 * the second phase. If no such an element exists, check the
+                 * last gap. */
+                rb_node_t *next = rb_next(curr);
+                MYMAP_STAT(map, next_calls);
+                if (next == NULL)
+                    return mymap_check_last_gap(map, vaddr, size);
+                curr = next;
+                break;
+
+            /* Check if right subtree looks promising */
+            } else if (RB_MAX_GAP(curr->right) < size) {
+
+                /* Move to the next element skipping whole right subtree and go
+                 * to the second phase. If such element doesn't exist, check the
+                 * last gap. */
+                rb_node_t *tmp = rb_subtree_next(curr);
+                MYMAP_STAT(map, subtree_next_calls);
+                if (tmp == NULL)
+                    return mymap_check_last_gap(map, vaddr, size);
+                curr = tmp;
+                break;
+            }
+
+            /* Look deeper into the right subtree */
+            curr = curr->right;
+        }
+    }
+
+    /* In second phase we no longer have to worry about the suggested virtual
+     * address, since in the previous part we made sure that is located before
+     * the current region. */
+    while (true) {
+
+        /* Check if gap before current element is big enough */
+        void *gap_start = RB_GAP_START(curr);
+
+        MYMAP_STAT(map, second_phase_nodes);
+        if (gap_start > vaddr && RB_GAP(curr) >= size) {
+            return gap_start;
+        } else if (gap_start <= vaddr && (RB_VADDR(curr) - vaddr) >= size) {
+            return vaddr;
+        }
+
+        /* Check if there is a gap big enough in the right subtree */
+        if (curr->right && RB_MAX_GAP(curr->right) >= size) {
+
+            curr = curr->right;
+            while (true) {
+
+                MYMAP_STAT(map, second_phase_nodes);
+
+                /* We want to get as close to suggested address as possible and
+                 * therefore we should start with left subtree */
+                if (curr->left && RB_MAX_GAP(curr->left) >= size) {
+                    curr = curr->left;
+
+                /* Check current element */
+                } else if (RB_GAP(curr) >= size) {
+                    return RB_GAP_START(curr);
+
+                /* Check right subtree as a last resort */
+                } else if (curr->right && RB_MAX_GAP(curr->right) >= size) {
+                    curr = curr->right;
+
+                } else {
+                    /* Should never happen unless tree is broken */
+                    return MYMAP_FAILED;
+                }
+            }
+        }
+
+        /* Move to the next element skipping whole right subtree and go
+         * to the second phase. If such element doesn't exist, check the
+         * last gap. */
+        rb_node_t *tmp = rb_subtree_next(curr);
+        MYMAP_STAT(map, subtree_next_calls);
+        if (tmp == NULL)
+            return mymap_check_last_gap(map, vaddr, size);
+        curr = tmp;
+    }
+
+    return NULL;
+}
+
+static void* mymap_get_unmapped_area_topdown(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align) {
+    rb_node_t *curr;
+    void *addr;
+    unsigned long length = size + align - 1; /* Size including alignment
+                                              * slack */
+
+    if (vaddr == NULL || vaddr > map->va_end) vaddr = map->va_end;
+    if (vaddr < map->va_base) return MYMAP_FAILED;
+
+    /* The last gap is the highest one, so it goes first */
+    addr = mymap_check_last_gap_topdown(map, vaddr, size, align);
+    if (addr != MYMAP_FAILED) return addr;
+
+    if (map->backend == MYMAP_BTREE) {
+        return mymap_btree_unmapped_topdown(map, vaddr, size, align);
+    }
+
+    if (RB_EMPTY(&map->rb_tree) || RB_MAX_GAP(map->rb_tree.root) < length) {
+        /* No gap in the tree is big enough */
+        return MYMAP_FAILED;
+    }
+
+    /* This is a mirror image of the bottom-up search. In the first phase we
+     * descend looking for the highest gap starting at or below suggested
+     * address, skipping subtrees which don't have gaps big enough. */
+    curr = map->rb_tree.root;
+    while (true) {
+
+        MYMAP_STAT(map, first_phase_nodes);
+
+        if (vaddr < RB_GAP_START(curr)) {
+
+            /* Gap before current region and all gaps in the right subtree
+             * start above suggested address. Look into the left subtree if it
+             * looks promising or go to the second phase with the previous
+             * element (if there is any). */
+            if (curr->left != NULL && RB_MAX_GAP(curr->left) >= length) {
+                curr = curr->left;
+                continue;
+            }
+
+            curr = rb_subtree_previous(curr);
+            MYMAP_STAT(map, subtree_next_calls);
+            if (curr == NULL) return MYMAP_FAILED;
+            break;
+        }
+
+        /* Gap before current region starts at or below suggested address, but
+         * gaps in the right subtree are higher, so they should be checked
+         * first */
+        if (curr->right != NULL && RB_MAX_GAP(curr->right) >= length) {
+            curr = curr->right;
+            continue;
+        }
+
+        break;
+    }
+
+    /* In the second phase all gaps after the current region have been already
+     * ruled out and all gaps before it start below suggested address */
+    while (true) {
+
+        MYMAP_STAT(map, second_phase_nodes);
+
+        /* Check if gap before current element is big enough taking suggested
+         * address and alignment into account */
+        if (RB_GAP(curr) >= length) {
+            addr = RB_VADDR(curr) - size;
+            if (addr > vaddr) addr = vaddr;
+            if ((unsigned long)(addr - RB_GAP_START(curr))
+                    >= align - 1)
+                return ALIGN_DOWN(addr, align);
+        }
+
+        /* Check if there is a gap big enough in the left subtree. All of them
+         * end below suggested address. */
+        if (curr->left && RB_MAX_GAP(curr->left) >= length) {
+
+            curr = curr->left;
+            while (true) {
+
+                MYMAP_STAT(map, second_phase_nodes);
+
+                /* We want to get as close to suggested address as possible and
+                 * therefore we should start with right subtree */
+                if (curr->right && RB_MAX_GAP(curr->right) >= length) {
+                    curr = curr->right;
+
+                /* Check current element */
+                } else if (RB_GAP(curr) >= length) {
+                    return ALIGN_DOWN(RB_VADDR(curr) - size, align);
+
+                /* Check left subtree as a last resort */
+                } else if (curr->left && RB_MAX_GAP(curr->left) >= length) {
+                    curr = curr->left;
+
+                } else {
+                    /* Should never happen unless tree is broken */
+                    return MYMAP_FAILED;
+                }
+            }
+        }
+
+        /* Move to the previous element skipping whole left subtree */
+        curr = rb_subtree_previous(curr);
+        MYMAP_STAT(map, subtree_next_calls);
+        if (curr == NULL) return MYMAP_FAILED;
+    }
+
+    return NULL;
+}
+
+static void* mymap_get_unmapped_area_best_fit(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align) {
+    map_best_fit_t best;
+
+    /* Suggested address is used as it is if the area there is free */
+    if (vaddr != NULL && vaddr >= map->va_base && vaddr <= map->va_end
+            && ALIGN_DOWN(vaddr, align) == vaddr
+            && (unsigned long)(map->va_end - vaddr) >= size
+            && mymap_is_unmapped(map, vaddr, size)) {
+        return vaddr;
+    }
+
+    best.size = size;
+    best.align = align;
+    best.addr = MYMAP_FAILED;
+    best.gap = 0;
+
+    /* The last byte of the address space can't be mapped */
+    mymap_best_gap(map, &best, (map->last_gap > 0) ? map->last_gap - 1 : 0);
+
+    return best.addr;
+}
+
+static void mymap_best_gap(map_t *map, map_best_fit_t *best,
+        unsigned long last_gap) {
+#ifdef MYMAP_GAP_INDEX
+    map_region_t *region;
+#endif
+    rb_node_t *node;
+
+#ifdef MYMAP_GAP_INDEX
+
+    /* Gaps come in order of sizes and the lowest one of equal gaps goes
+     * first, so the first gap the area fits in is the best one. Only the
+     * alignment may rule out some of the smallest ones. */
+    for (node = mymap_gap_index_lower_bound(map, best->size); node != NULL;
+            node = rb_next(node)) {
+        region = GAP_REGION(node);
+        mymap_best_fit_check(best,
+                (void*)((uintptr_t)region->vaddr - region->gap), region->gap);
+        if (best->addr != MYMAP_FAILED) break;
+    }
+#else
+
+    /* Every gap which could fit the area is checked in order of addresses, so
+     * the lowest one of equal gaps wins. Subtrees without such gaps are
+     * skipped. */
+    if (map->backend == MYMAP_BTREE) {
+        if (mymap_btree_for_each_gap(map, best->size, mymap_best_fit_check,
+                best)) {
+            return;
+        }
+    } else {
+        for (node = mymap_first_gap(map->rb_tree.root, best->size);
+                node != NULL; node = mymap_next_gap(node, best->size)) {
+            MYMAP_STAT(map, second_phase_nodes);
+            if (mymap_best_fit_check(best, RB_GAP_START(node), RB_GAP(node)))
+                return;
+        }
+    }
+#endif
+
+    /* The last gap is the highest one, so it has to be smaller to win */
+    MYMAP_STAT(map, last_gap_checks);
+    if (last_gap >= best->size) {
+        mymap_best_fit_check(best,
+                (void*)((uintptr_t)map->va_end - map->last_gap + 1), last_gap);
+    }
+}
+
+static int mymap_best_fit_check(void *arg, void *start, size_t size) {
+    map_best_fit_t *best = arg;
+    void *addr = ALIGN_UP(start, best->align);
+
+    /* Skip gaps which are too small once aligned or no better than the best
+     * one so far */
+    if ((uintptr_t)(addr - start) > size - best->size) return 0;
+    if (best->addr != MYMAP_FAILED && size >= best->gap) return 0;
+
+    best->addr = addr;
+    best->gap = size;
+
+    return size == best->size;
+}
+
+#ifndef MYMAP_GAP_INDEX
+static int mymap_count_gap(void *arg, void *start, size_t size) {
+    (*(size_t*)arg)++;
+    return 0;
+}
+#endif
+
+static inline int mymap_belongs_to_region(void *vaddr, map_region_t *region) {
+
+    if (vaddr < region->vaddr) {
+        return -1;
+    } else if (vaddr >= region->vend) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static void mymap_destroy_region(map_t *map, map_region_t *region) {
+    if (map->pool.slab_size > 0) {
+        mymap_pool_free(&map->pool, region);
+    } else {
+        MYMAP_FREE(region);
+    }
+}
+
+static inline map_region_t* mymap_pool_alloc(map_pool_t *pool) {
+    map_pool_obj_t *obj;
+    map_slab_t *slab;
+
+    /* Reuse released descriptors first */
+    if (pool->free != NULL) {
+        obj = pool->free;
+        pool->free = obj->next;
+        return &obj->region;
+    }
+
+    /* Start a new slab if the newest one is used up. Descriptors are carved
+     * out of it one by one, so consecutive allocations stay adjacent. */
+    if (pool->next == pool->end) {
+        slab = MYMAP_MALLOC(sizeof(map_slab_t)
+                + pool->slab_size*sizeof(map_pool_obj_t));
+        if (slab == NULL) return NULL;
+        MYMAP_STAT(POOL_MAP(pool), allocations);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->next = slab->objs;
+        pool->end = slab->objs + pool->slab_size;
+    }
+
+    return &(pool->next++)->region;
+}
+
+static inline void mymap_pool_free(map_pool_t *pool, map_region_t *region) {
+    map_pool_obj_t *obj = (map_pool_obj_t*)region;
+
+    obj->next = pool->free;
+    pool->free = obj;
+}
+
+static int mymap_insert_region(map_t *map, map_region_t *region) {
+    rb_node_t **link = &map->rb_tree.root, *parent = NULL, *node;
+    map_region_t *prev = NULL, *next = NULL;
+
+    if (map->backend == MYMAP_BTREE) {
+        prev = mymap_btree_neighbour(map, region->vaddr, -1);
+        next = mymap_btree_neighbour(map, region->vaddr, 1);
+        region->gap = region->vaddr - ((prev != NULL) ? prev->vend
+                : map->va_base);
+        if (mymap_btree_insert(map, region) != MYMAP_OK) return MYMAP_ERR;
+        mymap_gap_index_insert(map, region);
+        mymap_space_add_gap(map, region->gap);
+        map->space.regions++;
+
+        if (next != NULL) {
+            mymap_set_gap(map, next, next->vaddr - region->vend);
+        } else {
+            mymap_set_last_gap(map, map->va_end - region->vend + 1);
+        }
+        return MYMAP_OK;
+    }
+
+    /* Find the place for the new node. The last node we turned right at is
+     * the region before the new one and the last one we turned left at is the
+     * region after it. */
+    while (*link != NULL) {
+        parent = *link;
+        if (region->vaddr < RB_VADDR(parent)) {
+            next = RB_REGION(parent);
+            link = &parent->left;
+        } else {
+            prev = RB_REGION(parent);
+            link = &parent->right;
+        }
+    }
+
+    /* Gap before the new region */
+    if (prev != NULL) {
+        region->gap = region->vaddr - prev->vend;
+    } else {
+        region->gap = region->vaddr - map->va_base;
+    }
+    region->max_gap = region->gap;
+    mymap_gap_index_insert(map, region);
+    mymap_space_add_gap(map, region->gap);
+    map->space.regions++;
+
+    /* Link the node and update largest gaps on the path to the root */
+    node = &region->rb_node;
+    rb_node_init(node);
+    RB_SET_PARENT(node, parent);
+    *link = node;
+    mymap_augment_propagate(parent, NULL);
+
+    /* New region split the gap it was placed in, so the rest of it is either
+     * the gap before the next region or the last gap */
+    if (next != NULL) {
+        mymap_set_gap(map, next, next->vaddr - region->vend);
+    } else {
+        mymap_set_last_gap(map, map->va_end - region->vend + 1);
+    }
+
+    /* Fix up the tree of the regions to make sure it is a valid red-black
+     * tree */
+    if (mymap_rb_insert_fixup(&map->rb_tree, node) != RB_OK)
+        return MYMAP_ERR;
+
+    return MYMAP_OK;
+}
+
+static map_region_t* mymap_remove_region(map_t *map, map_region_t *region) {
+    map_region_t *prev_region, *next_region;
+    rb_node_t *prev, *next;
+    void *gap_start;
+
+    mymap_gap_index_remove(map, region);
+    mymap_space_remove_gap(map, region->gap);
+    map->space.regions--;
+
+    if (map->backend == MYMAP_BTREE) {
+        prev_region = mymap_btree_neighbour(map, region->vaddr, -1);
+        next_region = mymap_btree_neighbour(map, region->vaddr, 1);
+        mymap_btree_delete(map, region);
+        mymap_cache_invalidate(map, region);
+
+        gap_start = (prev_region != NULL) ? prev_region->vend : map->va_base;
+        if (next_region != NULL) {
+            mymap_set_gap(map, next_region, next_region->vaddr - gap_start);
+        } else {
+            mymap_set_last_gap(map, map->va_end - gap_start + 1);
+        }
+        return next_region;
+    }
+
+    prev = rb_previous(&region->rb_node);
+    next = rb_next(&region->rb_node);
+    MYMAP_STAT(map, next_calls);
+    MYMAP_STAT(map, next_calls);
+
+    mymap_rb_delete(&map->rb_tree, &region->rb_node);
+    mymap_cache_invalidate(map, region);
+
+    /* Gap before removed region, the region itself and the gap after it make
+     * up a single gap now */
+    gap_start = (prev != NULL) ? RB_REGION(prev)->vend : map->va_base;
+    if (next != NULL) {
+        mymap_set_gap(map, RB_REGION(next), RB_VADDR(next) - gap_start);
+    } else {
+        mymap_set_last_gap(map, map->va_end - gap_start + 1);
+    }
+
+    return RB_ELEMENT(next, map_region_t, rb_node);
+}
+
+static map_region_t* mymap_remove_regions(map_t *map, map_region_t *region,
+        void *end) {
+    map_region_t *prev, *next;
+    void *gap_start;
+    int deferred;
+
+    /* Propagating a single change stops as soon as largest gaps stop
+     * changing, which beats marking the whole path as dirty */
+    next = mymap_next(map, region);
+    if (next == NULL || next->vend > end) {
+        next = mymap_remove_region(map, region);
+        mymap_destroy_region(map, region);
+        return next;
+    }
+
+    prev = mymap_prev(map, region);
+    gap_start = (prev != NULL) ? prev->vend : map->va_base;
+
+    deferred = map->deferred;
+    map->deferred = 1;
+
+    /* Regions are unlinked without touching their neighbours, whose gaps are
+     * merged only once the whole run is gone */
+    for (; region != NULL && region->vend <= end; region = next) {
+        next = mymap_next(map, region);
+        mymap_gap_index_remove(map, region);
+        mymap_space_remove_gap(map, region->gap);
+        map->space.regions--;
+        if (map->backend == MYMAP_BTREE) {
+            mymap_btree_delete(map, region);
+        } else {
+            mymap_rb_delete(&map->rb_tree, &region->rb_node);
+        }
+        mymap_cache_invalidate(map, region);
+        mymap_destroy_region(map, region);
+    }
+
+    if (region != NULL) {
+        mymap_set_gap(map, region, region->vaddr - gap_start);
+    } else {
+        mymap_set_last_gap(map, map->va_end - gap_start + 1);
+    }
+
+    map->deferred = deferred;
+    if (!deferred) mymap_fix_dirty_gaps(map->rb_tree.root);
+
+    return region;
+}
+
+static map_op_t** mymap_sort_ops(map_op_t **ops, map_op_t **tmp,
+        size_t count) {
+    map_op_t **src = ops, **dst = tmp, **swap;
+    size_t width, start, mid, end, left, right, out;
+
+    /* Bottom-up merge sort. Operations are compared directly (no callbacks
+     * like in qsort) and pairs of runs which are already in order are just
+     * copied, so sorted batches cost a single comparison per run. */
+    for (width = 1; width < count; width *= 2) {
+        for (start = 0; start < count; start += 2*width) {
+            mid = (start + width < count) ? start + width : count;
+            end = (start + 2*width < count) ? start + 2*width : count;
+            left = start;
+            right = mid;
+            out = start;
+
+            if (mid == end || src[mid - 1]->vaddr <= src[mid]->vaddr) {
+                while (out < end) dst[out++] = src[left++];
+                continue;
+            }
+
+            while (left < mid && right < end) {
+                if (src[left]->vaddr <= src[right]->vaddr) {
+                    dst[out++] = src[left++];
+                } else {
+                    dst[out++] = src[right++];
+                }
+            }
+            while (left < mid) dst[out++] = src[left++];
+            while (right < end) dst[out++] = src[right++];
+        }
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    return src;
+}
+
+static void mymap_fix_dirty_gaps(rb_node_t *node) {
+
+    /* Clean subtree doesn't contain any dirty nodes */
+    if (node == NULL || RB_MAX_GAP(node) != MYMAP_DIRTY_GAP) return;
+
+    mymap_fix_dirty_gaps(node->left);
+    mymap_fix_dirty_gaps(node->right);
+    RB_MAX_GAP(node) = mymap_subtree_max_gap(node);
+}
 
-/* Private macros ----------------------------------------------------------- */
-#define RB_MAX_GAP(node)        RB_ELEMENT(node, map_region_t)->max_gap
-#define RB_GAP(node)            RB_ELEMENT(node, map_region_t)->gap
-#define RB_VADDR(node)          RB_ELEMENT(node, map_region_t)->vaddr
+static inline void mymap_mark_dirty(rb_node_t *node, rb_node_t *stop) {
 
-/* Private functions -------------------------------------------------------- */
-/**
- * Checks if virtual address belongs to region
- * @param vaddr Virtual address to check
- * @param region Pointer to region structure
- * @return Returns -1, 0 or 1 if virtual address is located before, inside or
- * after region, respectively
- */
-static int mymap_belongs_to_region(void *vaddr, void *region);
+    /* All ancestors of a dirty node are dirty already */
+    while (node != stop && RB_MAX_GAP(node) != MYMAP_DIRTY_GAP) {
+        RB_MAX_GAP(node) = MYMAP_DIRTY_GAP;
+        node = RB_PARENT(node);
+    }
+}
 
-/* TODO: Comment */
-static void mymap_destroy_region(map_region_t *region);
-static inline void* mymap_check_last_gap(map_t *map, void *vaddr,
-        unsigned long size);
-static void mymap_print_region(void *element);
+static rb_node_t* mymap_build_subtree(map_pool_obj_t *objs, size_t count,
+        unsigned depth, unsigned red_depth) {
+    size_t index = count/2;
+    map_region_t *region;
+    rb_node_t *node, *child;
 
-/* Exported functions ------------------------------------------------------- */
-int mymap_init(map_t *map) {
-    if (map == NULL) return MYMAP_ERR;
+    if (count == 0) return NULL;
 
-    /* Initialize red-black tree of mapped regions */
-    if (rb_init(&map->rb_tree) != RB_OK) return MYMAP_ERR;
+    region = &objs[index].region;
+    node = &region->rb_node;
+    RB_SET_COLOR(node, (depth == red_depth) ? RB_RED : RB_BLACK);
+    region->max_gap = region->gap;
 
-    return MYMAP_OK;
+    /* Build left subtree */
+    node->left = mymap_build_subtree(objs, index, depth + 1, red_depth);
+    if ((child = node->left) != NULL) {
+        RB_SET_PARENT(child, node);
+        if (RB_MAX_GAP(child) > region->max_gap)
+            region->max_gap = RB_MAX_GAP(child);
+    }
+
+    /* Build right subtree */
+    node->right = mymap_build_subtree(&objs[index + 1], count - index - 1,
+            depth + 1, red_depth);
+    if ((child = node->right) != NULL) {
+        RB_SET_PARENT(child, node);
+        if (RB_MAX_GAP(child) > region->max_gap)
+            region->max_gap = RB_MAX_GAP(child);
+    }
+
+    return node;
 }
 
-int mymap_dump(map_t *map) {
+static map_region_t* mymap_split_region(map_t *map, map_region_t *region,
+        void *vaddr) {
+    map_region_t *tail;
 
-    if (map == NULL) return MYMAP_ERR;
+    tail = _mymap_create_region(map, mymap_paddr_offset(region->paddr,
+            vaddr - region->vaddr), region->flags);
+    if (tail == NULL) return NULL;
 
-    if (RB_EMPTY(&map->rb_tree)) {
-        MYMAP_PRINTF("The map is empty.\n");
-    } else {
-        rb_print_subtree(map->rb_tree.root, mymap_print_region);
+    tail->vaddr = vaddr;
+    tail->vend = region->vend;
+    region->vend = vaddr;
+
+    /* Gap before the region after the original one stays the same, so only
+     * the new region gets a gap (of zero) */
+    if (mymap_insert_region(map, tail) != MYMAP_OK) {
+        region->vend = tail->vend;
+        mymap_remove_region(map, tail);
+        mymap_destroy_region(map, tail);
+        return NULL;
     }
 
-    return MYMAP_ERR;
+    return tail;
 }
 
-void *mymap_mmap(map_t *map, void *vaddr, unsigned int size, unsigned int flags,
-        void *o) {
-    map_region_t *region;
+static inline map_region_t* mymap_next(map_t *map, map_region_t *region) {
 
-    if (map == NULL) return MYMAP_FAILED;
+    MYMAP_STAT(map, next_calls);
 
-    region = mymap_create_region(o, flags);
-    if (region == NULL) return MYMAP_FAILED;
+    if (map->backend == MYMAP_BTREE)
+        return mymap_btree_neighbour(map, region->vaddr, 1);
 
-    if (RB_EMPTY(&map->rb_tree)) {
+    return RB_ELEMENT(rb_next(&region->rb_node), map_region_t, rb_node);
+}
 
-        /* This will be the first region in the address space, so we can map it
-         * to the suggested address if provided and in it is greater than base
-         * address of the virtual address space */
-        if (vaddr != NULL && vaddr >= MYMAP_VA_BASE) {
-            region->vaddr = vaddr;
+static inline map_region_t* mymap_prev(map_t *map, map_region_t *region) {
 
-        } else {
-            /* Suggested address was not provided, map to the beginning of the
-             * address space */
-            region->vaddr = MYMAP_VA_BASE;
-        }
+    MYMAP_STAT(map, next_calls);
 
-        /* Check if we the area is big enough additionally checking for
-         * overflow*/
-        unsigned long area_size = MYMAP_VA_END - region->vaddr + 1;
-        bool overflowed = MYMAP_VA_END > region->vaddr && area_size == 0;
-        if (area_size < size && !overflowed) {
-            mymap_destroy_region(region); /* Clean up */
-            return MYMAP_FAILED;
-        }
+    if (map->backend == MYMAP_BTREE)
+        return mymap_btree_neighbour(map, region->vaddr, -1);
 
-        map->rb_tree.root = region->rb_node;
+    return RB_ELEMENT(rb_previous(&region->rb_node), map_region_t, rb_node);
+}
 
-    } else {
+static inline map_region_t* mymap_last(map_t *map) {
 
-        /* Get region located before unmapped area fulfilling all
-         * requirements*/
-        region->vaddr = mymap_get_unmapped_area(map, vaddr, size);
+    if (map->backend == MYMAP_BTREE) return mymap_btree_edge(map, 1);
 
-        /* TODO: Insert new region */
-    }
+    return RB_ELEMENT(rb_maximum(map->rb_tree.root), map_region_t, rb_node);
+}
 
-    /* Calculate the end of the region */
-    region->vend = region->vaddr + size;
+static inline bool mymap_is_empty(map_t *map) {
+    return RB_EMPTY(&map->rb_tree) && map->btree.root == NULL;
+}
 
-    /* Fix up the tree of the regions to make sure it is a valid red-black
-     * tree */
-    if (rb_insert_fixup(&map->rb_tree, region->rb_node) != RB_OK) {
-        mymap_destroy_region(region); /* Clean up */
-        return MYMAP_FAILED;
+static inline map_region_t* mymap_lookup(map_t *map, void *vaddr) {
+
+    if (map->backend == MYMAP_BTREE) return mymap_btree_find(map, vaddr);
+
+    return mymap_rb_find(&map->rb_tree, vaddr);
+}
+
+static inline void mymap_move_region(map_t *map, map_region_t *region,
+        void *vaddr) {
+
+    /* Pivots of the B-tree are copies of the addresses, so they have to be
+     * moved too */
+    if (map->backend == MYMAP_BTREE) {
+        mymap_btree_move(map, region, vaddr);
+    } else {
+        region->vaddr = vaddr;
     }
+}
 
-    /* Return virtual address the region was mapped to */
-    return region->vaddr;
+static inline bool mymap_can_merge(map_region_t *region, void *vaddr,
+        void *paddr, unsigned int flags) {
+
+    /* Regions not backed by physical memory are always contiguous */
+    return region->vend == vaddr && region->flags == flags
+            && mymap_paddr_offset(region->paddr, region->vend - region->vaddr)
+                    == paddr;
 }
 
-void mymap_munmap(map_t *map, void *vaddr) {
-    rb_node_t *node;
-    int result;
+static bool mymap_merge_next(map_t *map, map_region_t *region) {
+    map_region_t *next;
 
-    if (map == NULL) return;
+    next = mymap_next(map, region);
+    if (next == NULL) return false;
+    if (!mymap_can_merge(region, next->vaddr, next->paddr, next->flags))
+        return false;
 
-    /* Find region this address belongs to */
-    node = rb_search(&map->rb_tree, vaddr, mymap_belongs_to_region, &result);
-    if (node == NULL) {
+    /* Removing the next region merges the gap after it with the one before
+     * it, which is empty, so region has to be extended first */
+    region->vend = next->vend;
+    mymap_remove_region(map, next);
+    mymap_destroy_region(map, next);
 
-        /* Some error occurred, tree is empty or this address does not belong
-         * to any region */
-        return;
+    return true;
+}
+
+static map_region_t* mymap_lower_bound(map_t *map, void *vaddr) {
+    rb_node_t *node = map->rb_tree.root;
+    map_region_t *found = NULL;
+
+    /* It's either the region containing the address or the first one after
+     * it */
+    if (map->backend == MYMAP_BTREE) {
+        found = mymap_btree_neighbour(map, vaddr, 0);
+        if (found != NULL && vaddr < found->vend) return found;
+        return mymap_btree_neighbour(map, vaddr, 1);
+    }
+
+    while (node != NULL) {
+        if (vaddr < RB_REGION(node)->vend) {
+            found = RB_REGION(node);
+            node = node->left;
+        } else {
+            node = node->right;
+        }
     }
 
-    /* Remove region from the tree and destroy regions */
-    rb_delete(&map->rb_tree, node);
-    mymap_destroy_region(RB_ELEMENT(node, map_region_t));
+    return found;
 }
 
-map_region_t* mymap_create_region(void *paddr, unsigned int flags) {
-    map_region_t *region;
-    rb_node_t *node;
+static rb_node_t* mymap_first_gap(rb_node_t *node, unsigned long size) {
 
-    /* Create and initialize region structure */
-    region = MYMAP_MALLOC(sizeof(map_region_t));
-    if (region == NULL) return NULL;
-    region->paddr = paddr;
-    region->flags = flags;
+    if (node == NULL || RB_MAX_GAP(node) < size) return NULL;
 
-    /* Create and initialize new red-black tree node to store the region in */
-    node = MYMAP_MALLOC(sizeof(rb_node_t));
-    if (node == NULL) {
+    /* Largest gaps of the subtrees tell which way the first such gap is */
+    while (node != NULL) {
+        if (node->left != NULL && RB_MAX_GAP(node->left) >= size) {
+            node = node->left;
+        } else if (RB_GAP(node) >= size) {
+            return node;
+        } else {
+            node = node->right;
+        }
+    }
 
-        /* Clean up */
-        MYMAP_FREE(region);
+    return NULL;
+}
 
-        return NULL;
+static rb_node_t* mymap_next_gap(rb_node_t *node, unsigned long size) {
+    rb_node_t *parent;
+
+    if (node->right != NULL && RB_MAX_GAP(node->right) >= size)
+        return mymap_first_gap(node->right, size);
+
+    /* Otherwise it's one of the ancestors the node is on the left of or the
+     * right subtree of such ancestor */
+    while ((parent = RB_PARENT(node)) != NULL) {
+        if (node == parent->left) {
+            if (RB_GAP(parent) >= size) return parent;
+            if (parent->right != NULL && RB_MAX_GAP(parent->right) >= size)
+                return mymap_first_gap(parent->right, size);
+        }
+        node = parent;
     }
-    rb_node_init(node, (void*)region);
 
-    /* Create link from region to the corresponding node of red-black tree */
-    region->rb_node = node;
+    return NULL;
+}
+
+static inline void mymap_cache_invalidate(map_t *map, map_region_t *region) {
+    int i;
 
-    return region;
+    /* Region could have been cached for addresses from different pages */
+    for (i = 0; i < MYMAP_CACHE_SIZE; i++) {
+        if (map->cache.regions[i] == region) map->cache.regions[i] = NULL;
+    }
 }
 
-void* mymap_get_unmapped_area(map_t *map, void *vaddr, unsigned int size) {
-    rb_node_t *curr;
+static inline void* mymap_paddr_offset(void *paddr, unsigned long offset) {
+    return (paddr != NULL) ? paddr + offset : NULL;
+}
 
-    if (map == NULL) return MYMAP_FAILED;
+static inline void mymap_set_gap(map_t *map, map_region_t *region,
+        unsigned long gap) {
+
+    /* Position of the gap in the index and its size class depend on its
+     * size */
+    if (gap != region->gap) {
+        mymap_gap_index_remove(map, region);
+        mymap_space_remove_gap(map, region->gap);
+        region->gap = gap;
+        mymap_gap_index_insert(map, region);
+        mymap_space_add_gap(map, gap);
+    }
 
-    if (RB_EMPTY(&map->rb_tree) || RB_MAX_GAP(map->rb_tree.root) < size) {
-        /* If tree is empty or maximum gap size at the root is smaller than
-         * requested size, then the last gap is our only chance */
-        return mymap_check_last_gap(map, vaddr, size);
+    /* Largest gaps of the B-tree are always updated right away */
+    if (map->backend == MYMAP_BTREE) {
+        mymap_btree_update_gap(map, region);
+        return;
     }
 
-    if (vaddr < MYMAP_VA_BASE) vaddr = MYMAP_VA_BASE;
+    if (map->deferred) {
 
-    /* In the first phase we analyze parts of the tree where we have to watch
-     * out both for maximum gap size in subtree and suggested virtual address.
-     * We'll make sure that suggested address is located before current region
-     * before moving to the second phase. */
-    curr = map->rb_tree.root;
-    while (true) {
+        /* Mark the region as dirty. Its ancestors inherit the mark, but only
+         * up to the first one which is already dirty. */
+        mymap_mark_dirty(&region->rb_node, NULL);
 
-        map_region_t *region = RB_ELEMENT(curr, map_region_t);
-        int result = mymap_belongs_to_region(vaddr, region);
+    } else {
+        mymap_augment_propagate(&region->rb_node, NULL);
+    }
+}
 
-        if (result < 0) { /* vaddr is before the current region */
+static inline void mymap_set_last_gap(map_t *map, unsigned long gap) {
+    mymap_space_remove_gap(map, map->last_gap);
+    map->last_gap = gap;
+    mymap_space_add_gap(map, gap);
+}
 
-            if (curr->left == NULL) {
+static inline void mymap_space_add_gap(map_t *map, unsigned long gap) {
 
-                /* There is no left subtree. Check if we can insert new region
-                 * before the current one */
-                map_region_t *tmp = RB_ELEMENT(curr, map_region_t);
-                if (tmp->gap >= size && (tmp->vaddr - vaddr) >= size) {
-                    return vaddr;
-                } else {
-                    /*  Won't fit here. Go to the second phase. */
-                    break;
-                }
+    if (gap == 0) return;
 
-            /* Check if any gap in the left subtree is big enough */
-            } else if (RB_MAX_GAP(curr->left) >= size) {
-                curr = curr->left;
+    map->space.unmapped += gap;
+    map->space.gaps++;
+    map->space.gap_classes[mymap_gap_class(gap)]++;
+}
 
-            } else {
-                /* Won't fit into this subtree. Go to the seconds phase. */
-                break;
-            }
+static inline void mymap_space_remove_gap(map_t *map, unsigned long gap) {
 
-        } else if (result == 0) {
+    if (gap == 0) return;
 
-            /* vaddr is inside the current region. Move to the next element and
-             * go to the second phase. If no such an element exists, check if we
-             * can place new region after current one (and the last at the same
-             * time). */
-            rb_node_t *next = rb_next(curr);
-            if (next == NULL)
-                return mymap_check_last_gap(map, vaddr, size);
-            curr = next;
-            break;
+    map->space.unmapped -= gap;
+    map->space.gaps--;
+    map->space.gap_classes[mymap_gap_class(gap)]--;
+}
 
-        } else { /* vaddr is after the current region */
+static inline unsigned mymap_gap_class(unsigned long gap) {
+    unsigned class = 0, shift;
 
-            if (curr->right == NULL) {
+    /* Binary search for the highest bit set */
+    for (shift = sizeof(unsigned long)*CHAR_BIT/2; shift > 0; shift /= 2) {
+        if (gap >> shift) {
+            gap >>= shift;
+            class += shift;
+        }
+    }
 
-                /* There is no right subtree. Move to the next element and go to
-                 * the second phase. If no such an element exists, check the
-                 * last gap. */
-                rb_node_t *next = rb_next(curr);
-                if (next == NULL)
-                    return mymap_check_last_gap(map, vaddr, size);
-                curr = next;
-                break;
+    return class;
+}
 
-            /* Check if right subtree looks promising */
-            } else if (RB_MAX_GAP(curr->right) < size) {
+static inline void mymap_gap_index_insert(map_t *map, map_region_t *region) {
+#ifdef MYMAP_GAP_INDEX
+    rb_node_t **link = &map->gap_index.root, *parent = NULL, *node;
 
-                /* Move to the next element skipping whole right subtree and go
-                 * to the second phase. If such element doesn't exist, check the
-                 * last gap. */
-                rb_node_t *tmp = rb_subtree_next(curr);
-                if (tmp == NULL)
-                    return mymap_check_last_gap(map, vaddr, size);
-                curr = tmp;
-                break;
-            }
+    if (region->gap == 0) return;
 
-            /* Look deeper into the right subtree */
-            curr = curr->right;
+    /* Gaps are ordered by size and then by address. The new one is counted
+     * in all subtrees on the way down. */
+    while (*link != NULL) {
+        parent = *link;
+        GAP_REGION(parent)->gap_count++;
+        if (region->gap < GAP_SIZE(parent) || (region->gap == GAP_SIZE(parent)
+                && region->vaddr < GAP_REGION(parent)->vaddr)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
         }
     }
 
-    /* In second phase we no longer have to worry about the suggested virtual
-     * address, since in the previous part we made sure that is located before
-     * the current region. */
-    while (true) {
+    node = &region->gap_node;
+    rb_node_init(node);
+    RB_SET_PARENT(node, parent);
+    region->gap_count = 1;
+    *link = node;
 
-        /* Check if gap before current element is big enough */
-        void *gap_start = (void*)(RB_VADDR(curr) - RB_GAP(curr));
-        if (gap_start > vaddr && RB_GAP(curr) >= size) {
-            return gap_start;
-        } else if (gap_start <= vaddr && (RB_VADDR(curr) - vaddr) >= size) {
-            return vaddr;
-        }
+    mymap_gap_rb_insert_fixup(&map->gap_index, node);
+#endif
+}
 
-        /* Check if there is a gap big enough in the right subtree */
-        if (curr->right && RB_MAX_GAP(curr->right) >= size) {
+static inline void mymap_gap_index_remove(map_t *map, map_region_t *region) {
+#ifdef MYMAP_GAP_INDEX
+    if (region->gap == 0) return;
 
-            curr = curr->right;
-            while (true) {
+    mymap_gap_rb_delete(&map->gap_index, &region->gap_node);
+#endif
+}
 
-                /* We want to get as close to suggested address as possible and
-                 * therefore we should start with left subtree */
-                if (curr->left && RB_MAX_GAP(curr->left) >= size) {
-                    curr = curr->left;
+#ifdef MYMAP_GAP_INDEX
+static rb_node_t* mymap_gap_index_lower_bound(map_t *map, unsigned long size) {
+    rb_node_t *node = map->gap_index.root, *found = NULL;
 
-                /* Check current element */
-                } else if (RB_GAP(curr) >= size) {
-                    return RB_VADDR(curr) - RB_GAP(curr);
+    while (node != NULL) {
+        if (GAP_SIZE(node) >= size) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
 
-                /* Check right subtree as a last resort */
-                } else if (curr->right && RB_MAX_GAP(curr->right) >= size) {
-                    curr = curr->right;
+    return found;
+}
 
-                } else {
-                    /* Should never happen unless tree is broken */
-                    return MYMAP_FAILED;
-                }
-            }
+static unsigned long mymap_gap_index_count(map_t *map, unsigned long size) {
+    rb_node_t *node = map->gap_index.root;
+    unsigned long count = 0;
+
+    /* Whenever the gap is big enough, so are all gaps in its right subtree */
+    while (node != NULL) {
+        if (GAP_SIZE(node) >= size) {
+            count += 1 + GAP_COUNT(node->right);
+            node = node->left;
+        } else {
+            node = node->right;
         }
+    }
 
-        /* Move to the next element skipping whole right subtree and go
-         * to the second phase. If such element doesn't exist, check the
-         * last gap. */
-        rb_node_t *tmp = rb_subtree_next(curr);
-        if (tmp == NULL)
-            return mymap_check_last_gap(map, vaddr, size);
-        curr = tmp;
+    return count;
+}
+
+static void mymap_gap_count_propagate(rb_node_t *node, rb_node_t *stop) {
+    unsigned long count;
+
+    while (node != stop) {
+
+        /* Nothing changes above this node if its count stays the same */
+        count = 1 + GAP_COUNT(node->left) + GAP_COUNT(node->right);
+        if (GAP_REGION(node)->gap_count == count) break;
+        GAP_REGION(node)->gap_count = count;
+
+        node = RB_PARENT(node);
     }
+}
 
-    return NULL;
+static void mymap_gap_count_rotate(rb_node_t *old, rb_node_t *new) {
+
+    /* New node is the root of the same subtree now */
+    GAP_REGION(new)->gap_count = GAP_REGION(old)->gap_count;
+    GAP_REGION(old)->gap_count = 1 + GAP_COUNT(old->left)
+            + GAP_COUNT(old->right);
 }
+#endif
 
-/* Private functions -------------------------------------------------------- */
-static int mymap_belongs_to_region(void *vaddr, void *region) {
-    map_region_t *r = (map_region_t*)region;
+static inline unsigned long mymap_subtree_max_gap(rb_node_t *node) {
+    unsigned long max_gap = RB_GAP(node);
 
-    if (vaddr < r->vaddr) {
-        return -1;
-    } else if (vaddr >= r->vend) {
-        return 1;
+    if (node->left != NULL && RB_MAX_GAP(node->left) > max_gap)
+        max_gap = RB_MAX_GAP(node->left);
+    if (node->right != NULL && RB_MAX_GAP(node->right) > max_gap)
+        max_gap = RB_MAX_GAP(node->right);
+
+    return max_gap;
+}
+
+static void mymap_augment_propagate(rb_node_t *node, rb_node_t *stop) {
+    unsigned long max_gap;
+
+    while (node != stop) {
+
+        /* Nothing changes above this node if its largest gap stays the same */
+        max_gap = mymap_subtree_max_gap(node);
+        if (RB_MAX_GAP(node) == max_gap) break;
+        RB_MAX_GAP(node) = max_gap;
+
+        node = RB_PARENT(node);
+    }
+}
+
+static inline void mymap_tree_propagate(rb_tree_t *tree, rb_node_t *node,
+        rb_node_t *stop) {
+
+    /* While updates are deferred, paths changed by removals of nodes are only
+     * marked, so that regions removed one after another share the work */
+    if (RB_ENTRY(tree, map_t, rb_tree)->deferred) {
+        mymap_mark_dirty(node, stop);
     } else {
-        return 0;
+        mymap_augment_propagate(node, stop);
     }
 }
 
-static void mymap_destroy_region(map_region_t *region) {
-    MYMAP_FREE(region->rb_node);
-    MYMAP_FREE(region);
+static void mymap_augment_copy(rb_node_t *old, rb_node_t *new) {
+    RB_MAX_GAP(new) = RB_MAX_GAP(old);
+}
+
+static void mymap_augment_rotate(rb_node_t *old, rb_node_t *new) {
+
+    /* New node is the root of the same subtree now, while the old one lost
+     * part of its subtree */
+    RB_MAX_GAP(new) = RB_MAX_GAP(old);
+    RB_MAX_GAP(old) = mymap_subtree_max_gap(old);
 }
 
 static inline void* mymap_check_last_gap(map_t *map, void *vaddr,
@@ -321,20 +2819,107 @@ static inline void* mymap_check_last_gap(map_t *map, void *vaddr,
 
     if (map == NULL) return MYMAP_FAILED;
 
-    gap_start = MYMAP_VA_END - map->last_gap + 1;
+    MYMAP_STAT(map, last_gap_checks);
+
+    gap_start = (void*)((uintptr_t)map->va_end - map->last_gap + 1);
 
     if (gap_start > vaddr && map->last_gap > size) {
         return gap_start;
-    } else if (gap_start <= vaddr && (MYMAP_VA_END - vaddr + 1) > size) {
+    } else if (gap_start <= vaddr && vaddr <= map->va_end
+            && (unsigned long)(map->va_end - vaddr) >= size) {
         return vaddr;
     } else {
         return MYMAP_FAILED;
     }
 }
 
-static void mymap_print_region(void *element) {
-    map_region_t *r = (map_region_t*)element;
+static inline void* mymap_check_last_gap_topdown(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align) {
+    void *gap_start, *addr;
+
+    gap_start = (void*)((uintptr_t)map->va_end - map->last_gap + 1);
+
+    if (gap_start > vaddr || map->last_gap <= size + align - 1)
+        return MYMAP_FAILED;
+
+    /* Place the area as high as possible, but not above suggested address */
+    addr = map->va_end - size;
+    if (addr > vaddr) addr = vaddr;
+    if ((unsigned long)(addr - gap_start) < align - 1) return MYMAP_FAILED;
+
+    return ALIGN_DOWN(addr, align);
+}
+
+static void mymap_print_region(rb_node_t *node) {
+    map_region_t *r = RB_REGION(node);
 
     MYMAP_PRINTF("(vaddr: %p, vend: %p, gap: %lu, max_gap: %lu)", r->vaddr,
-            r->vend, r->gap, r->max_gap);
+            r->vend, (unsigned long)r->gap, (unsigned long)r->max_gap);
+}
+
+static void mymap_trace(map_t *map, map_trace_op_t op, void *vaddr,
+        size_t size, unsigned long align, unsigned int flags, void *paddr,
+        void *result) {
+    map_trace_rec_t rec;
+
+    rec.op = op;
+    rec.align_shift = 0;
+    while (rec.align_shift < 63 && align > 1UL << rec.align_shift)
+        rec.align_shift++;
+    rec.reserved = 0;
+    rec.flags = flags;
+    rec.vaddr = (uintptr_t)vaddr;
+    rec.size = size;
+    rec.paddr = (uintptr_t)paddr;
+    rec.result = (uintptr_t)result;
+
+    map->trace(map->trace_arg, &rec);
+}
+
+static char* mymap_format_region(char *pos, map_region_t *region) {
+
+    pos = mymap_format_addr(pos, region->vaddr);
+    *pos++ = '-';
+    pos = mymap_format_addr(pos, region->vend);
+    *pos++ = ' ';
+    *pos++ = (region->flags & MYMAP_READ) ? 'r' : '-';
+    *pos++ = (region->flags & MYMAP_WRITE) ? 'w' : '-';
+    *pos++ = (region->flags & MYMAP_EXEC) ? 'x' : '-';
+    *pos++ = ' ';
+    pos = mymap_format_addr(pos, region->paddr);
+    *pos++ = '\n';
+
+    return pos;
+}
+
+static inline char* mymap_format_addr(char *pos, void *addr) {
+    static const char digits[] = "0123456789abcdef";
+    uintptr_t value = (uintptr_t)addr;
+    int i;
+
+    /* Two digits at a time, starting with the least significant byte */
+    for (i = 2*sizeof(void*) - 2; i >= 0; i -= 2) {
+        pos[i] = digits[(value >> 4) & 0xf];
+        pos[i + 1] = digits[value & 0xf];
+        value >>= 8;
+    }
+
+    return pos + 2*sizeof(void*);
+}
+
+static int mymap_write_fd(void *arg, const char *buf, size_t len) {
+    int fd = *(int*)arg;
+    ssize_t written;
+
+    while (len > 0) {
+        written = MYMAP_FD_WRITE(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+
+    return 0;
 }
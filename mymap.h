@@ -9,6 +9,8 @@
 #define MYMAP_H_
 
 #include "rb_tree.h"
+#include <stdint.h>
+#include <limits.h>
 
 /* Settings ----------------------------------------------------------------- */
 #include <stdlib.h>
@@ -18,10 +20,57 @@
 #include <stdio.h>
 #define MYMAP_PRINTF(...)       printf(__VA_ARGS__)
 
-/* Base of the virtual address space (smallest available address) */
+#include <unistd.h>
+#define MYMAP_FD_WRITE(fd, buf, len)    write(fd, buf, len)
+
+#include <pthread.h>
+#define MYMAP_RWLOCK_T              pthread_rwlock_t
+#define MYMAP_RWLOCK_INIT(lock)     pthread_rwlock_init(lock, NULL)
+#define MYMAP_RWLOCK_DESTROY(lock)  pthread_rwlock_destroy(lock)
+#define MYMAP_RWLOCK_RDLOCK(lock)   pthread_rwlock_rdlock(lock)
+#define MYMAP_RWLOCK_WRLOCK(lock)   pthread_rwlock_wrlock(lock)
+#define MYMAP_RWLOCK_UNLOCK(lock)   pthread_rwlock_unlock(lock)
+
+/* Default number of region descriptors in a single slab of the region pool */
+#define MYMAP_POOL_SLAB_SIZE    (256)
+
+/* Number of entries in the cache of recently found regions (power of two) */
+#define MYMAP_CACHE_SIZE        (4)
+
+/* Number of low address bits ignored when choosing cache entry, so that
+ * addresses from the same page share an entry */
+#define MYMAP_CACHE_SHIFT       (12)
+
+/* Size of the buffer regions are formatted in by flat dumps (has to hold at
+ * least one line, i.e. 55 bytes with 64-bit pointers) */
+#define MYMAP_DUMP_BUFFER_SIZE  (4096)
+
+/* Number of operations of a batch sorted and applied together (see
+ * mymap_batch) */
+#define MYMAP_BATCH_CHUNK       (256)
+
+/* Number of slots in a node of the B-tree backend */
+#define MYMAP_BTREE_SLOTS       (16)
+
+/* Define MYMAP_COMPACT (e.g. with -DMYMAP_COMPACT) to store sizes of gaps in
+ * 32 bits. Address spaces of the maps are limited to 4 GiB then, but together
+ * with RB_COMPACT every region descriptor fits in a single 64-byte cache
+ * line. */
+
+/* Define MYMAP_GAP_INDEX to keep gaps before regions in a second tree ordered
+ * by their sizes and addresses. It makes best-fit placement and counting gaps
+ * of a given size logarithmic, at the cost of a tree node and a counter per
+ * region and updating the index whenever a gap changes size. MYMAP_BEST_FIT
+ * policy is available only with the index. */
+
+/* Define MYMAP_STATS to count work done on hot paths of every map (nodes
+ * visited by searches, rotations, allocations etc.). Counters are read with
+ * mymap_get_stats. */
+
+/* Default base of the virtual address space (smallest available address) */
 #define MYMAP_VA_BASE           ((void*)0x00000010)
 
-/* End (last address) of the virtual address space */
+/* Default end (last address) of the virtual address space */
 #define MYMAP_VA_END            ((void*)0x00001000)
 
 /* Return codes ------------------------------------------------------------- */
@@ -36,33 +85,383 @@
 #define MYMAP_EXEC              (1 << 2)	/* Marks executable region */
 
 /* Exported types ----------------------------------------------------------- */
+/* Size of a gap stored in region descriptors */
+#ifdef MYMAP_COMPACT
+typedef uint32_t map_gap_t;
+#define MYMAP_GAP_MAX           (UINT32_MAX)
+#else
+typedef unsigned long map_gap_t;
+#define MYMAP_GAP_MAX           (ULONG_MAX)
+#endif
+
+/* Policies of placing new regions in the address space */
+typedef enum {
+    MYMAP_BOTTOM_UP, /* Lowest area at or above suggested address */
+    MYMAP_TOP_DOWN, /* Highest area at or below suggested address */
+    MYMAP_BEST_FIT, /* Suggested address if the area there is free, otherwise
+                     * the smallest gap which fits (the lowest one if there
+                     * are more of them). Requires MYMAP_GAP_INDEX. */
+} map_policy_t;
+
+/* Data structures regions of the map can be kept in */
+typedef enum {
+    MYMAP_RBTREE, /* Red-black tree augmented with largest gaps */
+    MYMAP_BTREE, /* B-tree keeping pivots and largest gaps of slots in nodes */
+} map_backend_t;
+
 typedef struct map_region_s map_region_t;
 
 struct map_region_s {
     void *paddr; /* Physical address of the first byte inside the region */
     void *vaddr; /* Virtual address of the first byte inside the region */
     void *vend; /* Virtual address of the first byte after the region */
+    rb_node_t rb_node; /* Node of a red-black tree this region is stored in */
     unsigned int flags; /* Memory region flags */
-    rb_node_t *rb_node; /* Node of a red-black tree this region is stored in */
-    unsigned long gap; /* Gap before this region */
-    unsigned long max_gap; /* Largest unmapped area in the subtree */
+    map_gap_t gap; /* Gap before this region */
+    map_gap_t max_gap; /* Largest unmapped area in the subtree */
+#ifdef MYMAP_GAP_INDEX
+    rb_node_t gap_node; /* Node of the tree of gaps (only if gap isn't empty) */
+    unsigned long gap_count; /* Number of gaps in the subtree of gap_node */
+#endif
 };
 
+/* Types of operations applied in batches */
+typedef enum {
+    MYMAP_OP_MMAP, /* Map new region */
+    MYMAP_OP_MUNMAP, /* Unmap region containing given address */
+} map_op_type_t;
+
+/* Operation applied as a part of a batch */
+typedef struct {
+    map_op_type_t type; /* Type of the operation */
+    void *vaddr; /* Suggested address (MYMAP_OP_MMAP) or any address from the
+                  * region to unmap (MYMAP_OP_MUNMAP) */
+    size_t size; /* Size of the mapped region (MYMAP_OP_MMAP only) */
+    unsigned int flags; /* Mapping attributes (MYMAP_OP_MMAP only) */
+    void *paddr; /* Physical address of the region (MYMAP_OP_MMAP only) */
+    void *result; /* Address the region was mapped to or the beginning of the
+                   * unmapped region. MYMAP_FAILED if operation failed. */
+} map_op_t;
+
+/* Description of a region used to build the map in bulk */
+typedef struct {
+    void *paddr; /* Physical address of the first byte inside the region */
+    void *vaddr; /* Virtual address of the first byte inside the region */
+    void *vend; /* Virtual address of the first byte after the region */
+    unsigned int flags; /* Memory region flags */
+} map_region_desc_t;
+
+/* Operations recorded in traces of the map */
+typedef enum {
+    MYMAP_TRACE_INIT, /* Beginning of the trace: vaddr and result are the base
+                       * and the end of the address space, flags the policy */
+    MYMAP_TRACE_REGION, /* Region mapped when tracing started or built by
+                         * mymap_build_sorted: vaddr, size, flags and paddr */
+    MYMAP_TRACE_POLICY, /* mymap_set_policy: flags are the new policy */
+    MYMAP_TRACE_MMAP, /* mymap_mmap(_aligned): all fields */
+    MYMAP_TRACE_MUNMAP, /* mymap_munmap: vaddr, result is the beginning of the
+                         * unmapped region */
+    MYMAP_TRACE_MUNMAP_RANGE, /* mymap_munmap_range: vaddr and size */
+    MYMAP_TRACE_MPROTECT, /* mymap_mprotect: vaddr, size and flags */
+    MYMAP_TRACE_UNMAPPED_AREA, /* mymap_get_unmapped_area(_aligned): vaddr,
+                                * size and align */
+    MYMAP_TRACE_BATCH, /* mymap_batch: size is the number of operations, which
+                        * follow as MYMAP_TRACE_MMAP and MYMAP_TRACE_MUNMAP
+                        * records in order of the array */
+    MYMAP_TRACE_COALESCING, /* mymap_enable_coalescing (also follows the
+                             * initial regions if it was enabled before) */
+    MYMAP_TRACE_BUILD, /* mymap_build_sorted: size is the number of regions,
+                        * which follow as MYMAP_TRACE_REGION records */
+} map_trace_op_t;
+
+/* Record of a single operation. Records have fixed size and are written in
+ * native byte order, so a trace file is just an array of them. */
+typedef struct {
+    uint8_t op; /* Operation (map_trace_op_t) */
+    uint8_t align_shift; /* Alignment of the area (log2) */
+    uint16_t reserved; /* Always zero */
+    uint32_t flags; /* Memory region flags or policy */
+    uint64_t vaddr; /* Virtual address passed to the operation */
+    uint64_t size; /* Size or length passed to the operation */
+    uint64_t paddr; /* Physical address passed to the operation */
+    uint64_t result; /* Returned address, MYMAP_FAILED if the operation
+                      * failed (NULL if it succeeded and returns no address) */
+} map_trace_rec_t;
+
+/* Function receiving records of operations on a traced map */
+typedef void (*map_trace_fn_t)(void *arg, const map_trace_rec_t *rec);
+
+/* Function called for every region visited by mymap_for_each_region_from.
+ * Returns zero to continue with the next region. */
+typedef int (*map_region_fn_t)(void *arg, map_region_t *region);
+
+/* Function called for every gap visited by mymap_for_each_gap with its
+ * beginning and size. Returns zero to continue with the next gap. */
+typedef int (*map_gap_fn_t)(void *arg, void *start, size_t size);
+
+/* Function receiving output of flat dumps. Returns zero if the whole buffer
+ * was written. */
+typedef int (*map_writer_t)(void *arg, const char *buf, size_t len);
+
+typedef struct map_slab_s map_slab_t;
+typedef union map_pool_obj_u map_pool_obj_t;
+
+typedef struct {
+    map_slab_t *slabs; /* List of slabs allocated by the pool */
+    map_pool_obj_t *free; /* List of released region descriptors */
+    map_pool_obj_t *next; /* Next never used descriptor in the newest slab */
+    map_pool_obj_t *end; /* End of the newest slab */
+    size_t slab_size; /* Number of descriptors per slab (0 if pool is not
+                       * used and descriptors are allocated one by one) */
+} map_pool_t;
+
+typedef struct {
+    map_region_t *regions[MYMAP_CACHE_SIZE]; /* Recently found regions */
+    unsigned long hits; /* Number of lookups answered from the cache */
+    unsigned long misses; /* Number of lookups which had to search the tree */
+} map_cache_t;
+
+typedef struct map_bnode_s map_bnode_t;
+
+typedef struct {
+    map_bnode_t *root; /* Root node (NULL if the tree is empty) */
+    unsigned height; /* Number of levels of nodes */
+    map_bnode_t *spare; /* List of nodes kept for the next insertion */
+    unsigned spare_count; /* Number of spare nodes */
+} map_btree_t;
+
+/* Number of size classes of gaps. Class i holds gaps of 2^i to 2^(i+1) - 1
+ * bytes. */
+#define MYMAP_GAP_CLASSES       (sizeof(unsigned long)*CHAR_BIT)
+
+/* Accounting of the address space of the map. It's updated together with the
+ * gaps, so reading it doesn't need to visit any regions. Gaps include the
+ * area after the last region and empty gaps between adjacent regions are not
+ * counted. */
+typedef struct {
+    size_t mapped; /* Bytes covered by regions */
+    size_t unmapped; /* Bytes not covered by any region */
+    size_t regions; /* Number of regions */
+    size_t gaps; /* Number of gaps */
+    size_t largest_gap; /* Size of the largest gap */
+    size_t gap_classes[MYMAP_GAP_CLASSES]; /* Numbers of gaps in each size
+                                            * class */
+} map_space_t;
+
+/* Counters of work done on hot paths of the map (MYMAP_STATS only). Nodes
+ * visited and tree rebalancing are counted for MYMAP_RBTREE backend. */
+typedef struct {
+    unsigned long searches; /* Searches for unmapped area */
+    unsigned long first_phase_nodes; /* Nodes visited while descending to
+                                      * suggested address */
+    unsigned long second_phase_nodes; /* Nodes visited while looking for a gap
+                                       * beyond suggested address */
+    unsigned long last_gap_checks; /* Searches which ended up checking the
+                                    * gap after the last region */
+    unsigned long next_calls; /* Steps to the next or the previous region */
+    unsigned long subtree_next_calls; /* Steps over a whole subtree */
+    unsigned long insert_fixups; /* Iterations of fixup after insertion */
+    unsigned long insert_rotations; /* Rotations done by those fixups */
+    unsigned long delete_fixups; /* Iterations of fixup after deletion */
+    unsigned long delete_rotations; /* Rotations done by those fixups */
+    unsigned long allocations; /* Memory blocks allocated by the map */
+} map_stats_t;
+
 typedef struct {
-    rb_tree_t rb_tree; /* Red-black tree of mapped areas */
+    map_backend_t backend; /* Data structure the regions are kept in */
+    rb_tree_t rb_tree; /* Red-black tree of mapped areas (MYMAP_RBTREE) */
+    map_btree_t btree; /* B-tree of mapped areas (MYMAP_BTREE) */
+#ifdef MYMAP_GAP_INDEX
+    rb_tree_t gap_index; /* Gaps before regions ordered by size and address */
+#endif
+    void *va_base; /* Base of the address space managed by the map */
+    void *va_end; /* End (last address) of the address space */
+    map_pool_t pool; /* Pool of region descriptors */
     unsigned long last_gap; /* Size of the area between the last region and the
                              * end of the address space */
+    map_space_t space; /* Unmapped bytes, regions and gaps (mapped bytes and
+                        * the largest gap are filled in when it's read) */
+    map_policy_t policy; /* Placement policy of new regions */
+    int coalesce; /* Nonzero if new regions are merged with compatible
+                   * neighbours by mmap */
+    int deferred; /* Nonzero if updates of largest gaps are deferred until
+                   * the end of a batch */
+    map_cache_t cache; /* Cache of recently found regions */
+    map_trace_fn_t trace; /* Receives records of operations (NULL if the map
+                           * isn't traced) */
+    void *trace_arg; /* Argument passed to the trace function */
+    int thread_safe; /* Nonzero if operations on the map take the lock */
+    MYMAP_RWLOCK_T lock; /* Lock shared by lookups and taken exclusively by
+                          * operations modifying the map */
+    unsigned long generation; /* Number of times the lock was taken
+                               * exclusively */
+#ifdef MYMAP_STATS
+    map_stats_t stats; /* Counters of work done on hot paths */
+#endif
 } map_t;
 
+/* Increments counter of the map statistics (does nothing unless MYMAP_STATS
+ * is defined) */
+#ifdef MYMAP_STATS
+#define MYMAP_STAT(map, counter)    ((map)->stats.counter++)
+#else
+#define MYMAP_STAT(map, counter)    ((void)0)
+#endif
+
 /* Exported functions ------------------------------------------------------- */
 
 /**
- * Initializes map.
+ * Initializes map managing the default address space between MYMAP_VA_BASE and
+ * MYMAP_VA_END.
  * @param map Pointer to the map instance.
  * @return Returns zero if operation succeeds. Otherwise returns error code.
  */
 int mymap_init(map_t *map);
 
+/**
+ * Initializes map managing given address space. Each map has its own space,
+ * so maps created this way may cover different parts of a full 64-bit address
+ * space.
+ * @param map Pointer to the map instance.
+ * @param va_base Base of the address space (smallest available address).
+ * Must not be NULL.
+ * @param va_end End (last address) of the address space. Must be lower than
+ * the highest address representable in a pointer.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_init_range(map_t *map, void *va_base, void *va_end);
+
+/**
+ * Initializes map which allocates region descriptors from its own pool. The
+ * pool is made of slabs holding a fixed number of descriptors each, which are
+ * released all at once by mymap_destroy.
+ * @param map Pointer to the map instance.
+ * @param slab_size Number of region descriptors in a single slab or zero to
+ * use MYMAP_POOL_SLAB_SIZE.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_init_pool(map_t *map, size_t slab_size);
+
+/**
+ * Makes operations on the map safe to call from multiple threads. Lookups and
+ * searches for unmapped areas may run concurrently, while operations
+ * modifying the map are exclusive. Has to be called before the map is shared
+ * between threads. Initialization, mymap_build_sorted and mymap_destroy are
+ * never synchronized.
+ * @param map Pointer to the map instance.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_enable_locking(map_t *map);
+
+/**
+ * Makes mymap_mmap merge new regions with neighbours which have the same flags
+ * and are contiguous both in virtual and physical memory (mymap_mprotect
+ * merges such regions whether coalescing is enabled or not). It keeps the
+ * number of regions low, but mymap_munmap removes whole regions, so afterwards
+ * it removes every mapping merged into the region too. Maps which coalesce
+ * regions should be unmapped with mymap_munmap_range.
+ * @param map Pointer to the map instance.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_enable_coalescing(map_t *map);
+
+/**
+ * Unmaps all regions and releases all the memory used by the map.
+ * @param map Pointer to the map instance.
+ */
+void mymap_destroy(map_t *map);
+
+/**
+ * Builds the map from an array of regions sorted by their virtual addresses in
+ * linear time. All region descriptors are allocated in a single block, which
+ * becomes part of the pool of the map (the pool is enabled if it wasn't).
+ * @param map Pointer to the empty map instance.
+ * @param regions Array of region descriptions sorted by virtual address.
+ * Regions must not overlap and have to fit in the address space.
+ * @param count Number of regions in the array.
+ * @return Returns zero if operation succeeds. Otherwise returns error code and
+ * leaves the map untouched.
+ */
+int mymap_build_sorted(map_t *map, const map_region_desc_t *regions,
+        size_t count);
+
+/**
+ * Sets boundaries of the address space managed by the map. Maps are
+ * initialized with the whole space between MYMAP_VA_BASE and MYMAP_VA_END.
+ * Size of the space has to be lower than MYMAP_GAP_MAX and its end lower than
+ * the highest address representable in a pointer.
+ * @param map Pointer to the map instance. The map has to be empty.
+ * @param va_base Base of the address space (smallest available address).
+ * Must not be NULL.
+ * @param va_end End (last address) of the address space.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_set_range(map_t *map, void *va_base, void *va_end);
+
+/**
+ * Selects data structure regions of the map are kept in. Maps are initialized
+ * with MYMAP_RBTREE backend. MYMAP_BTREE keeps regions in leaves of a B-tree,
+ * which makes lookups and searches for unmapped areas in large maps touch less
+ * memory, at the cost of more expensive walks to neighbouring regions.
+ * @param map Pointer to the map instance. The map has to be empty.
+ * @param backend Data structure to use.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_set_backend(map_t *map, map_backend_t backend);
+
+/**
+ * Selects policy of placing new regions in the address space of the map. Maps
+ * are initialized with MYMAP_BOTTOM_UP policy.
+ * @param map Pointer to the map instance.
+ * @param policy Placement policy.
+ * @return Returns zero if operation succeeds. Otherwise (also for
+ * MYMAP_BEST_FIT if the map was compiled without MYMAP_GAP_INDEX) returns
+ * error code.
+ */
+int mymap_set_policy(map_t *map, map_policy_t policy);
+
+/**
+ * Starts or stops recording operations on the map. Records of the initial
+ * state of the map (address space, policy and all mapped regions) are passed
+ * to the trace function right away, followed by a record of every operation
+ * changing the map or searching for unmapped area, so that the trace can be
+ * replayed on a fresh map. Operations are recorded before the lock of
+ * a thread-safe map is released, so records of operations changing the map
+ * come in the order they were applied, and traces of maps shared by several
+ * writers can be replayed too. The function has to be thread-safe if searches
+ * may run concurrently. Lookups are not recorded.
+ * @param map Pointer to the map instance.
+ * @param trace Function receiving the records or NULL to stop recording.
+ * @param arg Argument passed to the function.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_set_trace(map_t *map, map_trace_fn_t trace, void *arg);
+
+/**
+ * Trace function appending records to a file.
+ * @param file Stream opened for writing in binary mode (FILE*).
+ * @param rec Record of the operation.
+ */
+void mymap_trace_write(void *file, const map_trace_rec_t *rec);
+
+/**
+ * Copies statistics of the map. Counters of thread-safe maps are updated by
+ * concurrent searches without synchronization, so they are approximate then.
+ * @param map Pointer to the map instance.
+ * @param stats Pointer to the structure the counters are copied to.
+ * @return Returns zero if operation succeeds. Otherwise (also if the map was
+ * compiled without MYMAP_STATS) returns error code.
+ */
+int mymap_get_stats(map_t *map, map_stats_t *stats);
+
+/**
+ * Sets all counters of the map statistics to zero.
+ * @param map Pointer to the map instance.
+ * @return Returns zero if operation succeeds. Otherwise (also if the map was
+ * compiled without MYMAP_STATS) returns error code.
+ */
+int mymap_reset_stats(map_t *map);
+
 /**
  * Dumps structure of the map in human-readable format to stdout.
  * @param map Pointer to the map instance.
@@ -70,45 +469,270 @@ int mymap_init(map_t *map);
  */
 int mymap_dump(map_t *map);
 
+/**
+ * Calls function for regions of the map in order of their addresses, starting
+ * with the region containing given address or the first one after it. Finding
+ * the first region takes logarithmic time and every next one constant time on
+ * average. The map must not be modified by the function. Thread-safe maps stay
+ * locked for reading until the iteration ends.
+ * @param map Pointer to the map instance.
+ * @param vaddr Virtual address to start from.
+ * @param fn Function called for every region.
+ * @param arg Argument passed to the function.
+ * @return Returns zero if all regions were visited or the function stopped
+ * the iteration. Otherwise returns error code.
+ */
+int mymap_for_each_region_from(map_t *map, void *vaddr, map_region_fn_t fn,
+        void *arg);
+
+/**
+ * Calls function for unmapped areas of at least given size in order of their
+ * addresses, including the area after the last region. Subtrees without such
+ * gaps are skipped using their largest gaps, so finding every next gap takes
+ * at most logarithmic time however many smaller gaps lie in between. The map
+ * must not be modified by the function. Thread-safe maps stay locked for
+ * reading until the iteration ends.
+ * @param map Pointer to the map instance.
+ * @param min_size Minimum size of the gaps (gaps are never empty, so zero
+ * works like one).
+ * @param fn Function called for every gap.
+ * @param arg Argument passed to the function.
+ * @return Returns zero if all gaps were visited or the function stopped the
+ * iteration. Otherwise returns error code.
+ */
+int mymap_for_each_gap(map_t *map, size_t min_size, map_gap_fn_t fn,
+        void *arg);
+
+/**
+ * Writes all regions of the map in order of their addresses, one line per
+ * region:
+ *
+ *   vaddr-vend rwx paddr
+ *
+ * Addresses are written as hexadecimal numbers with all digits of a pointer
+ * and flags which are not set are replaced with '-'. Lines are formatted in
+ * a buffer of MYMAP_DUMP_BUFFER_SIZE bytes on the stack, which is passed to
+ * the writer whenever it fills up, so no memory is allocated. Thread-safe maps
+ * stay locked for reading until the whole dump is written.
+ * @param map Pointer to the map instance.
+ * @param writer Function receiving the output.
+ * @param arg Argument passed to the function.
+ * @return Returns zero if operation succeeds. Otherwise (also if the writer
+ * fails) returns error code.
+ */
+int mymap_dump_regions(map_t *map, map_writer_t writer, void *arg);
+
+/**
+ * Writes all regions of the map to a file descriptor in the format of
+ * mymap_dump_regions.
+ * @param map Pointer to the map instance.
+ * @param fd File descriptor opened for writing.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_dump_fd(map_t *map, int fd);
+
 /**
  * Maps region defined by arguments to process address space to address greater
- * or equal than suggested address.
- * Returns address the region was mapped to.
+ * or equal than suggested address (lower or equal with MYMAP_TOP_DOWN policy).
+ * Returns address the region was mapped to. If coalescing is enabled and the
+ * new region is adjacent to a region with the same flags and contiguous
+ * physical address, it's merged with that region instead of being mapped
+ * separately (see mymap_enable_coalescing). In thread-safe maps the
+ * area is searched for under the shared lock and searched for again once the
+ * lock is taken exclusively if another thread has changed the map meanwhile,
+ * so the region is placed as if the map was used by a single thread.
  * @param map Pointer to the map instance.
- * @param vaddr Suggested address to map to.
+ * @param vaddr Suggested address to map to. If NULL, the region is placed as
+ * low (or high with MYMAP_TOP_DOWN policy) as possible.
  * @param size Size of the mapped region.
  * @param flags Mapping attributes.
  * @param o Address of the beginning of the mapped region.
  * @return On success, returns address the region was mapped to. On failure,
  * MYMAP_FAILED is returned.
  */
-void *mymap_mmap(map_t *map, void *vaddr, unsigned int size, unsigned int flags,
+void *mymap_mmap(map_t *map, void *vaddr, size_t size, unsigned int flags,
         void *o);
 
 /**
- * Unmaps region containing address passed as a parameter.
+ * Works like mymap_mmap, but maps the region to address aligned to given
+ * boundary.
+ * @param map Pointer to the map instance.
+ * @param vaddr Suggested address to map to.
+ * @param size Size of the mapped region.
+ * @param align Alignment of the region (power of two, zero or one if any
+ * address will do).
+ * @param flags Mapping attributes.
+ * @param o Address of the beginning of the mapped region.
+ * @return On success, returns address the region was mapped to. On failure,
+ * MYMAP_FAILED is returned.
+ */
+void *mymap_mmap_aligned(map_t *map, void *vaddr, size_t size,
+        unsigned long align, unsigned int flags, void *o);
+
+/**
+ * Finds region containing given address. Recently found regions are kept in
+ * a small cache, so repeated lookups of nearby addresses usually don't have to
+ * search the tree. Lookups in thread-safe maps don't use the cache, since they
+ * would all write to it while holding the shared lock. The region belongs to
+ * the map, so in thread-safe maps a concurrent operation may change or release
+ * it as soon as the lookup returns. Use mymap_find_copy to read the region
+ * then.
+ * @param map Pointer to the map instance.
+ * @param vaddr Virtual address.
+ * @return Pointer to the region containing the address or NULL if the address
+ * is not mapped.
+ */
+map_region_t* mymap_find(map_t *map, void *vaddr);
+
+/**
+ * Works like mymap_find, but copies description of the region while the map
+ * is still locked, so it's safe to use with concurrent operations.
+ * @param map Pointer to the map instance.
+ * @param vaddr Virtual address.
+ * @param desc Pointer to the structure the description is copied to.
+ * @return Returns zero if the address is mapped. Otherwise returns error code
+ * and leaves the structure untouched.
+ */
+int mymap_find_copy(map_t *map, void *vaddr, map_region_desc_t *desc);
+
+/**
+ * Unmaps region containing address passed as a parameter. Mappings merged
+ * together by mymap_mmap with coalescing enabled (or by mymap_mprotect) make up
+ * a single region, so all of them are unmapped, not only the one containing
+ * the address. Use mymap_munmap_range to unmap a part of such region.
  * @param map Pointer to the map instance.
  * @param vaddr Any address from the region to unmap.
  */
 void mymap_munmap(map_t *map, void *vaddr);
 
 /**
- * Allocates and initializes region and tree node structures
+ * Unmaps all addresses in given range. Regions which lie partially inside the
+ * range are trimmed, and a region containing the whole range is split in two.
+ * @param map Pointer to the map instance.
+ * @param vaddr Beginning of the range.
+ * @param len Length of the range in bytes.
+ * @return Returns zero if operation succeeds. Otherwise returns error code and
+ * leaves the map untouched.
+ */
+int mymap_munmap_range(map_t *map, void *vaddr, size_t len);
+
+/**
+ * Changes flags of all regions in given range. Regions which lie partially
+ * inside the range are split at its boundaries. Afterwards regions in the
+ * range are merged with each other and with their neighbours if they have the
+ * same flags and are contiguous both in virtual and physical memory, even if
+ * coalescing isn't enabled, so restoring the flags undoes the splits.
+ * @param map Pointer to the map instance.
+ * @param vaddr Beginning of the range.
+ * @param len Length of the range in bytes.
+ * @param flags New memory region flags.
+ * @return Returns zero if operation succeeds. If any part of the range is not
+ * mapped returns error code and leaves the map untouched.
+ */
+int mymap_mprotect(map_t *map, void *vaddr, size_t len,
+        unsigned int flags);
+
+/**
+ * Applies a batch of mmap and munmap operations. Operations are split into
+ * chunks of MYMAP_BATCH_CHUNK, which are applied one after another. Inside a
+ * chunk operations are sorted and applied in order of their addresses
+ * (operations with equal addresses in order of appearance in the array).
+ * Consecutive munmap operations of adjacent regions are applied at once, so
+ * largest gaps are recomputed and gaps merged once per such run. Unmapping
+ * 10^6 contiguous regions in batches of 100-10000 takes 0.35-0.6 of the time
+ * of separate mymap_munmap calls, while unmapping scattered regions takes
+ * about the same time.
+ * @param map Pointer to the map instance.
+ * @param ops Array of operations. Result of each operation is stored in its
+ * result field.
+ * @param count Number of operations in the array.
+ * @return Returns zero if all operations succeeded. Otherwise returns error
+ * code.
+ */
+int mymap_batch(map_t *map, map_op_t *ops, size_t count);
+
+/**
+ * Allocates and initializes region structure together with the tree node
+ * embedded in it
+ * @param map Pointer to the map instance the region will belong to
  * @param paddr Physical address of the region
  * @param flags Memory region flags
  * @return Pointer to the region structure if operation succeeds. Otherwise
  * returns NULL.
  */
-map_region_t* mymap_create_region(void *paddr, unsigned int flags);
+map_region_t* mymap_create_region(map_t *map, void *paddr, unsigned int flags);
 
 /**
  * Searches the tree of regions to find a right place for a new region (gap big
- * enough and virtual address greater or equal to suggested in parameter)
+ * enough and virtual address greater or equal to suggested in parameter). With
+ * MYMAP_TOP_DOWN policy, the highest area starting at or below suggested
+ * address is returned instead. With MYMAP_BEST_FIT policy, suggested address
+ * is returned if the area there is free and otherwise the beginning of the
+ * smallest gap the area fits in, found in logarithmic time in the index of
+ * gaps.
  * @param map Pointer to the map instance
  * @param vaddr Suggested virtual address
  * @param size Size of the new region
  */
 void* mymap_get_unmapped_area(map_t *map, void *vaddr,
-        unsigned int size);
+        size_t size);
+
+/**
+ * Works like mymap_get_unmapped_area, but returns address aligned to given
+ * boundary. To keep the search logarithmic, only gaps which can hold the area
+ * regardless of their alignment are considered, i.e. the part of the gap on
+ * the right side of suggested address has to be at least size + align - 1
+ * bytes long.
+ * @param map Pointer to the map instance
+ * @param vaddr Suggested virtual address
+ * @param size Size of the new region
+ * @param align Alignment of the new region (power of two, zero or one if any
+ * address will do)
+ */
+void* mymap_get_unmapped_area_aligned(map_t *map, void *vaddr,
+        size_t size, unsigned long align);
+
+/**
+ * Finds the smallest unmapped area of at least given size (the lowest one if
+ * there are more of them), including the area after the last region. Takes
+ * logarithmic time with MYMAP_GAP_INDEX. Otherwise every area at least that
+ * big is visited.
+ * @param map Pointer to the map instance.
+ * @param min_size Minimum size of the area.
+ * @param size Size of the area found is stored here (may be NULL).
+ * @return Beginning of the area or MYMAP_FAILED if there is no such area.
+ */
+void* mymap_smallest_gap(map_t *map, size_t min_size, size_t *size);
+
+/**
+ * Finds the largest unmapped area (the lowest one if there are more of them),
+ * including the area after the last region. Takes logarithmic time.
+ * @param map Pointer to the map instance.
+ * @param size Size of the area found is stored here (may be NULL).
+ * @return Beginning of the area or MYMAP_FAILED if the whole address space is
+ * mapped.
+ */
+void* mymap_largest_gap(map_t *map, size_t *size);
+
+/**
+ * Counts unmapped areas of at least given size, including the area after the
+ * last region. Takes logarithmic time with MYMAP_GAP_INDEX. Otherwise every
+ * area at least that big is visited.
+ * @param map Pointer to the map instance.
+ * @param min_size Minimum size of the areas (zero works like one).
+ * @return Number of the areas.
+ */
+size_t mymap_count_gaps(map_t *map, size_t min_size);
+
+/**
+ * Reads accounting of the address space of the map: mapped and unmapped bytes,
+ * number of regions, the largest gap (including the area after the last
+ * region, whose last byte can't be mapped) and the histogram of gap sizes. It
+ * is kept up to date by every operation, so it takes constant time.
+ * @param map Pointer to the map instance.
+ * @param space Pointer to the structure the accounting is copied to.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_get_space(map_t *map, map_space_t *space);
 
 #endif /* MYMAP_H_ */
@@ -0,0 +1,803 @@
+/*
+ * mymap_btree.c
+ *
+ *  Created on: 18.10.2026
+ */
+
+#include "mymap_btree.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Private macros ----------------------------------------------------------- */
+
+/* Minimum number of used slots in nodes other than the root */
+#define MYMAP_BTREE_MIN         (MYMAP_BTREE_SLOTS/2)
+
+/* Maximum height of the tree. Every node but the root has at least
+ * MYMAP_BTREE_MIN slots, so that's way more than any address space needs. */
+#define MYMAP_BTREE_MAX_HEIGHT  (32)
+
+#define BNODE(ptr)              ((map_bnode_t*)(ptr))
+#define BREGION(ptr)            ((map_region_t*)(ptr))
+
+/* Map the tree belongs to */
+#define BTREE_MAP(btree)                                                    \
+    ((map_t*)((char*)(btree) - offsetof(map_t, btree)))
+
+#define ALIGN_DOWN(addr, align)                                             \
+    ((void*)((uintptr_t)(addr) & ~((uintptr_t)(align) - 1)))
+
+/* Private functions -------------------------------------------------------- */
+/**
+ * Takes node from the list of spare nodes or allocates a new one
+ * @param btree Pointer to the tree
+ * @return Pointer to the empty node or NULL if it could not be allocated
+ */
+static map_bnode_t* mymap_bnode_alloc(map_btree_t *btree);
+
+/**
+ * Puts node back on the list of spare nodes or releases it if there are
+ * enough of them
+ * @param btree Pointer to the tree
+ * @param node Pointer to the node
+ */
+static void mymap_bnode_release(map_btree_t *btree, map_bnode_t *node);
+
+/**
+ * Makes sure there are enough spare nodes to split every node on the path
+ * from the root to a leaf and to add a new root
+ * @param btree Pointer to the tree
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+static int mymap_bnode_reserve(map_btree_t *btree);
+
+/**
+ * Returns the largest gap in the node
+ * @param node Pointer to the node
+ * @return Size of the gap
+ */
+static inline unsigned long mymap_bnode_max_gap(const map_bnode_t *node);
+
+/**
+ * Selects the slot which given address belongs to, i.e. the last slot with
+ * pivot lower or equal to the address (or the first one if there is none)
+ * @param node Pointer to the node
+ * @param vaddr Virtual address
+ * @return Index of the slot
+ */
+static inline unsigned mymap_bnode_route(const map_bnode_t *node, void *vaddr);
+
+/**
+ * Inserts slot to the node, moving following slots to the right
+ * @param node Pointer to the node (with at least one free slot)
+ * @param index Index of the new slot
+ * @param pivot Pivot of the slot
+ * @param gap Largest gap of the slot
+ * @param slot Region or child node
+ */
+static void mymap_bnode_insert_slot(map_bnode_t *node, unsigned index,
+        void *pivot, unsigned long gap, void *slot);
+
+/**
+ * Removes slot from the node, moving following slots to the left
+ * @param node Pointer to the node
+ * @param index Index of the slot
+ */
+static void mymap_bnode_remove_slot(map_bnode_t *node, unsigned index);
+
+/**
+ * Updates pivot and largest gap of the slot after its child changed
+ * @param node Pointer to the node
+ * @param index Index of the slot
+ */
+static inline void mymap_bnode_refresh_slot(map_bnode_t *node, unsigned index);
+
+/**
+ * Inserts region into the subtree
+ * @param btree Pointer to the tree
+ * @param node Root of the subtree
+ * @param height Height of the subtree (1 for leaves)
+ * @param region Pointer to the region
+ * @return New node holding the upper half of the root of the subtree if it had
+ * to be split, NULL otherwise
+ */
+static map_bnode_t* mymap_btree_insert_subtree(map_btree_t *btree,
+        map_bnode_t *node, unsigned height, map_region_t *region);
+
+/**
+ * Removes region starting at given address from the subtree
+ * @param btree Pointer to the tree
+ * @param node Root of the subtree
+ * @param height Height of the subtree (1 for leaves)
+ * @param vaddr Virtual address of the region
+ */
+static void mymap_btree_delete_subtree(map_btree_t *btree, map_bnode_t *node,
+        unsigned height, void *vaddr);
+
+/**
+ * Refills child node which has too few slots, either by moving a slot from
+ * one of its siblings or by merging it with one of them
+ * @param btree Pointer to the tree
+ * @param node Pointer to the parent node
+ * @param index Index of the child in the parent node
+ * @return Index of the slot the child's contents are in now
+ */
+static unsigned mymap_btree_rebalance(map_btree_t *btree, map_bnode_t *node,
+        unsigned index);
+
+/**
+ * Finds path from the root to the leaf slot holding region starting at given
+ * address
+ * @param btree Pointer to the tree
+ * @param vaddr Virtual address of the region
+ * @param path Array the nodes on the path are stored in
+ * @param index Array indexes of the slots on the path are stored in
+ */
+static void mymap_btree_path(map_btree_t *btree, void *vaddr,
+        map_bnode_t **path, unsigned *index);
+
+/**
+ * Bottom-up search for unmapped area in the subtree
+ */
+static void* mymap_btree_bottomup_subtree(map_bnode_t *node, unsigned height,
+        void *vaddr, unsigned long size);
+
+/**
+ * Top-down search for unmapped area in the subtree. If first_only is set,
+ * only the gap before the first region of the subtree is considered.
+ */
+static void* mymap_btree_topdown_subtree(map_bnode_t *node, unsigned height,
+        void *vaddr, unsigned long size, unsigned long align, bool first_only);
+
+/**
+ * Calls function for regions of the subtree, starting with the one containing
+ * given address or the first one after it (see mymap_btree_for_each_region)
+ * @param node Root of the subtree
+ * @param height Height of the subtree
+ * @param vaddr Virtual address
+ * @param fn Function called for every region
+ * @param arg Argument passed to the function
+ * @return Zero or the value returned by the function which stopped the walk
+ */
+static int mymap_btree_regions_subtree(map_bnode_t *node, unsigned height,
+        void *vaddr, map_region_fn_t fn, void *arg);
+
+/**
+ * Calls function for gaps of the subtree (see mymap_btree_for_each_gap)
+ * @param node Root of the subtree
+ * @param height Height of the subtree
+ * @param min_size Minimum size of the gaps
+ * @param fn Function called for every gap
+ * @param arg Argument passed to the function
+ * @return Zero or the value returned by the function which stopped the walk
+ */
+static int mymap_btree_gaps_subtree(map_bnode_t *node, unsigned height,
+        unsigned long min_size, map_gap_fn_t fn, void *arg);
+
+/**
+ * Releases all nodes of the subtree
+ */
+static void mymap_btree_destroy_subtree(map_t *map, map_bnode_t *node,
+        unsigned height, void (*release)(map_t *map, map_region_t *region));
+
+/**
+ * Prints the subtree
+ */
+static void mymap_btree_dump_subtree(map_bnode_t *node, unsigned height,
+        unsigned depth);
+
+/* Exported functions ------------------------------------------------------- */
+int mymap_btree_insert(map_t *map, map_region_t *region) {
+    map_btree_t *btree = &map->btree;
+    map_bnode_t *sibling, *root;
+
+    if (mymap_bnode_reserve(btree) != MYMAP_OK) return MYMAP_ERR;
+
+    if (btree->root == NULL) {
+        btree->root = mymap_bnode_alloc(btree);
+        btree->height = 1;
+    }
+
+    sibling = mymap_btree_insert_subtree(btree, btree->root, btree->height,
+            region);
+    if (sibling != NULL) {
+
+        /* Root was split, so the tree grows by one level */
+        root = mymap_bnode_alloc(btree);
+        mymap_bnode_insert_slot(root, 0, btree->root->pivots[0],
+                mymap_bnode_max_gap(btree->root), btree->root);
+        mymap_bnode_insert_slot(root, 1, sibling->pivots[0],
+                mymap_bnode_max_gap(sibling), sibling);
+        btree->root = root;
+        btree->height++;
+    }
+
+    return MYMAP_OK;
+}
+
+void mymap_btree_delete(map_t *map, map_region_t *region) {
+    map_btree_t *btree = &map->btree;
+    map_bnode_t *root;
+
+    if (btree->root == NULL) return;
+
+    mymap_btree_delete_subtree(btree, btree->root, btree->height,
+            region->vaddr);
+
+    /* Root with a single child is not needed anymore and an empty leaf means
+     * the tree is empty */
+    root = btree->root;
+    if (btree->height > 1 && root->count == 1) {
+        btree->root = BNODE(root->slots[0]);
+        btree->height--;
+        mymap_bnode_release(btree, root);
+    } else if (btree->height == 1 && root->count == 0) {
+        btree->root = NULL;
+        btree->height = 0;
+        mymap_bnode_release(btree, root);
+    }
+}
+
+void mymap_btree_update_gap(map_t *map, map_region_t *region) {
+    map_bnode_t *path[MYMAP_BTREE_MAX_HEIGHT];
+    unsigned index[MYMAP_BTREE_MAX_HEIGHT], level;
+    unsigned long gap;
+
+    if (map->btree.root == NULL) return;
+
+    mymap_btree_path(&map->btree, region->vaddr, path, index);
+
+    /* Update the leaf and then largest gaps on the path up to the root, until
+     * one of them doesn't change */
+    level = map->btree.height - 1;
+    path[level]->gaps[index[level]] = region->gap;
+    while (level > 0) {
+        gap = mymap_bnode_max_gap(path[level]);
+        level--;
+        if (path[level]->gaps[index[level]] == gap) break;
+        path[level]->gaps[index[level]] = gap;
+    }
+}
+
+void mymap_btree_move(map_t *map, map_region_t *region, void *vaddr) {
+    map_bnode_t *path[MYMAP_BTREE_MAX_HEIGHT];
+    unsigned index[MYMAP_BTREE_MAX_HEIGHT], level;
+
+    if (map->btree.root == NULL) return;
+
+    mymap_btree_path(&map->btree, region->vaddr, path, index);
+
+    /* Pivots of the ancestors change as long as the region is the first one
+     * in their slots */
+    level = map->btree.height - 1;
+    path[level]->pivots[index[level]] = vaddr;
+    while (level > 0 && index[level] == 0) {
+        level--;
+        path[level]->pivots[index[level]] = vaddr;
+    }
+
+    region->vaddr = vaddr;
+}
+
+map_region_t* mymap_btree_find(map_t *map, void *vaddr) {
+    map_bnode_t *node = map->btree.root;
+    map_region_t *region;
+    unsigned height, index;
+
+    if (node == NULL) return NULL;
+
+    for (height = map->btree.height; height > 1; height--) {
+        node = BNODE(node->slots[mymap_bnode_route(node, vaddr)]);
+    }
+
+    index = mymap_bnode_route(node, vaddr);
+    if (node->pivots[index] > vaddr) return NULL;
+
+    region = BREGION(node->slots[index]);
+    return (vaddr < region->vend) ? region : NULL;
+}
+
+map_region_t* mymap_btree_neighbour(map_t *map, void *vaddr, int dir) {
+    map_bnode_t *node = map->btree.root, *side = NULL;
+    unsigned height, side_height = 0, index, i;
+
+    if (node == NULL) return NULL;
+
+    /* Descend towards the address, remembering the closest subtree on the
+     * requested side in case there's no such region in the leaf */
+    for (height = map->btree.height; height > 1; height--) {
+        index = mymap_bnode_route(node, vaddr);
+        if (dir > 0 && index + 1 < node->count) {
+            side = BNODE(node->slots[index + 1]);
+            side_height = height - 1;
+        } else if (dir <= 0 && index > 0) {
+            side = BNODE(node->slots[index - 1]);
+            side_height = height - 1;
+        }
+        node = BNODE(node->slots[index]);
+    }
+
+    if (dir > 0) {
+        for (i = 0; i < node->count; i++) {
+            if (node->pivots[i] > vaddr) return BREGION(node->slots[i]);
+        }
+    } else {
+        for (i = node->count; i > 0; i--) {
+            if (node->pivots[i - 1] < vaddr
+                    || (dir == 0 && node->pivots[i - 1] == vaddr)) {
+                return BREGION(node->slots[i - 1]);
+            }
+        }
+    }
+
+    /* It's the first (or the last) region of the closest subtree */
+    if (side == NULL) return NULL;
+    for (; side_height > 1; side_height--) {
+        side = BNODE(side->slots[(dir > 0) ? 0 : side->count - 1]);
+    }
+    return BREGION(side->slots[(dir > 0) ? 0 : side->count - 1]);
+}
+
+map_region_t* mymap_btree_edge(map_t *map, int last) {
+    map_bnode_t *node = map->btree.root;
+    unsigned height;
+
+    if (node == NULL) return NULL;
+
+    for (height = map->btree.height; height > 1; height--) {
+        node = BNODE(node->slots[last ? node->count - 1 : 0]);
+    }
+
+    return BREGION(node->slots[last ? node->count - 1 : 0]);
+}
+
+unsigned long mymap_btree_max_gap(map_t *map) {
+    return (map->btree.root != NULL) ? mymap_bnode_max_gap(map->btree.root) : 0;
+}
+
+void* mymap_btree_unmapped_bottomup(map_t *map, void *vaddr,
+        unsigned long size) {
+
+    if (map->btree.root == NULL) return MYMAP_FAILED;
+
+    return mymap_btree_bottomup_subtree(map->btree.root, map->btree.height,
+            vaddr, size);
+}
+
+void* mymap_btree_unmapped_topdown(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align) {
+
+    if (map->btree.root == NULL) return MYMAP_FAILED;
+
+    return mymap_btree_topdown_subtree(map->btree.root, map->btree.height,
+            vaddr, size, align, false);
+}
+
+int mymap_btree_for_each_region(map_t *map, void *vaddr, map_region_fn_t fn,
+        void *arg) {
+
+    if (map->btree.root == NULL) return 0;
+
+    return mymap_btree_regions_subtree(map->btree.root, map->btree.height,
+            vaddr, fn, arg);
+}
+
+int mymap_btree_for_each_gap(map_t *map, unsigned long min_size,
+        map_gap_fn_t fn, void *arg) {
+
+    if (map->btree.root == NULL) return 0;
+
+    return mymap_btree_gaps_subtree(map->btree.root, map->btree.height,
+            min_size, fn, arg);
+}
+
+void mymap_btree_destroy(map_t *map,
+        void (*release)(map_t *map, map_region_t *region)) {
+    map_bnode_t *node;
+
+    if (map->btree.root != NULL) {
+        mymap_btree_destroy_subtree(map, map->btree.root, map->btree.height,
+                release);
+    }
+
+    while (map->btree.spare != NULL) {
+        node = map->btree.spare;
+        map->btree.spare = BNODE(node->slots[0]);
+        MYMAP_FREE(node);
+    }
+
+    map->btree.root = NULL;
+    map->btree.height = 0;
+    map->btree.spare_count = 0;
+}
+
+void mymap_btree_dump(map_t *map) {
+    mymap_btree_dump_subtree(map->btree.root, map->btree.height, 0);
+}
+
+/* Private functions -------------------------------------------------------- */
+static map_bnode_t* mymap_bnode_alloc(map_btree_t *btree) {
+    map_bnode_t *node = btree->spare;
+
+    if (node != NULL) {
+        btree->spare = BNODE(node->slots[0]);
+        btree->spare_count--;
+    } else {
+        node = MYMAP_MALLOC(sizeof(map_bnode_t));
+        if (node == NULL) return NULL;
+        MYMAP_STAT(BTREE_MAP(btree), allocations);
+    }
+
+    node->count = 0;
+    return node;
+}
+
+static void mymap_bnode_release(map_btree_t *btree, map_bnode_t *node) {
+
+    /* Keep just enough nodes for the next insert */
+    if (btree->spare_count > btree->height) {
+        MYMAP_FREE(node);
+        return;
+    }
+
+    node->slots[0] = btree->spare;
+    btree->spare = node;
+    btree->spare_count++;
+}
+
+static int mymap_bnode_reserve(map_btree_t *btree) {
+    map_bnode_t *node;
+
+    while (btree->spare_count < btree->height + 1) {
+        node = MYMAP_MALLOC(sizeof(map_bnode_t));
+        if (node == NULL) return MYMAP_ERR;
+        MYMAP_STAT(BTREE_MAP(btree), allocations);
+        node->slots[0] = btree->spare;
+        btree->spare = node;
+        btree->spare_count++;
+    }
+
+    return MYMAP_OK;
+}
+
+static inline unsigned long mymap_bnode_max_gap(const map_bnode_t *node) {
+    unsigned long max_gap = 0;
+    unsigned i;
+
+    for (i = 0; i < node->count; i++) {
+        if (node->gaps[i] > max_gap) max_gap = node->gaps[i];
+    }
+
+    return max_gap;
+}
+
+static inline unsigned mymap_bnode_route(const map_bnode_t *node,
+        void *vaddr) {
+    unsigned i = 0;
+
+    while (i + 1 < node->count && node->pivots[i + 1] <= vaddr) i++;
+
+    return i;
+}
+
+static void mymap_bnode_insert_slot(map_bnode_t *node, unsigned index,
+        void *pivot, unsigned long gap, void *slot) {
+    unsigned i;
+
+    for (i = node->count; i > index; i--) {
+        node->pivots[i] = node->pivots[i - 1];
+        node->gaps[i] = node->gaps[i - 1];
+        node->slots[i] = node->slots[i - 1];
+    }
+
+    node->pivots[index] = pivot;
+    node->gaps[index] = gap;
+    node->slots[index] = slot;
+    node->count++;
+}
+
+static void mymap_bnode_remove_slot(map_bnode_t *node, unsigned index) {
+    unsigned i;
+
+    node->count--;
+    for (i = index; i < node->count; i++) {
+        node->pivots[i] = node->pivots[i + 1];
+        node->gaps[i] = node->gaps[i + 1];
+        node->slots[i] = node->slots[i + 1];
+    }
+}
+
+static inline void mymap_bnode_refresh_slot(map_bnode_t *node,
+        unsigned index) {
+    map_bnode_t *child = BNODE(node->slots[index]);
+
+    node->pivots[index] = child->pivots[0];
+    node->gaps[index] = mymap_bnode_max_gap(child);
+}
+
+static map_bnode_t* mymap_btree_insert_subtree(map_btree_t *btree,
+        map_bnode_t *node, unsigned height, map_region_t *region) {
+    map_bnode_t *sibling, *target = node, *split = NULL;
+    unsigned index, i;
+    unsigned long gap;
+    void *pivot, *slot;
+
+    if (height > 1) {
+
+        /* Insert into the child and update its slot. If the child was split,
+         * its upper half goes to the next slot. */
+        index = mymap_bnode_route(node, region->vaddr);
+        sibling = mymap_btree_insert_subtree(btree, BNODE(node->slots[index]),
+                height - 1, region);
+        mymap_bnode_refresh_slot(node, index);
+        if (sibling == NULL) return NULL;
+
+        index++;
+        pivot = sibling->pivots[0];
+        gap = mymap_bnode_max_gap(sibling);
+        slot = sibling;
+
+    } else {
+
+        /* Keep regions in the leaf sorted */
+        for (index = 0; index < node->count
+                && node->pivots[index] < region->vaddr; index++);
+        pivot = region->vaddr;
+        gap = region->gap;
+        slot = region;
+    }
+
+    /* Full node gives its upper half to a new sibling first. Spare nodes were
+     * reserved beforehand, so it can't fail. */
+    if (node->count == MYMAP_BTREE_SLOTS) {
+        split = mymap_bnode_alloc(btree);
+        for (i = MYMAP_BTREE_SLOTS/2; i < node->count; i++) {
+            mymap_bnode_insert_slot(split, split->count, node->pivots[i],
+                    node->gaps[i], node->slots[i]);
+        }
+        node->count = MYMAP_BTREE_SLOTS/2;
+        if (index > node->count) {
+            target = split;
+            index -= node->count;
+        }
+    }
+
+    mymap_bnode_insert_slot(target, index, pivot, gap, slot);
+
+    return split;
+}
+
+static void mymap_btree_delete_subtree(map_btree_t *btree, map_bnode_t *node,
+        unsigned height, void *vaddr) {
+    unsigned index = mymap_bnode_route(node, vaddr), i;
+
+    if (height == 1) {
+        mymap_bnode_remove_slot(node, index);
+        return;
+    }
+
+    mymap_btree_delete_subtree(btree, BNODE(node->slots[index]), height - 1,
+            vaddr);
+    if (BNODE(node->slots[index])->count < MYMAP_BTREE_MIN
+            && node->count > 1) {
+        index = mymap_btree_rebalance(btree, node, index);
+    }
+
+    /* Slots of the child and its siblings could have changed */
+    for (i = (index > 0) ? index - 1 : 0; i <= index + 1 && i < node->count;
+            i++) {
+        mymap_bnode_refresh_slot(node, i);
+    }
+}
+
+static unsigned mymap_btree_rebalance(map_btree_t *btree, map_bnode_t *node,
+        unsigned index) {
+    map_bnode_t *child = BNODE(node->slots[index]), *left, *right;
+    unsigned i, last;
+
+    left = (index > 0) ? BNODE(node->slots[index - 1]) : NULL;
+    right = (index + 1 < node->count) ? BNODE(node->slots[index + 1]) : NULL;
+
+    /* Borrow a slot from a sibling which can spare it */
+    if (left != NULL && left->count > MYMAP_BTREE_MIN) {
+        last = left->count - 1;
+        mymap_bnode_insert_slot(child, 0, left->pivots[last],
+                left->gaps[last], left->slots[last]);
+        left->count--;
+        return index;
+    }
+    if (right != NULL && right->count > MYMAP_BTREE_MIN) {
+        mymap_bnode_insert_slot(child, child->count, right->pivots[0],
+                right->gaps[0], right->slots[0]);
+        mymap_bnode_remove_slot(right, 0);
+        return index;
+    }
+
+    /* Otherwise merge with a sibling, which fits since both are at most half
+     * full */
+    if (left != NULL) {
+        for (i = 0; i < child->count; i++) {
+            mymap_bnode_insert_slot(left, left->count, child->pivots[i],
+                    child->gaps[i], child->slots[i]);
+        }
+        mymap_bnode_remove_slot(node, index);
+        mymap_bnode_release(btree, child);
+        return index - 1;
+    }
+
+    for (i = 0; i < right->count; i++) {
+        mymap_bnode_insert_slot(child, child->count, right->pivots[i],
+                right->gaps[i], right->slots[i]);
+    }
+    mymap_bnode_remove_slot(node, index + 1);
+    mymap_bnode_release(btree, right);
+    return index;
+}
+
+static void mymap_btree_path(map_btree_t *btree, void *vaddr,
+        map_bnode_t **path, unsigned *index) {
+    map_bnode_t *node = btree->root;
+    unsigned level;
+
+    for (level = 0; level < btree->height; level++) {
+        path[level] = node;
+        index[level] = mymap_bnode_route(node, vaddr);
+        if (level + 1 < btree->height) {
+            node = BNODE(node->slots[index[level]]);
+        }
+    }
+}
+
+static void* mymap_btree_bottomup_subtree(map_bnode_t *node, unsigned height,
+        void *vaddr, unsigned long size) {
+    void *addr, *gap_start, *region_start;
+    unsigned i;
+
+    for (i = 0; i < node->count; i++) {
+
+        /* Skip slots without a gap large enough and slots where all regions
+         * start too low to fit the area between suggested address and any of
+         * them */
+        if (node->gaps[i] < size) continue;
+        if (i + 1 < node->count && (node->pivots[i + 1] <= vaddr
+                || (unsigned long)(node->pivots[i + 1] - vaddr) <= size)) {
+            continue;
+        }
+
+        if (height > 1) {
+            addr = mymap_btree_bottomup_subtree(BNODE(node->slots[i]),
+                    height - 1, vaddr, size);
+            if (addr != MYMAP_FAILED) return addr;
+            continue;
+        }
+
+        /* Area starts at the beginning of the gap or at suggested address,
+         * whichever is higher */
+        region_start = node->pivots[i];
+        gap_start = (void*)((uintptr_t)region_start - node->gaps[i]);
+        addr = (gap_start > vaddr) ? gap_start : vaddr;
+        if (region_start >= addr
+                && (unsigned long)(region_start - addr) >= size) {
+            return addr;
+        }
+    }
+
+    return MYMAP_FAILED;
+}
+
+static void* mymap_btree_topdown_subtree(map_bnode_t *node, unsigned height,
+        void *vaddr, unsigned long size, unsigned long align,
+        bool first_only) {
+    void *addr, *gap_start, *region_start;
+    unsigned i;
+
+    for (i = first_only ? 1 : node->count; i > 0; i--) {
+
+        if (node->gaps[i - 1] < size + align - 1) continue;
+
+        if (height > 1) {
+
+            /* Gaps inside a subtree starting above suggested address start
+             * above it too, except for the gap before the subtree */
+            addr = mymap_btree_topdown_subtree(BNODE(node->slots[i - 1]),
+                    height - 1, vaddr, size, align,
+                    first_only || node->pivots[i - 1] > vaddr);
+            if (addr != MYMAP_FAILED) return addr;
+            continue;
+        }
+
+        /* Area ends at the end of the gap or starts at suggested address,
+         * whichever is lower */
+        region_start = node->pivots[i - 1];
+        gap_start = (void*)((uintptr_t)region_start - node->gaps[i - 1]);
+        addr = region_start - size;
+        if (addr > vaddr) addr = vaddr;
+        if (addr >= gap_start && (unsigned long)(addr - gap_start) >= align - 1)
+            return ALIGN_DOWN(addr, align);
+    }
+
+    return MYMAP_FAILED;
+}
+
+static int mymap_btree_regions_subtree(map_bnode_t *node, unsigned height,
+        void *vaddr, map_region_fn_t fn, void *arg) {
+    map_region_t *region;
+    unsigned i;
+    int ret;
+
+    /* Only the first subtree visited can hold regions before the address, all
+     * following ones are walked from their beginning */
+    for (i = mymap_bnode_route(node, vaddr); i < node->count; i++) {
+        if (height > 1) {
+            ret = mymap_btree_regions_subtree(BNODE(node->slots[i]),
+                    height - 1, vaddr, fn, arg);
+        } else {
+            region = BREGION(node->slots[i]);
+            if (region->vend <= vaddr) continue;
+            ret = fn(arg, region);
+        }
+        if (ret != 0) return ret;
+    }
+
+    return 0;
+}
+
+static int mymap_btree_gaps_subtree(map_bnode_t *node, unsigned height,
+        unsigned long min_size, map_gap_fn_t fn, void *arg) {
+    unsigned i;
+    int ret;
+
+    for (i = 0; i < node->count; i++) {
+
+        /* Gaps of inner slots are the largest ones of their subtrees */
+        if (node->gaps[i] < min_size) continue;
+
+        if (height > 1) {
+            ret = mymap_btree_gaps_subtree(BNODE(node->slots[i]), height - 1,
+                    min_size, fn, arg);
+        } else {
+            ret = fn(arg, (void*)((uintptr_t)node->pivots[i] - node->gaps[i]),
+                    node->gaps[i]);
+        }
+        if (ret != 0) return ret;
+    }
+
+    return 0;
+}
+
+static void mymap_btree_destroy_subtree(map_t *map, map_bnode_t *node,
+        unsigned height, void (*release)(map_t *map, map_region_t *region)) {
+    unsigned i;
+
+    for (i = 0; i < node->count; i++) {
+        if (height > 1) {
+            mymap_btree_destroy_subtree(map, BNODE(node->slots[i]), height - 1,
+                    release);
+        } else if (release != NULL) {
+            release(map, BREGION(node->slots[i]));
+        }
+    }
+
+    MYMAP_FREE(node);
+}
+
+static void mymap_btree_dump_subtree(map_bnode_t *node, unsigned height,
+        unsigned depth) {
+    map_region_t *r;
+    unsigned i;
+
+    for (i = 0; i < node->count; i++) {
+        MYMAP_PRINTF("%*s", 4*depth, "");
+        if (height > 1) {
+            MYMAP_PRINTF("[%p] max_gap: %lu\n", node->pivots[i],
+                    (unsigned long)node->gaps[i]);
+            mymap_btree_dump_subtree(BNODE(node->slots[i]), height - 1,
+                    depth + 1);
+        } else {
+            r = BREGION(node->slots[i]);
+            MYMAP_PRINTF("(vaddr: %p, vend: %p, gap: %lu)\n", r->vaddr, r->vend,
+                    (unsigned long)node->gaps[i]);
+        }
+    }
+}
@@ -0,0 +1,164 @@
+/*
+ * mymap_btree.h
+ *
+ *  Created on: 18.10.2026
+ *
+ * B-tree backend of the map. Regions are kept in leaves of a multi-way tree.
+ * Every node stores sorted pivots (smallest virtual address in each slot) and
+ * largest gaps of the slots inline, so searching for an address or a gap
+ * reads a few consecutive cache lines per level instead of following a
+ * pointer per binary decision.
+ *
+ * These functions are used by mymap.c for maps with MYMAP_BTREE backend and
+ * are not meant to be called directly. Like the red-black tree code, they keep
+ * the structure and its largest gaps consistent, while sizes of the gaps are
+ * computed by the caller.
+ */
+
+#ifndef MYMAP_BTREE_H_
+#define MYMAP_BTREE_H_
+
+#include "mymap.h"
+
+/* Exported types ----------------------------------------------------------- */
+struct map_bnode_s {
+    void *pivots[MYMAP_BTREE_SLOTS]; /* Smallest virtual address in the slot */
+    map_gap_t gaps[MYMAP_BTREE_SLOTS]; /* Largest gap in the slot (gap before
+                                        * the region in leaves) */
+    void *slots[MYMAP_BTREE_SLOTS]; /* Regions (in leaves) or child nodes */
+    unsigned count; /* Number of used slots */
+};
+
+/* Exported functions ------------------------------------------------------- */
+
+/**
+ * Inserts region into the tree. Gap before the region has to be set already.
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @return Returns zero if operation succeeds. Otherwise returns error code and
+ * leaves the tree untouched.
+ */
+int mymap_btree_insert(map_t *map, map_region_t *region);
+
+/**
+ * Removes region from the tree
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ */
+void mymap_btree_delete(map_t *map, map_region_t *region);
+
+/**
+ * Updates largest gaps after the gap before the region changed
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region with the new gap already set
+ */
+void mymap_btree_update_gap(map_t *map, map_region_t *region);
+
+/**
+ * Moves beginning of the region without changing its position among the other
+ * regions. Gap before the region has to be updated separately.
+ * @param map Pointer to the map instance
+ * @param region Pointer to the region
+ * @param vaddr New virtual address of the region
+ */
+void mymap_btree_move(map_t *map, map_region_t *region, void *vaddr);
+
+/**
+ * Finds region containing given address
+ * @param map Pointer to the map instance
+ * @param vaddr Virtual address
+ * @return Pointer to the region or NULL if the address is not mapped
+ */
+map_region_t* mymap_btree_find(map_t *map, void *vaddr);
+
+/**
+ * Finds region closest to given address
+ * @param map Pointer to the map instance
+ * @param vaddr Virtual address
+ * @param dir Positive to find the first region starting after the address,
+ * negative to find the last region starting before it and zero to find the
+ * last region starting at or before it
+ * @return Pointer to the region or NULL if there is no such region
+ */
+map_region_t* mymap_btree_neighbour(map_t *map, void *vaddr, int dir);
+
+/**
+ * Returns the first or the last region in the tree
+ * @param map Pointer to the map instance
+ * @param last Nonzero to return the last region
+ * @return Pointer to the region or NULL if the tree is empty
+ */
+map_region_t* mymap_btree_edge(map_t *map, int last);
+
+/**
+ * Returns the largest gap before any of the regions in the tree
+ * @param map Pointer to the map instance
+ * @return Size of the gap (zero if the tree is empty)
+ */
+unsigned long mymap_btree_max_gap(map_t *map);
+
+/**
+ * Finds the lowest gap before a region which can hold an area of given size at
+ * or above suggested address. Works like red-black tree based search, so the
+ * last gap isn't checked.
+ * @param map Pointer to the map instance
+ * @param vaddr Suggested address (not lower than the base of the map)
+ * @param size Size of the area
+ * @return Address of the area or MYMAP_FAILED if there is no such gap
+ */
+void* mymap_btree_unmapped_bottomup(map_t *map, void *vaddr,
+        unsigned long size);
+
+/**
+ * Finds the highest gap before a region which can hold an area of given size
+ * and alignment at or below suggested address. The last gap isn't checked.
+ * @param map Pointer to the map instance
+ * @param vaddr Suggested address
+ * @param size Size of the area
+ * @param align Alignment of the area
+ * @return Address of the area or MYMAP_FAILED if there is no such gap
+ */
+void* mymap_btree_unmapped_topdown(map_t *map, void *vaddr,
+        unsigned long size, unsigned long align);
+
+/**
+ * Calls function for regions in order of their addresses, starting with the
+ * region containing given address or the first one after it
+ * @param map Pointer to the map instance
+ * @param vaddr Virtual address
+ * @param fn Function called for every region
+ * @param arg Argument passed to the function
+ * @return Zero if all regions were visited. Otherwise the value returned by
+ * the function which stopped the walk.
+ */
+int mymap_btree_for_each_region(map_t *map, void *vaddr, map_region_fn_t fn,
+        void *arg);
+
+/**
+ * Calls function for gaps before the regions in the tree which are at least
+ * given size, in order of their addresses. The last gap isn't visited.
+ * @param map Pointer to the map instance
+ * @param min_size Minimum size of the gaps (not zero)
+ * @param fn Function called for every gap
+ * @param arg Argument passed to the function
+ * @return Zero if all gaps were visited. Otherwise the value returned by the
+ * function which stopped the walk.
+ */
+int mymap_btree_for_each_gap(map_t *map, unsigned long min_size,
+        map_gap_fn_t fn, void *arg);
+
+/**
+ * Releases all nodes of the tree
+ * @param map Pointer to the map instance
+ * @param release Function called for every region in the tree (may be NULL)
+ */
+void mymap_btree_destroy(map_t *map,
+        void (*release)(map_t *map, map_region_t *region));
+
+/**
+ * Prints the tree in human-readable form
+ * @param map Pointer to the map instance
+ */
+void mymap_btree_dump(map_t *map);
+
+#endif /* MYMAP_BTREE_H_ */
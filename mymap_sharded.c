@@ -0,0 +1,193 @@
+/*
+ * mymap_sharded.c
+ *
+ *  Created on: 18.10.2026
+ */
+
+#include "mymap_sharded.h"
+
+/* Private functions -------------------------------------------------------- */
+/**
+ * Returns index of the shard managing given address
+ * @param smap Pointer to the sharded map instance
+ * @param vaddr Virtual address (inside the address space)
+ * @return Index of the shard
+ */
+static inline unsigned mymap_sharded_index(sharded_map_t *smap, void *vaddr);
+
+/* Exported functions ------------------------------------------------------- */
+int mymap_sharded_init(sharded_map_t *smap, unsigned count) {
+    return mymap_sharded_init_range(smap, count, MYMAP_VA_BASE, MYMAP_VA_END);
+}
+
+int mymap_sharded_init_range(sharded_map_t *smap, unsigned count,
+        void *va_base, void *va_end) {
+    unsigned long span;
+    void *base;
+    unsigned i;
+
+    if (smap == NULL || count == 0) return MYMAP_ERR;
+    if (va_base == NULL || va_end < va_base) return MYMAP_ERR;
+    span = va_end - va_base + 1;
+    if (span/count == 0) return MYMAP_ERR;
+
+    smap->shards = MYMAP_MALLOC(count*sizeof(map_t));
+    if (smap->shards == NULL) return MYMAP_ERR;
+    smap->count = count;
+    smap->va_base = va_base;
+    smap->va_end = va_end;
+    smap->shard_size = span/count;
+
+    /* Shards cover consecutive parts of the address space. The last one takes
+     * whatever is left after dividing it. */
+    for (i = 0; i < count; i++) {
+        base = va_base + i*smap->shard_size;
+        if (mymap_init(&smap->shards[i]) != MYMAP_OK
+                || mymap_set_range(&smap->shards[i], base, (i < count - 1) ?
+                        base + smap->shard_size - 1 : va_end) != MYMAP_OK
+                || mymap_enable_locking(&smap->shards[i]) != MYMAP_OK) {
+            smap->count = i + 1;
+            mymap_sharded_destroy(smap);
+            return MYMAP_ERR;
+        }
+    }
+
+    return MYMAP_OK;
+}
+
+void mymap_sharded_destroy(sharded_map_t *smap) {
+    unsigned i;
+
+    if (smap == NULL || smap->shards == NULL) return;
+
+    for (i = 0; i < smap->count; i++) mymap_destroy(&smap->shards[i]);
+    MYMAP_FREE(smap->shards);
+    smap->shards = NULL;
+    smap->count = 0;
+}
+
+void* mymap_sharded_mmap(sharded_map_t *smap, unsigned home, void *vaddr,
+        size_t size, unsigned int flags, void *o) {
+    void *addr;
+    unsigned i, first;
+
+    if (smap == NULL || smap->count == 0) return MYMAP_FAILED;
+
+    if (vaddr != NULL) {
+
+        /* Region can't be placed below suggested address, so only the shard
+         * containing it and the following ones are tried */
+        if (vaddr < smap->va_base) vaddr = smap->va_base;
+        if (vaddr > smap->va_end) return MYMAP_FAILED;
+        first = mymap_sharded_index(smap, vaddr);
+        for (i = first; i < smap->count; i++) {
+            addr = mymap_mmap(&smap->shards[i], (i == first) ? vaddr : NULL,
+                    size, flags, o);
+            if (addr != MYMAP_FAILED) return addr;
+        }
+        return MYMAP_FAILED;
+    }
+
+    /* Try the home shard first. Shards without a gap large enough fail fast
+     * (on largest gap at the root of the tree and the last gap) under the
+     * shared lock, so spilling over to the other shards is cheap. */
+    first = home % smap->count;
+    for (i = 0; i < smap->count; i++) {
+        addr = mymap_mmap(&smap->shards[(first + i) % smap->count], NULL,
+                size, flags, o);
+        if (addr != MYMAP_FAILED) return addr;
+    }
+
+    return MYMAP_FAILED;
+}
+
+void mymap_sharded_munmap(sharded_map_t *smap, void *vaddr) {
+    mymap_munmap(mymap_sharded_shard(smap, vaddr), vaddr);
+}
+
+int mymap_sharded_munmap_range(sharded_map_t *smap, void *vaddr, size_t len) {
+    void *last, *start, *end;
+    unsigned i;
+
+    if (smap == NULL || smap->count == 0 || len == 0) return MYMAP_ERR;
+    if (vaddr > smap->va_end) return MYMAP_OK;
+
+    /* Range is clipped to the address space and unmapped from every shard it
+     * overlaps with */
+    last = (len - 1 > (size_t)(smap->va_end - vaddr)) ? smap->va_end
+            : vaddr + len - 1;
+    if (last < smap->va_base) return MYMAP_OK;
+    if (vaddr < smap->va_base) vaddr = smap->va_base;
+    for (i = mymap_sharded_index(smap, vaddr);
+            i <= mymap_sharded_index(smap, last); i++) {
+        start = (vaddr > smap->shards[i].va_base) ? vaddr
+                : smap->shards[i].va_base;
+        end = (last < smap->shards[i].va_end) ? last : smap->shards[i].va_end;
+        if (mymap_munmap_range(&smap->shards[i], start, end - start + 1)
+                != MYMAP_OK) {
+            return MYMAP_ERR;
+        }
+    }
+
+    return MYMAP_OK;
+}
+
+int mymap_sharded_mprotect(sharded_map_t *smap, void *vaddr, size_t len,
+        unsigned int flags) {
+    return mymap_mprotect(mymap_sharded_shard(smap, vaddr), vaddr, len, flags);
+}
+
+void* mymap_sharded_get_unmapped_area(sharded_map_t *smap, unsigned home,
+        void *vaddr, size_t size) {
+    void *addr;
+    unsigned i, first;
+
+    if (smap == NULL || smap->count == 0) return MYMAP_FAILED;
+
+    /* Shards are tried in the same order as by mymap_sharded_mmap */
+    if (vaddr != NULL) {
+        if (vaddr < smap->va_base) vaddr = smap->va_base;
+        if (vaddr > smap->va_end) return MYMAP_FAILED;
+        first = mymap_sharded_index(smap, vaddr);
+        for (i = first; i < smap->count; i++) {
+            addr = mymap_get_unmapped_area(&smap->shards[i],
+                    (i == first) ? vaddr : NULL, size);
+            if (addr != MYMAP_FAILED) return addr;
+        }
+        return MYMAP_FAILED;
+    }
+
+    first = home % smap->count;
+    for (i = 0; i < smap->count; i++) {
+        addr = mymap_get_unmapped_area(&smap->shards[(first + i) % smap->count],
+                NULL, size);
+        if (addr != MYMAP_FAILED) return addr;
+    }
+
+    return MYMAP_FAILED;
+}
+
+map_region_t* mymap_sharded_find(sharded_map_t *smap, void *vaddr) {
+    return mymap_find(mymap_sharded_shard(smap, vaddr), vaddr);
+}
+
+int mymap_sharded_find_copy(sharded_map_t *smap, void *vaddr,
+        map_region_desc_t *desc) {
+    return mymap_find_copy(mymap_sharded_shard(smap, vaddr), vaddr, desc);
+}
+
+map_t* mymap_sharded_shard(sharded_map_t *smap, void *vaddr) {
+
+    if (smap == NULL || smap->count == 0) return NULL;
+    if (vaddr < smap->va_base || vaddr > smap->va_end) return NULL;
+
+    return &smap->shards[mymap_sharded_index(smap, vaddr)];
+}
+
+/* Private functions -------------------------------------------------------- */
+static inline unsigned mymap_sharded_index(sharded_map_t *smap, void *vaddr) {
+    unsigned long index = (vaddr - smap->va_base)/smap->shard_size;
+
+    /* The last shard may be slightly larger than the others */
+    return (index < smap->count) ? index : smap->count - 1;
+}
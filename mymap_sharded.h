@@ -0,0 +1,150 @@
+/*
+ * mymap_sharded.h
+ *
+ *  Created on: 18.10.2026
+ *
+ * Map split into a number of shards, each managing a contiguous part of the
+ * address space with its own map and lock. Threads allocating in different
+ * shards don't contend with each other.
+ */
+
+#ifndef MYMAP_SHARDED_H_
+#define MYMAP_SHARDED_H_
+
+#include "mymap.h"
+
+/* Exported types ----------------------------------------------------------- */
+typedef struct {
+    map_t *shards; /* Maps managing consecutive parts of the address space */
+    unsigned count; /* Number of shards */
+    void *va_base; /* Base of the address space split into the shards */
+    void *va_end; /* End (last address) of the address space */
+    unsigned long shard_size; /* Size of the address space of a single shard
+                               * (the last one also gets the remainder) */
+} sharded_map_t;
+
+/* Exported functions ------------------------------------------------------- */
+
+/**
+ * Initializes sharded map. Address space between MYMAP_VA_BASE and
+ * MYMAP_VA_END is split into given number of equal shards. All of them are
+ * thread-safe.
+ * @param smap Pointer to the sharded map instance.
+ * @param count Number of shards.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_sharded_init(sharded_map_t *smap, unsigned count);
+
+/**
+ * Initializes sharded map splitting given address space into given number of
+ * equal shards (see mymap_init_range and mymap_sharded_init).
+ * @param smap Pointer to the sharded map instance.
+ * @param count Number of shards.
+ * @param va_base Base (first address) of the address space.
+ * @param va_end End (last address) of the address space.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_sharded_init_range(sharded_map_t *smap, unsigned count,
+        void *va_base, void *va_end);
+
+/**
+ * Unmaps all regions and releases all the memory used by the sharded map.
+ * @param smap Pointer to the sharded map instance.
+ */
+void mymap_sharded_destroy(sharded_map_t *smap);
+
+/**
+ * Maps region like mymap_mmap. If suggested address is given, the region is
+ * placed in the shard containing it or, if it's full, in one of the following
+ * shards. Otherwise it's placed in the home shard of the caller, spilling to
+ * the other shards only if the home one has no gap large enough. Regions never
+ * cross shard boundaries.
+ * @param smap Pointer to the sharded map instance.
+ * @param home Home shard of the caller (e.g. derived from thread ID). Taken
+ * modulo number of shards.
+ * @param vaddr Suggested address to map to or NULL.
+ * @param size Size of the mapped region.
+ * @param flags Mapping attributes.
+ * @param o Address of the beginning of the mapped region.
+ * @return On success, returns address the region was mapped to. On failure,
+ * MYMAP_FAILED is returned.
+ */
+void* mymap_sharded_mmap(sharded_map_t *smap, unsigned home, void *vaddr,
+        size_t size, unsigned int flags, void *o);
+
+/**
+ * Unmaps region containing given address.
+ * @param smap Pointer to the sharded map instance.
+ * @param vaddr Any address from the region to unmap.
+ */
+void mymap_sharded_munmap(sharded_map_t *smap, void *vaddr);
+
+/**
+ * Unmaps all addresses in given range like mymap_munmap_range. The range may
+ * span several shards, and it's unmapped from each of them in turn, so
+ * concurrent operations may see it unmapped only partially.
+ * @param smap Pointer to the sharded map instance.
+ * @param vaddr Beginning of the range.
+ * @param len Length of the range in bytes.
+ * @return Returns zero if operation succeeds. Otherwise returns error code.
+ */
+int mymap_sharded_munmap_range(sharded_map_t *smap, void *vaddr, size_t len);
+
+/**
+ * Changes flags of all regions in given range like mymap_mprotect. Last
+ * address of a shard can't be mapped, so ranges crossing shard boundaries are
+ * never mapped as a whole and are rejected.
+ * @param smap Pointer to the sharded map instance.
+ * @param vaddr Beginning of the range.
+ * @param len Length of the range in bytes.
+ * @param flags New memory region flags.
+ * @return Returns zero if operation succeeds. If any part of the range is not
+ * mapped returns error code and leaves the map untouched.
+ */
+int mymap_sharded_mprotect(sharded_map_t *smap, void *vaddr, size_t len,
+        unsigned int flags);
+
+/**
+ * Finds unmapped area like mymap_get_unmapped_area, trying the shards in the
+ * same order as mymap_sharded_mmap. Shards may be changed by other threads
+ * before the area is mapped.
+ * @param smap Pointer to the sharded map instance.
+ * @param home Home shard of the caller. Taken modulo number of shards.
+ * @param vaddr Suggested address or NULL.
+ * @param size Size of the area.
+ * @return Beginning of the area or MYMAP_FAILED if there is no such area.
+ */
+void* mymap_sharded_get_unmapped_area(sharded_map_t *smap, unsigned home,
+        void *vaddr, size_t size);
+
+/**
+ * Finds region containing given address. Shards are thread-safe maps, so the
+ * region may be changed by concurrent operations (see mymap_find).
+ * @param smap Pointer to the sharded map instance.
+ * @param vaddr Virtual address.
+ * @return Pointer to the region containing the address or NULL if the address
+ * is not mapped.
+ */
+map_region_t* mymap_sharded_find(sharded_map_t *smap, void *vaddr);
+
+/**
+ * Works like mymap_sharded_find, but copies description of the region while
+ * its shard is locked (see mymap_find_copy).
+ * @param smap Pointer to the sharded map instance.
+ * @param vaddr Virtual address.
+ * @param desc Pointer to the structure the description is copied to.
+ * @return Returns zero if the address is mapped. Otherwise returns error code.
+ */
+int mymap_sharded_find_copy(sharded_map_t *smap, void *vaddr,
+        map_region_desc_t *desc);
+
+/**
+ * Returns the shard managing given address.
+ * @param smap Pointer to the sharded map instance.
+ * @param vaddr Virtual address.
+ * @return Pointer to the map of the shard or NULL if the address is outside
+ * the address space.
+ */
+map_t* mymap_sharded_shard(sharded_map_t *smap, void *vaddr);
+
+#endif /* MYMAP_SHARDED_H_ */
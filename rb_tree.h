@@ -5,7 +5,11 @@
  *      Author: krystian
  */
 
+#ifndef RB_TREE_H_
+#define RB_TREE_H_
+
 #include <stddef.h>
+#include <stdint.h>
 
 /* Settings ----------------------------------------------------------------- */
 #include <stdlib.h>
@@ -15,6 +19,11 @@
 #include <stdio.h>
 #define RB_PRINTF(...)          printf(__VA_ARGS__)
 
+/* Define RB_COMPACT (e.g. with -DRB_COMPACT) to keep color of every node in the
+ * lowest bit of its parent pointer instead of a separate field. It saves a
+ * word per node, but all files using the tree have to be built with the same
+ * setting. */
+
 /* Return codes ------------------------------------------------------------- */
 #define RB_OK                   (0)
 #define RB_ERR                  (-1) /* Unspecified error */
@@ -26,35 +35,93 @@
 /* Exported macros and definitions ------------------------------------------ */
 #define RB_EMPTY(tree)          ((tree)->root == NULL)
 
-#define RB_ELEMENT(node, type)                                              \
-    ((node != NULL)?((type*)(node)->element):((type*)NULL))
+/* Returns pointer to the structure of a given type the node is embedded in as
+ * a member with a given name (the node must not be NULL) */
+#define RB_ENTRY(node, type, member)                                        \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+/* Same as RB_ENTRY, but evaluates to NULL if the node is NULL */
+#define RB_ELEMENT(node, type, member)                                      \
+    ((node != NULL)?RB_ENTRY(node, type, member):((type*)NULL))
 
 #define RB_LINK_LEFT(_parent, _child)                                       \
     _parent->left = _child;                                                 \
-    _child->parent = _parent;
+    RB_SET_PARENT(_child, _parent);
 
 #define RB_LINK_RIGHT(_parent, _child)                                      \
     _parent->right = _child;                                                \
-    _child->parent = _parent;
+    RB_SET_PARENT(_child, _parent);
+
+/* Accessors of the parent and the color of the node, which work regardless of
+ * RB_COMPACT setting */
+#ifdef RB_COMPACT
+#define RB_PARENT(node)                                                     \
+    ((rb_node_t*)((node)->parent_color & ~(uintptr_t)1))
+#define RB_COLOR(node)          ((rb_color_t)((node)->parent_color & 1))
+#define RB_SET_PARENT(node, _parent)                                        \
+    ((node)->parent_color = (uintptr_t)(_parent)                            \
+            | ((node)->parent_color & 1))
+#define RB_SET_COLOR(node, _color)                                          \
+    ((node)->parent_color = ((node)->parent_color & ~(uintptr_t)1)          \
+            | (uintptr_t)(_color))
+#define RB_SET_PARENT_COLOR(node, _parent, _color)                          \
+    ((node)->parent_color = (uintptr_t)(_parent) | (uintptr_t)(_color))
+#else
+#define RB_PARENT(node)         ((node)->parent)
+#define RB_COLOR(node)          ((node)->color)
+#define RB_SET_PARENT(node, _parent)    ((node)->parent = (_parent))
+#define RB_SET_COLOR(node, _color)      ((node)->color = (_color))
+#define RB_SET_PARENT_COLOR(node, _parent, _color)                          \
+    do {                                                                    \
+        (node)->parent = (_parent);                                         \
+        (node)->color = (_color);                                           \
+    } while (0)
+#endif
 
 /* Exported types ----------------------------------------------------------- */
+/* Colors have to fit in a single bit (see RB_COMPACT) */
 typedef enum {
-    RB_RED,
-    RB_BLACK,
+    RB_RED = 0,
+    RB_BLACK = 1,
 } rb_color_t;
 
 typedef struct rb_node_s rb_node_t;
 
+/* Node of a red-black tree. Nodes are meant to be embedded in the structures
+ * stored in the tree, which are then accessed with RB_ENTRY/RB_ELEMENT. */
 struct rb_node_s {
-    void *element;
+#ifdef RB_COMPACT
+    uintptr_t parent_color; /* Parent pointer with color in the lowest bit */
+#else
     rb_node_t *parent;
+#endif
     rb_node_t *left;
     rb_node_t *right;
+#ifndef RB_COMPACT
     rb_color_t color;
+#endif
 };
 
+/* Callbacks used to maintain additional data stored in the nodes, which
+ * depends on the contents of the whole subtree (e.g. maximum value of some
+ * field in the subtree). All of them are optional. */
+typedef struct {
+    /* Recomputes data of the node and its ancestors up to (but excluding) stop
+     * node after the subtree of the node changed */
+    void (*propagate)(rb_node_t *node, rb_node_t *stop);
+
+    /* Copies data of the old node to the new one, which replaced it in the
+     * tree */
+    void (*copy)(rb_node_t *old, rb_node_t *new);
+
+    /* Updates data after rotation. New node took place of the old one and
+     * became its parent. */
+    void (*rotate)(rb_node_t *old, rb_node_t *new);
+} rb_augment_t;
+
 typedef struct {
     rb_node_t *root;
+    const rb_augment_t *augment; /* Augmentation callbacks (may be NULL) */
 } rb_tree_t;
 
 /* Exported functions ------------------------------------------------------- */
@@ -65,17 +132,26 @@ typedef struct {
  */
 int rb_init(rb_tree_t *t);
 
+/**
+ * Initializes augmented red-black tree. Insert and delete operations call
+ * given callbacks whenever they change the structure of the tree.
+ * @param t Pointer to the tree instance
+ * @param augment Pointer to the augmentation callbacks
+ * @return Returns zero on success and error code otherwise
+ */
+int rb_init_augmented(rb_tree_t *t, const rb_augment_t *augment);
+
 /**
  * Initializes node of red-black tree.
  * @param node Pointer to the node
- * @param element Pointer to the element to store in the node
  */
-void rb_node_init(rb_node_t *node, void *element);
+void rb_node_init(rb_node_t *node);
 
 /**
  * Modifies tree so that it becomes a red-black tree again after inserting new
  * node. Node should be inserted according to rules imposed on binary search
- * trees.
+ * trees. If the tree is augmented, data of the ancestors of the new node has to
+ * be propagated before the call.
  * @param t Pointer to the tree instance
  * @param node Pointer to the inserted node
  * @return Returns zero on success and error code otherwise
@@ -113,6 +189,14 @@ rb_node_t* rb_next(rb_node_t *node);
  */
 rb_node_t* rb_subtree_next(rb_node_t *subtree);
 
+/**
+ * Returns previous node before the first one in the subtree in depth-first
+ * in-order traversal.
+ * @param subtree Pointer to the root of the subtree
+ * @return Pointer to the previous node or NULL if there is no such node
+ */
+rb_node_t* rb_subtree_previous(rb_node_t *subtree);
+
 /**
  * Returns previous node in depth-first in-order traversal.
  * @param node Current node
@@ -124,9 +208,9 @@ rb_node_t* rb_previous(rb_node_t *node);
  * Searches for a given key in the tree
  * @param t Pointer to the tree
  * @param element Pointer to the key to search for
- * @param compare Compare function accepting two parameters, key and element
- * stored in a tree node. Defines the order of elements by returning -1, 0 or 1
- * if the key is lesser, equal or greater than the element stored in the node,
+ * @param compare Compare function accepting two parameters, key and a tree
+ * node. Defines the order of elements by returning -1, 0 or 1 if the key is
+ * lesser, equal or greater than the element the node is embedded in,
  * respectively
  * @param result Pointer to place where the result of last comparison will be
  * stored
@@ -134,17 +218,19 @@ rb_node_t* rb_previous(rb_node_t *node);
  * such an element in the tree, returns pointer to the node it should be
  * attached to. May return NULL if an error occurs or if the tree is empty.
  */
-rb_node_t* rb_search(rb_tree_t *t, void *key, int (*compare)(void*, void*),
-        int *result);
+rb_node_t* rb_search(rb_tree_t *t, void *key,
+        int (*compare)(void*, rb_node_t*), int *result);
 
 /**
- * Prints subtree in human-readable form
+ * Prints subtree in human-readable form. Nodes are visited without recursion
+ * and no memory is allocated.
  * @param subtree Pointer to the root of the subtree
  * @param print_element Pointer to the function that will be used to print
- * elements stored in the tree
+ * elements the nodes are embedded in
  * @return Returns zero on success and error code otherwise
  */
-int rb_print_subtree(rb_node_t *subtree, void (print_element)(void *element));
+int rb_print_subtree(rb_node_t *subtree,
+        void (print_element)(rb_node_t *node));
 
 /**
  * Finds node with the lowest key in the subtree
@@ -159,3 +245,5 @@ rb_node_t* rb_minimum(rb_node_t *root);
  * @return Pointer to the node holding maximum value
  */
 rb_node_t* rb_maximum(rb_node_t *root);
+
+#endif /* RB_TREE_H_ */
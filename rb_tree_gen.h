@@ -0,0 +1,374 @@
+/*
+ * rb_tree_gen.h
+ *
+ * Generator of red-black tree operations specialized for a given element type,
+ * comparison and augmentation callbacks. Functions of rb_tree.c reach the
+ * callbacks through pointers, which the compiler can't inline. Code generated
+ * here calls them directly, so whole search, insert and delete paths get
+ * specialized for the tree they are used with.
+ *
+ * Usage:
+ *
+ *  RB_GENERATE_STATIC(name, type, member, key_type, compare, propagate, copy,
+ *          rotate)
+ *
+ * generates following static inline functions:
+ *
+ *  type* name_find(rb_tree_t *t, key_type key)
+ *  int name_insert_fixup(rb_tree_t *t, rb_node_t *node)
+ *  int name_delete(rb_tree_t *t, rb_node_t *node)
+ *
+ * where compare(key, element) returns negative value, zero or positive value if
+ * the key is lesser, equal or greater than the element, respectively, and
+ * propagate(t, node, stop), copy(t, old, new) and rotate(t, old, new) have the
+ * same meaning as the callbacks of rb_augment_t. Any of them may be a macro.
+ * Callbacks of trees which aren't augmented can be RB_AUGMENT_NONE.
+ *
+ * Rebalancing steps can be observed by defining RB_GEN_EVENT(t, event) before
+ * this header is included. It's called with the tree and one of the tokens
+ * insert_fixups, insert_rotations, delete_fixups and delete_rotations.
+ */
+
+#ifndef RB_TREE_GEN_H_
+#define RB_TREE_GEN_H_
+
+#include "rb_tree.h"
+
+/* Exported macros and definitions ------------------------------------------ */
+
+/* Augmentation callback which does nothing */
+#define RB_AUGMENT_NONE(t, node, other)     do {} while (0)
+
+/* Rebalancing steps aren't observed by default */
+#ifndef RB_GEN_EVENT
+#define RB_GEN_EVENT(t, event)              ((void)0)
+#endif
+
+#define RB_GEN_IS_RED(node)     ((node) != NULL && RB_COLOR(node) == RB_RED)
+#define RB_GEN_IS_BLACK(node)   ((node) == NULL || RB_COLOR(node) == RB_BLACK)
+
+/* Generates all the functions of a specialized tree */
+#define RB_GENERATE_STATIC(name, type, member, key_type, compare,           \
+        propagate, copy, rotate)                                            \
+    RB_GENERATE_FIND(name, type, member, key_type, compare,                 \
+            static inline)                                                  \
+    RB_GENERATE_AUGMENTED(name, propagate, copy, rotate, static inline)
+
+/* Generates search of the element equal to the key */
+#define RB_GENERATE_FIND(name, type, member, key_type, compare, attr)       \
+attr type* name##_find(rb_tree_t *t, key_type key) {                        \
+    rb_node_t *node = t->root;                                              \
+    int result;                                                             \
+                                                                            \
+    while (node != NULL) {                                                  \
+        result = compare(key, RB_ENTRY(node, type, member));                \
+        if (result < 0) {                                                   \
+            node = node->left;                                              \
+        } else if (result > 0) {                                            \
+            node = node->right;                                             \
+        } else {                                                            \
+            return RB_ENTRY(node, type, member);                            \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    return NULL;                                                            \
+}
+
+/* Generates rotations, insert fixup and delete. All tree manipulations were
+ * implemented based on "Red-Black Trees" chapter from "Introduction to
+ * Algorithms". */
+#define RB_GENERATE_AUGMENTED(name, propagate, copy, rotate, attr)          \
+                                                                            \
+/* Rotate left:                                                             \
+ *                                                                          \
+ *    |              |                                                      \
+ *    x              y                                                      \
+ *   / \            / \                                                     \
+ *  A   y    ->    x   C                                                    \
+ *     / \        / \                                                       \
+ *    B   C      A   B                                                      \
+ */                                                                         \
+attr void name##_left_rotate(rb_tree_t *t, rb_node_t *x) {                  \
+    rb_node_t *y = x->right;                                                \
+                                                                            \
+    x->right = y->left;                                                     \
+    if (y->left != NULL) RB_SET_PARENT(y->left, x);                         \
+    RB_SET_PARENT(y, RB_PARENT(x));                                         \
+    if (RB_PARENT(x) == NULL) {                                             \
+        t->root = y;                                                        \
+    } else if (x == RB_PARENT(x)->left) {                                   \
+        RB_PARENT(x)->left = y;                                             \
+    } else {                                                                \
+        RB_PARENT(x)->right = y;                                            \
+    }                                                                       \
+    y->left = x;                                                            \
+    RB_SET_PARENT(x, y);                                                    \
+                                                                            \
+    rotate(t, x, y);                                                        \
+}                                                                           \
+                                                                            \
+/* Rotate right:                                                            \
+ *                                                                          \
+ *      |          |                                                        \
+ *      x          y                                                        \
+ *     / \        / \                                                       \
+ *    y   C  ->  A   x                                                      \
+ *   / \            / \                                                     \
+ *  A   B          B   C                                                    \
+ */                                                                         \
+attr void name##_right_rotate(rb_tree_t *t, rb_node_t *x) {                 \
+    rb_node_t *y = x->left;                                                 \
+                                                                            \
+    x->left = y->right;                                                     \
+    if (y->right != NULL) RB_SET_PARENT(y->right, x);                       \
+    RB_SET_PARENT(y, RB_PARENT(x));                                         \
+    if (RB_PARENT(x) == NULL) {                                             \
+        t->root = y;                                                        \
+    } else if (x == RB_PARENT(x)->right) {                                  \
+        RB_PARENT(x)->right = y;                                            \
+    } else {                                                                \
+        RB_PARENT(x)->left = y;                                             \
+    }                                                                       \
+    y->right = x;                                                           \
+    RB_SET_PARENT(x, y);                                                    \
+                                                                            \
+    rotate(t, x, y);                                                        \
+}                                                                           \
+                                                                            \
+attr void name##_transplant(rb_tree_t *t, rb_node_t *u, rb_node_t *v) {     \
+                                                                            \
+    if (RB_PARENT(u) == NULL) {                                             \
+        t->root = v;                                                        \
+    } else if (u == RB_PARENT(u)->left) {                                   \
+        RB_PARENT(u)->left = v;                                             \
+    } else {                                                                \
+        RB_PARENT(u)->right = v;                                            \
+    }                                                                       \
+                                                                            \
+    if (v != NULL) RB_SET_PARENT(v, RB_PARENT(u));                          \
+}                                                                           \
+                                                                            \
+attr int name##_insert_fixup(rb_tree_t *t, rb_node_t *z) {                  \
+    rb_node_t *y;                                                           \
+                                                                            \
+    while (RB_GEN_IS_RED(RB_PARENT(z))) {                                   \
+        RB_GEN_EVENT(t, insert_fixups);                                     \
+                                                                            \
+        if (RB_PARENT(z) == RB_PARENT(RB_PARENT(z))->left) {                \
+                                                                            \
+            /* Get uncle node */                                            \
+            y = RB_PARENT(RB_PARENT(z))->right;                             \
+                                                                            \
+            if (RB_GEN_IS_RED(y)) {                                         \
+                /* Case I: */                                               \
+                RB_SET_COLOR(RB_PARENT(z), RB_BLACK);                       \
+                RB_SET_COLOR(y, RB_BLACK);                                  \
+                RB_SET_COLOR(RB_PARENT(RB_PARENT(z)), RB_RED);              \
+                z = RB_PARENT(RB_PARENT(z));                                \
+                continue;                                                   \
+            }                                                               \
+                                                                            \
+            if (z == RB_PARENT(z)->right) {                                 \
+                /* Case II: */                                              \
+                z = RB_PARENT(z);                                           \
+                RB_GEN_EVENT(t, insert_rotations);                          \
+                name##_left_rotate(t, z);                                   \
+            }                                                               \
+                                                                            \
+            /* Case III: */                                                 \
+            RB_SET_COLOR(RB_PARENT(z), RB_BLACK);                           \
+            RB_SET_COLOR(RB_PARENT(RB_PARENT(z)), RB_RED);                  \
+            RB_GEN_EVENT(t, insert_rotations);                              \
+            name##_right_rotate(t, RB_PARENT(RB_PARENT(z)));                \
+                                                                            \
+        } else if (RB_PARENT(z) == RB_PARENT(RB_PARENT(z))->right) {        \
+                                                                            \
+            /* Get uncle node */                                            \
+            y = RB_PARENT(RB_PARENT(z))->left;                              \
+                                                                            \
+            if (RB_GEN_IS_RED(y)) {                                         \
+                /* Case I: */                                               \
+                RB_SET_COLOR(RB_PARENT(z), RB_BLACK);                       \
+                RB_SET_COLOR(y, RB_BLACK);                                  \
+                RB_SET_COLOR(RB_PARENT(RB_PARENT(z)), RB_RED);              \
+                z = RB_PARENT(RB_PARENT(z));                                \
+                continue;                                                   \
+            }                                                               \
+                                                                            \
+            if (z == RB_PARENT(z)->left) {                                  \
+                /* Case II: */                                              \
+                z = RB_PARENT(z);                                           \
+                RB_GEN_EVENT(t, insert_rotations);                          \
+                name##_right_rotate(t, z);                                  \
+            }                                                               \
+                                                                            \
+            /* Case III: */                                                 \
+            RB_SET_COLOR(RB_PARENT(z), RB_BLACK);                           \
+            RB_SET_COLOR(RB_PARENT(RB_PARENT(z)), RB_RED);                  \
+            RB_GEN_EVENT(t, insert_rotations);                              \
+            name##_left_rotate(t, RB_PARENT(RB_PARENT(z)));                 \
+                                                                            \
+        } else {                                                            \
+            /* Should never happen, but just to make sure... */             \
+            return RB_INTERNAL_ERR;                                         \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    RB_SET_COLOR(t->root, RB_BLACK);                                        \
+                                                                            \
+    return RB_OK;                                                           \
+}                                                                           \
+                                                                            \
+/* Node x may be NULL, so its parent is passed and tracked separately */    \
+attr int name##_delete_fixup(rb_tree_t *t, rb_node_t *x,                    \
+        rb_node_t *parent) {                                                \
+    rb_node_t *w;                                                           \
+                                                                            \
+    while (x != t->root && RB_GEN_IS_BLACK(x)) {                            \
+        RB_GEN_EVENT(t, delete_fixups);                                     \
+                                                                            \
+        if (x == parent->left) {                                            \
+                                                                            \
+            w = parent->right;                                              \
+                                                                            \
+            if (RB_GEN_IS_RED(w)) {                                         \
+                /* Case I: */                                               \
+                RB_SET_COLOR(w, RB_BLACK);                                  \
+                RB_SET_COLOR(parent, RB_RED);                               \
+                RB_GEN_EVENT(t, delete_rotations);                          \
+                name##_left_rotate(t, parent);                              \
+                w = parent->right;                                          \
+            }                                                               \
+                                                                            \
+            if (RB_GEN_IS_BLACK(w->left) && RB_GEN_IS_BLACK(w->right)) {    \
+                /* Case II:  */                                             \
+                RB_SET_COLOR(w, RB_RED);                                    \
+                x = parent;                                                 \
+                parent = RB_PARENT(x);                                      \
+                                                                            \
+            } else {                                                        \
+                                                                            \
+                if (RB_GEN_IS_BLACK(w->right)) {                            \
+                    /* Case III: */                                         \
+                    RB_SET_COLOR(w->left, RB_BLACK);                        \
+                    RB_SET_COLOR(w, RB_RED);                                \
+                    RB_GEN_EVENT(t, delete_rotations);                      \
+                    name##_right_rotate(t, w);                              \
+                    w = parent->right;                                      \
+                }                                                           \
+                                                                            \
+                /* Case IV: */                                              \
+                RB_SET_COLOR(w, RB_COLOR(parent));                          \
+                RB_SET_COLOR(parent, RB_BLACK);                             \
+                RB_SET_COLOR(w->right, RB_BLACK);                           \
+                RB_GEN_EVENT(t, delete_rotations);                          \
+                name##_left_rotate(t, parent);                              \
+                x = t->root;                                                \
+            }                                                               \
+                                                                            \
+        } else if (x == parent->right) {                                    \
+                                                                            \
+            w = parent->left;                                               \
+                                                                            \
+            if (RB_GEN_IS_RED(w)) {                                         \
+                /* Case I: */                                               \
+                RB_SET_COLOR(w, RB_BLACK);                                  \
+                RB_SET_COLOR(parent, RB_RED);                               \
+                RB_GEN_EVENT(t, delete_rotations);                          \
+                name##_right_rotate(t, parent);                             \
+                w = parent->left;                                           \
+            }                                                               \
+                                                                            \
+            if (RB_GEN_IS_BLACK(w->left) && RB_GEN_IS_BLACK(w->right)) {    \
+                /* Case II:  */                                             \
+                RB_SET_COLOR(w, RB_RED);                                    \
+                x = parent;                                                 \
+                parent = RB_PARENT(x);                                      \
+                                                                            \
+            } else {                                                        \
+                                                                            \
+                if (RB_GEN_IS_BLACK(w->left)) {                             \
+                    /* Case III: */                                         \
+                    RB_SET_COLOR(w->right, RB_BLACK);                       \
+                    RB_SET_COLOR(w, RB_RED);                                \
+                    RB_GEN_EVENT(t, delete_rotations);                      \
+                    name##_left_rotate(t, w);                               \
+                    w = parent->left;                                       \
+                }                                                           \
+                                                                            \
+                /* Case IV: */                                              \
+                RB_SET_COLOR(w, RB_COLOR(parent));                          \
+                RB_SET_COLOR(parent, RB_BLACK);                             \
+                RB_SET_COLOR(w->left, RB_BLACK);                            \
+                RB_GEN_EVENT(t, delete_rotations);                          \
+                name##_right_rotate(t, parent);                             \
+                x = t->root;                                                \
+            }                                                               \
+                                                                            \
+        } else {                                                            \
+            /* Should never happen, but just to make sure... */             \
+            return RB_INTERNAL_ERR;                                         \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    if (x != NULL) RB_SET_COLOR(x, RB_BLACK);                               \
+                                                                            \
+    return RB_OK;                                                           \
+}                                                                           \
+                                                                            \
+/* Since there are no sentinel nodes, x may be NULL and its parent has to   \
+ * be tracked separately */                                                 \
+attr int name##_delete(rb_tree_t *t, rb_node_t *z) {                        \
+    rb_node_t *y = z, *x, *x_parent;                                        \
+    rb_color_t y_color = RB_COLOR(z);                                       \
+                                                                            \
+    if (z->left == NULL) {                                                  \
+        x = z->right;                                                       \
+        x_parent = RB_PARENT(z);                                            \
+        name##_transplant(t, z, z->right);                                  \
+        propagate(t, x_parent, NULL);                                       \
+                                                                            \
+    } else if (z->right == NULL) {                                          \
+        x = z->left;                                                        \
+        x_parent = RB_PARENT(z);                                            \
+        name##_transplant(t, z, z->left);                                   \
+        propagate(t, x_parent, NULL);                                       \
+                                                                            \
+    } else {                                                                \
+        y = z->right;                                                       \
+        while (y->left != NULL) y = y->left;                                \
+        y_color = RB_COLOR(y);                                              \
+        x = y->right;                                                       \
+                                                                            \
+        if (RB_PARENT(y) == z) {                                            \
+            x_parent = y;                                                   \
+        } else {                                                            \
+            x_parent = RB_PARENT(y);                                        \
+            name##_transplant(t, y, y->right);                              \
+            y->right = z->right;                                            \
+            RB_SET_PARENT(y->right, y);                                     \
+        }                                                                   \
+                                                                            \
+        name##_transplant(t, z, y);                                         \
+        y->left = z->left;                                                  \
+        RB_SET_PARENT(y->left, y);                                          \
+        RB_SET_COLOR(y, RB_COLOR(z));                                       \
+                                                                            \
+        /* Node y took place of z, so it starts with its data. Then the     \
+         * path from the place y was removed from up to the root is         \
+         * updated. */                                                      \
+        copy(t, z, y);                                                      \
+        if (x_parent != y) {                                                \
+            propagate(t, x_parent, y);                                      \
+        }                                                                   \
+        propagate(t, y, NULL);                                              \
+    }                                                                       \
+                                                                            \
+    if (y_color == RB_BLACK) {                                              \
+        return name##_delete_fixup(t, x, x_parent);                         \
+    }                                                                       \
+                                                                            \
+    return RB_OK;                                                           \
+}
+
+#endif /* RB_TREE_GEN_H_ */
@@ -0,0 +1,725 @@
+/*
+ * bench.c
+ *
+ * Benchmarks of the map. Measures how throughput of concurrent lookups in a
+ * thread-safe map scales with the number of reader threads, optionally with
+ * a writer thread mapping and unmapping regions at the same time. If number of
+ * shards is given, also compares throughput of concurrent mmap/munmap in a
+ * single thread-safe map and in a sharded map.
+ *
+ * In suite mode, measures latency of single-threaded find, get_unmapped_area,
+ * mmap and munmap in maps of growing size (from a hundred up to max_regions
+ * regions in a 47-bit address space), with suggested addresses and sizes drawn
+ * from several distributions. Reports mean, median and 99th percentile latency
+ * of each operation and resident set size of the process after the map is
+ * built, either as a table or as CSV. Searching a plain sorted array of the
+ * regions is measured as a baseline for maps of up to a hundred thousand
+ * regions.
+ *
+ * In frag mode, generates a long sequence of mmaps and munmaps of mixed sizes
+ * keeping a 16 GiB address space about 92% full and replays it under each
+ * placement policy. Reports how many mmaps failed, how long operations took
+ * and how fragmented the free space is in the end (the share of free space
+ * outside the largest gap). Builds with MYMAP_STATS also report counters of
+ * work done by the map under each policy.
+ *
+ * Usage: bench [max_threads] [writer] [shards]
+ *        bench suite [max_regions] [csv]
+ *        bench frag [ops]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "mymap.h"
+#include "mymap_sharded.h"
+
+/* Number of lookups done by each reader thread */
+#define NUM_OF_LOOKUPS              (2000000)
+
+/* Number of mmap/munmap pairs done by each thread */
+#define NUM_OF_MMAPS                (500000)
+
+/* Maximum number of threads */
+#define MAX_THREADS                 (64)
+
+/* Default maximum number of regions in suite mode */
+#define SUITE_MAX_REGIONS           (10000000)
+
+/* Number of operations timed for each distribution in suite mode */
+#define SUITE_OPS                   (100000)
+
+/* The array baseline is slow, so it's timed less and for smaller maps only */
+#define SUITE_BASELINE_OPS          (1000)
+#define SUITE_BASELINE_MAX_REGIONS  (100000)
+
+/* Address space used in suite mode */
+#define SUITE_VA_BASE               ((void*)0x10000)
+#define SUITE_VA_END                ((void*)0x7fffffffffff)
+
+/* Granularity of regions and gaps in suite mode */
+#define SUITE_PAGE                  (4096)
+
+/* Default number of operations in frag mode */
+#define FRAG_OPS                    (1000000)
+
+/* Address space used in frag mode and share of it kept mapped [%] */
+#define FRAG_VA_BASE                ((void*)0x10000)
+#define FRAG_VA_SIZE                (16UL << 30)
+#define FRAG_FILL                   (92)
+
+/* Stores latency of an expression in nanoseconds without the cost of reading
+ * the clock. Result of the expression is kept, so it can't be optimized out. */
+#define TIME_NS(lat, overhead, expr) do {                                     \
+        unsigned long _t = now_ns();                                          \
+        sink = (uintptr_t)(expr);                                             \
+        _t = now_ns() - _t;                                                   \
+        (lat) = (_t > (overhead)) ? _t - (overhead) : 0;                      \
+    } while (0)
+
+typedef struct {
+    pthread_t thread;
+    unsigned seed;
+    unsigned long found;
+} reader_t;
+
+typedef struct {
+    pthread_t thread;
+    sharded_map_t *smap;
+    unsigned home;
+} mapper_t;
+
+typedef enum {
+    HINT_NONE, /* No suggested address */
+    HINT_UNIFORM, /* Anywhere in the mapped part of the address space */
+    HINT_TAIL, /* In the last 1% of the mapped part */
+    NUM_OF_HINTS
+} hint_dist_t;
+
+typedef enum {
+    SIZE_PAGE, /* Single page */
+    SIZE_SMALL, /* One to eight pages */
+    SIZE_LARGE, /* 16 to 64 pages, fits in the larger gaps or above regions */
+    NUM_OF_SIZES
+} size_dist_t;
+
+typedef struct {
+    map_region_desc_t *regions; /* Layout of the largest map */
+    unsigned long count; /* Number of regions in the current map */
+    unsigned long span; /* Size of the mapped part of the address space */
+    unsigned seed;
+    unsigned long timer_overhead; /* Cost of reading the clock [ns] */
+    int csv;
+} suite_t;
+
+typedef struct {
+    size_t size; /* Size of the region */
+    unsigned long slot; /* Slot the address of the region is kept in */
+    int unmap; /* Set if the region is unmapped, cleared if it's mapped */
+} frag_op_t;
+
+/* Virtual memory map instance */
+map_t map;
+
+/* Set when readers are done, so the writer can stop */
+atomic_int done;
+
+/* Results of timed operations */
+volatile uintptr_t sink;
+
+/* Names of the distributions */
+const char *hint_names[NUM_OF_HINTS] = {"none", "uniform", "tail"};
+const char *size_names[NUM_OF_SIZES] = {"page", "small", "large"};
+
+/* Private functions -------------------------------------------------------- */
+static void bench_lookups(unsigned max_threads, int with_writer);
+static void bench_mmap(unsigned max_threads, unsigned shards);
+static void bench_suite(unsigned long max_regions, int csv);
+static void suite_run_map(suite_t *suite, map_backend_t backend);
+static void bench_frag(unsigned long count);
+static unsigned long frag_generate(frag_op_t *ops, unsigned long count);
+static void frag_run(frag_op_t *ops, unsigned long count, void **slots,
+        map_policy_t policy, const char *name);
+static void suite_run_baseline(suite_t *suite);
+static void suite_report(suite_t *suite, const char *backend, const char *op,
+        const char *hint, const char *size, unsigned long *lat,
+        unsigned long count, long rss);
+static void* suite_hint(suite_t *suite, hint_dist_t hint);
+static size_t suite_size(suite_t *suite, size_dist_t size);
+static void* scan_unmapped_area(const map_region_desc_t *regions,
+        unsigned long count, void *vaddr, size_t size);
+static int compare_latency(const void *a, const void *b);
+static long rss_kib(void);
+static void build_map(map_t *m);
+static void* reader(void *arg);
+static void* writer(void *arg);
+static void* mapper(void *arg);
+static unsigned long now_ns(void);
+static double now(void);
+
+/* Main --------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+    unsigned max_threads = 8, shards = 0;
+    int with_writer = 0;
+
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        bench_suite((argc > 2) ? strtoul(argv[2], NULL, 0) : SUITE_MAX_REGIONS,
+                argc > 3 && strcmp(argv[3], "csv") == 0);
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "frag") == 0) {
+        bench_frag((argc > 2) ? strtoul(argv[2], NULL, 0) : FRAG_OPS);
+        return 0;
+    }
+
+    if (argc > 1) max_threads = atoi(argv[1]);
+    if (argc > 2) with_writer = atoi(argv[2]);
+    if (argc > 3) shards = atoi(argv[3]);
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+    bench_lookups(max_threads, with_writer);
+
+    if (shards > 0) {
+        bench_mmap(max_threads, 1);
+        bench_mmap(max_threads, shards);
+    }
+
+    return 0;
+}
+
+/* Private functions -------------------------------------------------------- */
+static void bench_lookups(unsigned max_threads, int with_writer) {
+    static reader_t readers[MAX_THREADS];
+    pthread_t writer_thread;
+    unsigned threads, i;
+    double start, elapsed, base = 0;
+
+    build_map(&map);
+
+    printf("threads  lookups/s      speedup  (%s)\n",
+            with_writer ? "with writer" : "readers only");
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        atomic_store(&done, 0);
+        if (with_writer) pthread_create(&writer_thread, NULL, writer, NULL);
+
+        start = now();
+        for (i = 0; i < threads; i++) {
+            readers[i].seed = i + 1;
+            pthread_create(&readers[i].thread, NULL, reader, &readers[i]);
+        }
+        for (i = 0; i < threads; i++) pthread_join(readers[i].thread, NULL);
+        elapsed = now() - start;
+
+        atomic_store(&done, 1);
+        if (with_writer) pthread_join(writer_thread, NULL);
+
+        if (threads == 1) base = NUM_OF_LOOKUPS/elapsed;
+        printf("%7u  %12.0f  %7.2f\n", threads,
+                threads*(double)NUM_OF_LOOKUPS/elapsed,
+                threads*(double)NUM_OF_LOOKUPS/elapsed/base);
+    }
+
+    mymap_destroy(&map);
+}
+
+static void bench_mmap(unsigned max_threads, unsigned shards) {
+    static mapper_t mappers[MAX_THREADS];
+    sharded_map_t smap;
+    unsigned threads, i;
+    double start, elapsed, base = 0;
+
+    if (mymap_sharded_init(&smap, shards) != MYMAP_OK) {
+        printf("Can't split the address space into %u shards\n", shards);
+        return;
+    }
+
+    printf("threads  mmaps/s        speedup  (%u shard%s)\n", shards,
+            (shards > 1) ? "s" : "");
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        start = now();
+        for (i = 0; i < threads; i++) {
+            mappers[i].smap = &smap;
+            mappers[i].home = i;
+            pthread_create(&mappers[i].thread, NULL, mapper, &mappers[i]);
+        }
+        for (i = 0; i < threads; i++) pthread_join(mappers[i].thread, NULL);
+        elapsed = now() - start;
+
+        if (threads == 1) base = NUM_OF_MMAPS/elapsed;
+        printf("%7u  %12.0f  %7.2f\n", threads,
+                threads*(double)NUM_OF_MMAPS/elapsed,
+                threads*(double)NUM_OF_MMAPS/elapsed/base);
+    }
+
+    mymap_sharded_destroy(&smap);
+}
+
+static void bench_suite(unsigned long max_regions, int csv) {
+    suite_t suite;
+    unsigned long count, i, t;
+    unsigned seed = 1;
+    char *vaddr = SUITE_VA_BASE;
+
+    if (max_regions < 100) max_regions = 100;
+    suite.regions = malloc(max_regions*sizeof(map_region_desc_t));
+    if (suite.regions == NULL) {
+        printf("Can't allocate %lu regions\n", max_regions);
+        return;
+    }
+
+    /* Single pages separated by gaps of one to four pages. Every hundredth
+     * gap is larger, so that there are a few places big requests fit in. */
+    for (i = 0; i < max_regions; i++) {
+        suite.regions[i].paddr = NULL;
+        suite.regions[i].vaddr = vaddr;
+        suite.regions[i].vend = vaddr + SUITE_PAGE;
+        suite.regions[i].flags = MYMAP_READ;
+        vaddr += SUITE_PAGE*(2 + ((i % 100 == 99) ? 32 : rand_r(&seed) % 4));
+    }
+
+    /* Reading the clock takes a while too, so its cost is subtracted from
+     * every measured latency */
+    suite.timer_overhead = ULONG_MAX;
+    for (i = 0; i < 1000; i++) {
+        t = now_ns();
+        t = now_ns() - t;
+        if (t < suite.timer_overhead) suite.timer_overhead = t;
+    }
+
+    suite.seed = 2;
+    suite.csv = csv;
+    if (csv) {
+        printf("backend,regions,op,hint,size,ops,ns_per_op,p50_ns,p99_ns,"
+                "rss_kib\n");
+    } else {
+        printf("%-7s  %8s  %-6s  %-7s  %-5s  %10s  %8s  %8s  %9s\n",
+                "backend", "regions", "op", "hint", "size", "ns/op", "p50",
+                "p99", "rss[KiB]");
+    }
+
+    for (count = 100; count <= max_regions; count *= 10) {
+        suite.count = count;
+        suite.span = (char*)suite.regions[count - 1].vend
+                - (char*)SUITE_VA_BASE;
+        suite_run_map(&suite, MYMAP_RBTREE);
+        suite_run_map(&suite, MYMAP_BTREE);
+        if (count <= SUITE_BASELINE_MAX_REGIONS) suite_run_baseline(&suite);
+    }
+
+    free(suite.regions);
+}
+
+static void suite_run_map(suite_t *suite, map_backend_t backend) {
+    const char *name = (backend == MYMAP_BTREE) ? "btree" : "rbtree";
+    map_region_desc_t *region;
+    unsigned long *lat, i;
+    hint_dist_t hint;
+    size_dist_t size;
+    void *vaddr;
+    size_t len;
+    map_t m;
+    long rss;
+
+    lat = malloc(SUITE_OPS*sizeof(unsigned long));
+    if (lat == NULL) return;
+
+    mymap_init_range(&m, SUITE_VA_BASE, SUITE_VA_END);
+    mymap_set_backend(&m, backend);
+    if (mymap_build_sorted(&m, suite->regions, suite->count) != MYMAP_OK) {
+        printf("Can't build map of %lu regions\n", suite->count);
+        free(lat);
+        return;
+    }
+    rss = rss_kib();
+
+    for (i = 0; i < SUITE_OPS; i++) {
+        vaddr = suite_hint(suite, HINT_UNIFORM);
+        TIME_NS(lat[i], suite->timer_overhead, mymap_find(&m, vaddr));
+    }
+    suite_report(suite, name, "find", "uniform", "-", lat, SUITE_OPS, rss);
+
+    for (hint = 0; hint < NUM_OF_HINTS; hint++) {
+        for (size = 0; size < NUM_OF_SIZES; size++) {
+            for (i = 0; i < SUITE_OPS; i++) {
+                vaddr = suite_hint(suite, hint);
+                len = suite_size(suite, size);
+                TIME_NS(lat[i], suite->timer_overhead,
+                        mymap_get_unmapped_area(&m, vaddr, len));
+            }
+            suite_report(suite, name, "gua", hint_names[hint],
+                    size_names[size], lat, SUITE_OPS, rss);
+        }
+    }
+
+    /* Every new region is unmapped right away, so that all of them are
+     * mapped into the same layout. They have different flags than the
+     * regions of the layout, so they are never merged with them. */
+    for (hint = 0; hint < NUM_OF_HINTS; hint++) {
+        for (size = 0; size < NUM_OF_SIZES; size++) {
+            for (i = 0; i < SUITE_OPS; i++) {
+                vaddr = suite_hint(suite, hint);
+                len = suite_size(suite, size);
+                TIME_NS(lat[i], suite->timer_overhead,
+                        vaddr = mymap_mmap(&m, vaddr, len, MYMAP_WRITE, NULL));
+                if (vaddr != MYMAP_FAILED) mymap_munmap(&m, vaddr);
+            }
+            suite_report(suite, name, "mmap", hint_names[hint],
+                    size_names[size], lat, SUITE_OPS, rss);
+        }
+    }
+
+    /* Unmapped regions of the layout are mapped back the same way */
+    for (i = 0; i < SUITE_OPS; i++) {
+        region = &suite->regions[rand_r(&suite->seed) % suite->count];
+        TIME_NS(lat[i], suite->timer_overhead,
+                (mymap_munmap(&m, region->vaddr), 0));
+        mymap_mmap(&m, region->vaddr, region->vend - region->vaddr,
+                region->flags, region->paddr);
+    }
+    suite_report(suite, name, "munmap", "-", "page", lat, SUITE_OPS, rss);
+
+    mymap_destroy(&m);
+    free(lat);
+}
+
+static void suite_run_baseline(suite_t *suite) {
+    unsigned long *lat, i;
+    hint_dist_t hint;
+    size_dist_t size;
+    void *vaddr;
+    size_t len;
+
+    lat = malloc(SUITE_BASELINE_OPS*sizeof(unsigned long));
+    if (lat == NULL) return;
+
+    for (hint = 0; hint < NUM_OF_HINTS; hint++) {
+        for (size = 0; size < NUM_OF_SIZES; size++) {
+            for (i = 0; i < SUITE_BASELINE_OPS; i++) {
+                vaddr = suite_hint(suite, hint);
+                len = suite_size(suite, size);
+                TIME_NS(lat[i], suite->timer_overhead,
+                        scan_unmapped_area(suite->regions, suite->count, vaddr,
+                                len));
+            }
+            suite_report(suite, "array", "gua", hint_names[hint],
+                    size_names[size], lat, SUITE_BASELINE_OPS, -1);
+        }
+    }
+
+    free(lat);
+}
+
+static void suite_report(suite_t *suite, const char *backend, const char *op,
+        const char *hint, const char *size, unsigned long *lat,
+        unsigned long count, long rss) {
+    unsigned long i, p50, p99;
+    double sum = 0;
+
+    for (i = 0; i < count; i++) sum += lat[i];
+    qsort(lat, count, sizeof(unsigned long), compare_latency);
+    p50 = lat[count/2];
+    p99 = lat[count*99/100];
+
+    if (suite->csv) {
+        printf("%s,%lu,%s,%s,%s,%lu,%.1f,%lu,%lu,", backend, suite->count, op,
+                hint, size, count, sum/count, p50, p99);
+        if (rss >= 0) printf("%ld", rss);
+        printf("\n");
+    } else {
+        printf("%-7s  %8lu  %-6s  %-7s  %-5s  %10.1f  %8lu  %8lu  ", backend,
+                suite->count, op, hint, size, sum/count, p50, p99);
+        if (rss >= 0) {
+            printf("%9ld\n", rss);
+        } else {
+            printf("%9s\n", "-");
+        }
+    }
+}
+
+static void bench_frag(unsigned long count) {
+    unsigned long slot_count;
+    frag_op_t *ops;
+    void **slots;
+
+    ops = malloc(count*sizeof(frag_op_t));
+    if (ops == NULL) {
+        printf("Can't allocate %lu operations\n", count);
+        return;
+    }
+
+    /* The sequence is generated once, so that every policy gets exactly the
+     * same requests */
+    slot_count = frag_generate(ops, count);
+    slots = malloc(slot_count*sizeof(void*));
+    if (slots == NULL) {
+        printf("Can't allocate %lu slots\n", slot_count);
+        free(ops);
+        return;
+    }
+
+    printf("%-9s  %8s  %10s  %8s  %8s  %8s  %10s  %11s  %6s\n", "policy",
+            "failed", "failed[MiB]", "ns/op", "regions", "gaps", "free[MiB]",
+            "largest[MiB]", "frag");
+    frag_run(ops, count, slots, MYMAP_BOTTOM_UP, "first-fit");
+    frag_run(ops, count, slots, MYMAP_TOP_DOWN, "top-down");
+    frag_run(ops, count, slots, MYMAP_BEST_FIT, "best-fit");
+
+    free(slots);
+    free(ops);
+}
+
+static unsigned long frag_generate(frag_op_t *ops, unsigned long count) {
+    unsigned long *live, live_count = 0, slot_count = 0, i, j;
+    size_t *sizes, mapped = 0, r;
+    unsigned seed = 3;
+
+    live = malloc(count*sizeof(unsigned long));
+    sizes = malloc(count*sizeof(size_t));
+    if (live == NULL || sizes == NULL) {
+        printf("Can't allocate %lu slots\n", count);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < count; i++) {
+
+        /* Map while there's room left, then keep the space about as full,
+         * unmapping random regions */
+        if (live_count == 0 || (mapped < FRAG_VA_SIZE/100*FRAG_FILL
+                && rand_r(&seed) % 100 < 55)) {
+
+            /* Mostly small regions, some medium and a few of 1 to 16 MiB */
+            r = rand_r(&seed) % 100;
+            if (r < 60) {
+                ops[i].size = SUITE_PAGE*(1 + rand_r(&seed) % 4);
+            } else if (r < 90) {
+                ops[i].size = SUITE_PAGE*(8 + rand_r(&seed) % 57);
+            } else {
+                ops[i].size = SUITE_PAGE*(256 + rand_r(&seed) % 3841);
+            }
+            ops[i].slot = slot_count;
+            ops[i].unmap = 0;
+            sizes[slot_count] = ops[i].size;
+            live[live_count++] = slot_count++;
+            mapped += ops[i].size;
+        } else {
+            j = rand_r(&seed) % live_count;
+            ops[i].size = sizes[live[j]];
+            ops[i].slot = live[j];
+            ops[i].unmap = 1;
+            mapped -= sizes[live[j]];
+            live[j] = live[--live_count];
+        }
+    }
+
+    free(sizes);
+    free(live);
+
+    return slot_count;
+}
+
+static void frag_run(frag_op_t *ops, unsigned long count, void **slots,
+        map_policy_t policy, const char *name) {
+    unsigned long failed = 0, i;
+    size_t failed_size = 0;
+    map_space_t space;
+    double start, elapsed;
+#ifdef MYMAP_STATS
+    map_stats_t stats;
+#endif
+    map_t m;
+
+    mymap_init_range(&m, FRAG_VA_BASE, (char*)FRAG_VA_BASE + FRAG_VA_SIZE);
+    if (mymap_set_policy(&m, policy) != MYMAP_OK) {
+        printf("%-9s  not available (build with -DMYMAP_GAP_INDEX)\n", name);
+        mymap_destroy(&m);
+        return;
+    }
+    mymap_enable_coalescing(&m);
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        if (!ops[i].unmap) {
+            slots[ops[i].slot] = mymap_mmap(&m, NULL, ops[i].size, MYMAP_READ,
+                    NULL);
+            if (slots[ops[i].slot] == MYMAP_FAILED) {
+                failed++;
+                failed_size += ops[i].size;
+            }
+
+        /* Neighbours with the same flags are merged, so regions are unmapped
+         * by their ranges */
+        } else if (slots[ops[i].slot] != MYMAP_FAILED) {
+            mymap_munmap_range(&m, slots[ops[i].slot], ops[i].size);
+        }
+    }
+    elapsed = now() - start;
+
+    mymap_get_space(&m, &space);
+    printf("%-9s  %8lu  %10.1f  %8.0f  %8lu  %8lu  %10.1f  %11.1f  %5.1f%%\n",
+            name, failed, failed_size/1048576.0, elapsed*1e9/count,
+            space.regions, space.gaps, space.unmapped/1048576.0,
+            space.largest_gap/1048576.0, (space.unmapped > 0)
+                    ? 100.0 - 100.0*space.largest_gap/space.unmapped : 0);
+
+#ifdef MYMAP_STATS
+    /* Work done by the whole sequence */
+    mymap_get_stats(&m, &stats);
+    printf("%-9s  searches %lu, nodes %lu+%lu, last gap checks %lu, "
+            "rotations %lu, allocations %lu\n", "", stats.searches,
+            stats.first_phase_nodes, stats.second_phase_nodes,
+            stats.last_gap_checks,
+            stats.insert_rotations + stats.delete_rotations,
+            stats.allocations);
+#endif
+
+    mymap_destroy(&m);
+}
+
+static void* suite_hint(suite_t *suite, hint_dist_t hint) {
+    unsigned long r = (unsigned long)rand_r(&suite->seed) << 31
+            | rand_r(&suite->seed);
+
+    switch (hint) {
+    case HINT_UNIFORM:
+        return (char*)SUITE_VA_BASE + r % suite->span;
+    case HINT_TAIL:
+        return (char*)SUITE_VA_BASE + suite->span - 1
+                - r % (suite->span/100 + 1);
+    default:
+        return NULL;
+    }
+}
+
+static size_t suite_size(suite_t *suite, size_dist_t size) {
+
+    switch (size) {
+    case SIZE_SMALL:
+        return SUITE_PAGE*(1 + rand_r(&suite->seed) % 8);
+    case SIZE_LARGE:
+        return SUITE_PAGE*(16 + rand_r(&suite->seed) % 49);
+    default:
+        return SUITE_PAGE;
+    }
+}
+
+static void* scan_unmapped_area(const map_region_desc_t *regions,
+        unsigned long count, void *vaddr, size_t size) {
+    void *start = SUITE_VA_BASE, *from;
+    unsigned long i;
+
+    /* Lowest gap which can hold the area at or above suggested address, just
+     * like mymap_get_unmapped_area with the default policy */
+    for (i = 0; i < count; i++) {
+        from = (start > vaddr) ? start : vaddr;
+        if (regions[i].vaddr >= from
+                && (size_t)(regions[i].vaddr - from) >= size) {
+            return from;
+        }
+        start = regions[i].vend;
+    }
+
+    /* Check the last gap */
+    from = (start > vaddr) ? start : vaddr;
+    if (from <= SUITE_VA_END && (size_t)(SUITE_VA_END - from) >= size)
+        return from;
+
+    return MYMAP_FAILED;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+
+    return (x > y) - (x < y);
+}
+
+static long rss_kib(void) {
+    long pages = -1;
+    FILE *f;
+
+    /* Second field of statm is the number of resident pages */
+    f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "%*d %ld", &pages) != 1) pages = -1;
+    fclose(f);
+
+    return (pages >= 0) ? pages*(sysconf(_SC_PAGESIZE)/1024) : -1;
+}
+
+static void build_map(map_t *m) {
+    char *vaddr;
+
+    /* Map every other byte of the address space, so that half of the lookups
+     * hit a region */
+    mymap_init(m);
+    for (vaddr = MYMAP_VA_BASE; (void*)vaddr < MYMAP_VA_END; vaddr += 2) {
+        mymap_mmap(m, vaddr, 1, MYMAP_READ, NULL);
+    }
+    mymap_enable_locking(m);
+}
+
+static void* reader(void *arg) {
+    reader_t *r = arg;
+    unsigned long span = MYMAP_VA_END - MYMAP_VA_BASE + 1;
+    unsigned i;
+
+    r->found = 0;
+    for (i = 0; i < NUM_OF_LOOKUPS; i++) {
+        void *vaddr = (char*)MYMAP_VA_BASE + rand_r(&r->seed) % span;
+        if (mymap_find(&map, vaddr) != NULL) r->found++;
+    }
+
+    return NULL;
+}
+
+static void* writer(void *arg) {
+    unsigned seed = 0;
+    unsigned long span = MYMAP_VA_END - MYMAP_VA_BASE + 1;
+
+    /* Keep replacing random regions */
+    while (!atomic_load(&done)) {
+        char *vaddr = (char*)MYMAP_VA_BASE + (rand_r(&seed) % span & ~1UL);
+        mymap_munmap(&map, vaddr);
+        mymap_mmap(&map, vaddr, 1, MYMAP_READ, NULL);
+    }
+
+    return NULL;
+}
+
+static void* mapper(void *arg) {
+    mapper_t *m = arg;
+    void *vaddr;
+    unsigned i;
+
+    /* Map and unmap small regions in the home shard */
+    for (i = 0; i < NUM_OF_MMAPS; i++) {
+        vaddr = mymap_sharded_mmap(m->smap, m->home, NULL, 1, MYMAP_READ, NULL);
+        if (vaddr != MYMAP_FAILED) mymap_sharded_munmap(m->smap, vaddr);
+    }
+
+    return NULL;
+}
+
+static unsigned long now_ns(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec*1000000000UL + t.tv_nsec;
+}
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
@@ -5,10 +5,14 @@
  *      Author: krystian
  */
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "mymap.h"
+#include "mymap_sharded.h"
 
 /* Number of regions in the virtual memory */
 #define NUM_OF_REGIONS              (16)
@@ -17,12 +21,108 @@
  * region. */
 #define NUM_OF_TESTS                (32)
 
+/* Maximum number of regions compared by checks of the layout */
+#define MAX_LAYOUT                  (4096)
+
+/* Maximum number of gaps collected by checks of iterators */
+#define MAX_GAPS                    (8)
+
+/* Number of regions written by checks of flat dumps (enough to fill the
+ * buffer of the dump a few times) */
+#define NUM_OF_DUMPED               (1000)
+
+/* Maximum number of bytes captured from flat dumps */
+#define MAX_DUMP                    (NUM_OF_DUMPED*64)
+
+/* Number of random operations applied to maps with both backends */
+#define NUM_OF_OPS                  (4000)
+
+/* Number of bytes in the model of the address space (at least
+ * MYMAP_VA_END) */
+#define MODEL_SIZE                  (0x1000)
+
+/* Number of region identifiers in the model of the address space */
+#define MAX_MODEL_IDS               (2*NUM_OF_OPS + 1)
+
+/* Number of batches compared with operations applied one at a time and the
+ * largest number of operations in a batch (spanning a few chunks) */
+#define NUM_OF_BATCHES              (64)
+#define MAX_BATCH                   (2*MYMAP_BATCH_CHUNK + 64)
+
+/* Number of operations of each thread sharing a thread-safe map */
+#define NUM_OF_THREAD_OPS           (20000)
+
+/* Maximum number of regions mapped by each writer sharing a map */
+#define MAX_THREAD_REGIONS          (64)
+
+/* Number of threads mapping and unmapping regions of a shared map and of
+ * threads looking them up */
+#define NUM_OF_WRITERS              (2)
+#define NUM_OF_READERS              (2)
+
+/* Shorthand for addresses in checks */
+#define VA(addr)                    ((void*)(uintptr_t)(addr))
+
 typedef struct {
     void *vaddr;
     void *vend;
     unsigned long gap;
 } _region_t;
 
+/* Region expected by checks of the layout (physical addresses are not
+ * compared) */
+typedef struct {
+    void *vaddr;
+    void *vend;
+    unsigned int flags;
+    void *paddr;
+} _mapping_t;
+
+/* Regions of the map collected by checks of the layout */
+typedef struct {
+    _mapping_t regions[MAX_LAYOUT];
+    size_t count;
+    void *prev_end; /* End of the last region collected so far */
+    int gaps_ok; /* Cleared if a gap stored in the map is wrong */
+} layout_t;
+
+/* Gaps collected by checks of iterators */
+typedef struct {
+    void *start[MAX_GAPS];
+    size_t size[MAX_GAPS];
+    size_t count;
+    size_t limit; /* Number of gaps after which the iteration is stopped */
+} gaps_t;
+
+/* Address space modelled byte by byte. Every mapped byte holds identifier of
+ * its region (zero marks unmapped bytes). */
+typedef struct {
+    unsigned short owner[MODEL_SIZE];
+    unsigned int flags[MAX_MODEL_IDS];
+    uintptr_t offset[MAX_MODEL_IDS]; /* Physical minus virtual address */
+    unsigned short ids; /* Number of identifiers given out so far */
+} model_t;
+
+/* Output of flat dumps captured by checks */
+typedef struct {
+    char text[MAX_DUMP];
+    size_t len;
+    unsigned writes; /* Number of calls of the writer */
+    unsigned limit; /* Number of calls after which the writer fails */
+    int split_line; /* Set if a chunk didn't end with a whole line */
+    int too_long; /* Set if a chunk didn't fit in the buffer of the dump */
+} dump_t;
+
+/* Thread sharing a thread-safe map. Writers map regions whose flags hold their
+ * size, so that readers can tell torn copies of regions. */
+typedef struct {
+    map_t *map;
+    unsigned int seed; /* State of the random number generator */
+    void *mapped[MAX_THREAD_REGIONS]; /* Regions mapped by a writer */
+    size_t count; /* Number of regions mapped by a writer */
+    unsigned long errors; /* Failed operations or inconsistent lookups */
+} worker_t;
+
 /* Region descriptors */
 _region_t _regions[NUM_OF_REGIONS];
 
@@ -32,6 +132,32 @@ unsigned long last_gap;
 /* Virtual memory map instance */
 map_t map;
 
+/* Numbers of all and failed checks of behaviour of the map */
+unsigned checks, failed_checks;
+
+/* Names of the backends */
+const char *backend_names[] = {"rbtree", "btree"};
+
+/* Number of region descriptors in each slab of the pools of maps checked with
+ * both backends (zero if the maps don't have pools) */
+size_t slab_size;
+
+/* Names of the policies */
+const char *policy_names[] = {"bottom-up", "top-down", "best-fit"};
+
+/* Layout of the map being checked */
+layout_t layout;
+
+/* Model of the maps checked against each other */
+model_t model;
+
+/* Layout of the map the other map is compared with */
+_mapping_t expected[MAX_LAYOUT];
+
+/* Output of the dump being checked and the lines it's expected to hold */
+dump_t dump;
+char dump_expected[MAX_DUMP];
+
 /* Private functions -------------------------------------------------------- */
 static void generate_layout(void);
 static void print_layout(void);
@@ -39,11 +165,43 @@ static void* _get_unmapped_area(_region_t r[], void *vaddr, unsigned int size);
 static void* get_random_vaddr(void);
 static unsigned int get_random_size(void *vaddr);
 static void build_map(map_t *m);
-static rb_node_t* _build_map(_region_t *r, size_t size);
+static void check(int cond, const char *name, const char *what);
+static void init_map(map_t *m, map_backend_t backend);
+static const char* map_name(map_backend_t backend);
+static int layout_is(map_t *m, const _mapping_t *regions, size_t count);
+static void collect_layout(map_t *m);
+static int collect_region(void *arg, map_region_t *region);
+static void test_mmap(map_backend_t backend, map_policy_t policy);
+static void test_mmap_aligned(map_backend_t backend, map_policy_t policy);
+static void test_best_fit(map_backend_t backend);
+static void test_gap_queries(map_backend_t backend);
+static void test_space(map_backend_t backend);
+static void test_munmap_range(map_backend_t backend);
+static void test_mprotect(map_backend_t backend);
+static void test_coalescing(map_backend_t backend);
+static void test_find_cache(map_backend_t backend);
+static void test_find_copy(map_backend_t backend);
+static void test_batch(map_backend_t backend);
+static void test_concurrency(map_backend_t backend);
+static void* stress_writer(void *arg);
+static void* stress_reader(void *arg);
+static void test_btree(map_policy_t policy);
+static void model_split(uintptr_t addr);
+static void model_merge(uintptr_t addr, uintptr_t end);
+static int model_is_free(uintptr_t addr, size_t size);
+static int model_matches(map_t *m);
+static void test_iterators(map_backend_t backend);
+static int collect_gap(void *arg, void *start, size_t size);
+static void test_dump(map_backend_t backend);
+static int capture_dump(void *arg, const char *buf, size_t len);
+static int stop_region(void *arg, map_region_t *region);
+static void test_sharded_range(void);
+static void test_stats(void);
 
 /* Main --------------------------------------------------------------------- */
 int main(int argc, char **argv) {
-    unsigned i = 0;
+    const size_t slab_sizes[] = {0, 1, MYMAP_POOL_SLAB_SIZE};
+    unsigned i = 0, j, failures = 0;
 
     srand(time(NULL));
 
@@ -56,11 +214,6 @@ int main(int argc, char **argv) {
     build_map(&map);
     mymap_dump(&map);
 
-    /* Wait for any key */
-    printf("\nPress any key to run tests...\n");
-    getchar();
-
-
     /* Display header */
     printf("\n%4s %10s %10s %20s %20s\n", "nr", "vaddr", "size", "array",
             "tree");
@@ -83,16 +236,54 @@ int main(int argc, char **argv) {
         if (array_addr != tree_addr) {
             print_layout();
             mymap_dump(&map);
-
-            /* Wait for any key */
-            getchar();
+            failures++;
         }
 
         if (i >= NUM_OF_TESTS) break;
         i++;
     }
 
-    return 0;
+    mymap_destroy(&map);
+
+    /* Check behaviour of operations on the map with each backend, also when
+     * regions are allocated from pools (with a single region per slab at
+     * worst) */
+    for (j = 0; j < sizeof(slab_sizes)/sizeof(slab_sizes[0]); j++) {
+        slab_size = slab_sizes[j];
+        for (i = MYMAP_RBTREE; i <= MYMAP_BTREE; i++) {
+            test_mmap(i, MYMAP_BOTTOM_UP);
+            test_mmap(i, MYMAP_TOP_DOWN);
+            test_mmap(i, MYMAP_BEST_FIT);
+            test_mmap_aligned(i, MYMAP_BOTTOM_UP);
+            test_mmap_aligned(i, MYMAP_TOP_DOWN);
+            test_mmap_aligned(i, MYMAP_BEST_FIT);
+            test_best_fit(i);
+            test_gap_queries(i);
+            test_space(i);
+            test_munmap_range(i);
+            test_mprotect(i);
+            test_coalescing(i);
+            test_find_cache(i);
+            test_find_copy(i);
+            test_batch(i);
+            test_concurrency(i);
+            test_iterators(i);
+            test_dump(i);
+        }
+    }
+    test_btree(MYMAP_BOTTOM_UP);
+    test_btree(MYMAP_TOP_DOWN);
+    test_btree(MYMAP_BEST_FIT);
+    test_sharded_range();
+    test_stats();
+    printf("\n%u of %u checks failed\n", failed_checks, checks);
+
+    if (failures > 0) {
+        printf("\n%u of %u tests failed\n", failures, NUM_OF_TESTS + 1);
+        return EXIT_FAILURE;
+    }
+
+    return (failed_checks > 0) ? EXIT_FAILURE : 0;
 }
 
 /* Private functions -------------------------------------------------------- */
@@ -109,11 +300,14 @@ static void generate_layout(void) {
         size = high_limit - low_limit;
         _regions[i].vaddr = low_limit + (long)rand()*size/RAND_MAX;
         if (_regions[i].vaddr < low_limit) _regions[i].vaddr = low_limit;
+        if (_regions[i].vaddr >= high_limit) _regions[i].vaddr = high_limit - 1;
 
         /* Rand end address */
         size = high_limit - _regions[i].vaddr;
         _regions[i].vend = _regions[i].vaddr + (long)rand()*size/RAND_MAX;
         if (_regions[i].vend > high_limit) _regions[i].vend = high_limit;
+        if (_regions[i].vend <= _regions[i].vaddr)
+            _regions[i].vend = _regions[i].vaddr + 1;
 
         /* Calculate gap size */
         if (i == 0) {
@@ -193,40 +387,1219 @@ static unsigned int get_random_size(void *vaddr) {
 }
 
 static void build_map(map_t *m) {
+    map_region_desc_t desc[NUM_OF_REGIONS];
+    unsigned i;
+
     if (m == NULL) return;
 
-    m->rb_tree.root = _build_map(_regions, NUM_OF_REGIONS);
-    m->last_gap = last_gap;
+    for (i = 0; i < NUM_OF_REGIONS; i++) {
+        desc[i].paddr = NULL;
+        desc[i].vaddr = _regions[i].vaddr;
+        desc[i].vend = _regions[i].vend;
+        desc[i].flags = 0;
+    }
+
+    mymap_init(m);
+    if (mymap_build_sorted(m, desc, NUM_OF_REGIONS) != MYMAP_OK) {
+        printf("Failed to build the map\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void check(int cond, const char *name, const char *what) {
+    checks++;
+    if (cond) return;
+
+    printf("Check failed (%s): %s\n", name, what);
+    failed_checks++;
+}
+
+static void init_map(map_t *m, map_backend_t backend) {
+    if (slab_size > 0) {
+        mymap_init_pool(m, slab_size);
+    } else {
+        mymap_init(m);
+    }
+    mymap_set_backend(m, backend);
+}
+
+static const char* map_name(map_backend_t backend) {
+    static char names[2][32];
+
+    if (slab_size == 0) return backend_names[backend];
+
+    snprintf(names[backend], sizeof(names[backend]), "%s, slabs of %zu",
+            backend_names[backend], slab_size);
+    return names[backend];
+}
+
+static int layout_is(map_t *m, const _mapping_t *regions, size_t count) {
+    size_t i;
+
+    collect_layout(m);
+
+    /* Gap after the last region is kept separately */
+    if (m->last_gap != (unsigned long)(m->va_end - layout.prev_end) + 1)
+        return 0;
+    if (!layout.gaps_ok || layout.count != count) return 0;
+
+    for (i = 0; i < count; i++) {
+        if (layout.regions[i].vaddr != regions[i].vaddr
+                || layout.regions[i].vend != regions[i].vend
+                || layout.regions[i].flags != regions[i].flags) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void collect_layout(map_t *m) {
+    layout.count = 0;
+    layout.prev_end = m->va_base;
+    layout.gaps_ok = 1;
+    mymap_for_each_region_from(m, m->va_base, collect_region, &layout);
+}
+
+static int collect_region(void *arg, map_region_t *region) {
+    layout_t *l = arg;
+
+    if (region->gap != (unsigned long)(region->vaddr - l->prev_end))
+        l->gaps_ok = 0;
+    l->prev_end = region->vend;
+
+    if (l->count == MAX_LAYOUT) return 1;
+    l->regions[l->count].vaddr = region->vaddr;
+    l->regions[l->count].vend = region->vend;
+    l->regions[l->count].flags = region->flags;
+    l->regions[l->count].paddr = region->paddr;
+    l->count++;
+
+    return 0;
+}
+
+static void test_mmap(map_backend_t backend, map_policy_t policy) {
+
+    /* Regions mapped without suggested address and the area mapped in place
+     * of the second one after it is unmapped, for each policy */
+    static const uintptr_t placed[][4] = {
+        [MYMAP_BOTTOM_UP] = {0x10, 0x20, 0x40, 0x20},
+        [MYMAP_TOP_DOWN] = {0xff0, 0xfd0, 0xfa0, 0xfe0},
+        [MYMAP_BEST_FIT] = {0x10, 0x20, 0x40, 0x20},
+    };
+    const uintptr_t *addr = placed[policy];
+    const char *name = map_name(backend);
+    _mapping_t regions[4];
+    map_t m;
+
+    init_map(&m, backend);
+
+    /* Best fit needs the index of gaps */
+    if (mymap_set_policy(&m, policy) != MYMAP_OK) {
+#ifdef MYMAP_GAP_INDEX
+        check(0, name, policy_names[policy]);
+#else
+        check(policy == MYMAP_BEST_FIT, name, "best fit without the index");
+#endif
+        mymap_destroy(&m);
+        return;
+    }
+
+    /* Neighbours have different flags, so they are never merged */
+    check(mymap_mmap(&m, NULL, 0x10, MYMAP_READ, NULL) == VA(addr[0])
+            && mymap_mmap(&m, NULL, 0x20, MYMAP_WRITE, NULL) == VA(addr[1])
+            && mymap_mmap(&m, NULL, 0x30, MYMAP_EXEC, NULL) == VA(addr[2]),
+            name, policy_names[policy]);
+
+    regions[0] = (_mapping_t){VA(addr[0]), VA(addr[0] + 0x10), MYMAP_READ};
+    regions[1] = (_mapping_t){VA(addr[1]), VA(addr[1] + 0x20), MYMAP_WRITE};
+    regions[2] = (_mapping_t){VA(addr[2]), VA(addr[2] + 0x30), MYMAP_EXEC};
+
+    /* Regions come in order of addresses (top-down places them backwards) */
+    if (policy == MYMAP_TOP_DOWN) {
+        regions[3] = regions[0];
+        regions[0] = regions[2];
+        regions[2] = regions[3];
+    }
+    check(layout_is(&m, regions, 3), name, "layout after mmap");
+
+    /* Smaller area goes into the gap left by the unmapped region */
+    mymap_munmap(&m, VA(addr[1] + 0x8));
+    regions[1] = (_mapping_t){VA(addr[3]), VA(addr[3] + 0x10), MYMAP_WRITE};
+    check(mymap_mmap(&m, NULL, 0x10, MYMAP_WRITE, NULL) == VA(addr[3]), name,
+            "mmap into gap after munmap");
+    check(layout_is(&m, regions, 3), name, "layout after munmap and mmap");
+
+    /* Suggested address is used if the area there is free and never if it
+     * overlaps a region */
+    check(mymap_mmap(&m, VA(0x500), 0x10, 0, NULL) == VA(0x500), name,
+            "mmap at suggested address");
+    check(mymap_get_unmapped_area(&m, VA(addr[2]), 0x10) != VA(addr[2]), name,
+            "area overlapping region is not returned");
+    check(mymap_mmap(&m, NULL, 0x1000, 0, NULL) == MYMAP_FAILED, name,
+            "mmap larger than free space fails");
+
+    mymap_destroy(&m);
+}
+
+static void test_mmap_aligned(map_backend_t backend, map_policy_t policy) {
+
+    /* Areas aligned to 0x100 without suggested address and to 0x40 with
+     * unaligned suggested address for each policy. Best fit doesn't use the
+     * suggested address, so it takes the smallest gap left below the first
+     * area. */
+    static const uintptr_t placed[][2] = {
+        [MYMAP_BOTTOM_UP] = {0x100, 0x140},
+        [MYMAP_TOP_DOWN] = {0xf00, 0x100},
+        [MYMAP_BEST_FIT] = {0x100, 0x40},
+    };
+    const char *name = map_name(backend);
+    void *addr;
+    map_t m;
+
+    init_map(&m, backend);
+    if (mymap_set_policy(&m, policy) != MYMAP_OK) {
+        mymap_destroy(&m);
+        return;
+    }
+
+    mymap_mmap(&m, VA(0x10), 0x10, MYMAP_READ, NULL);
+    addr = mymap_mmap_aligned(&m, NULL, 0x10, 0x100, MYMAP_READ, NULL);
+    check(addr == VA(placed[policy][0]), name, "mmap aligned to 0x100");
+    addr = mymap_mmap_aligned(&m, VA(0x123), 0x10, 0x40, MYMAP_READ, NULL);
+    check(addr == VA(placed[policy][1]), name,
+            "mmap aligned to 0x40 near unaligned suggested address");
+
+    /* Alignment has to be a power of two and zero works like one */
+    check(mymap_mmap_aligned(&m, NULL, 0x10, 0x30, MYMAP_READ, NULL)
+            == MYMAP_FAILED, name, "alignment which isn't power of two");
+    check(mymap_get_unmapped_area_aligned(&m, VA(0x501), 0x10, 0)
+            == VA(0x501), name, "zero alignment");
+
+    /* Aligned area fits only if the gap holds it after alignment */
+    check(mymap_get_unmapped_area_aligned(&m, NULL, 0x900, 0x800)
+            == MYMAP_FAILED, name, "area which doesn't fit after alignment");
+
+    mymap_destroy(&m);
+}
+
+static void test_best_fit(map_backend_t backend) {
+    const char *name = map_name(backend);
+    map_t m;
+
+    init_map(&m, backend);
+
+    /* Gaps of 0x40, 0x20 and 0x10 bytes between regions */
+    mymap_mmap(&m, VA(0x10), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x60), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x90), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0xb0), 0x10, MYMAP_READ, NULL);
+
+#ifdef MYMAP_GAP_INDEX
+    check(mymap_set_policy(&m, MYMAP_BEST_FIT) == MYMAP_OK, name,
+            "best fit with the index");
+
+    /* Free suggested address is used as it is, otherwise area goes into the
+     * smallest gap it fits in */
+    check(mymap_mmap(&m, VA(0x800), 0x10, 0, NULL) == VA(0x800), name,
+            "best fit at free suggested address");
+    check(mymap_mmap(&m, VA(0x65), 0x10, 0, NULL) == VA(0xa0), name,
+            "best fit instead of suggested address inside region");
+    check(mymap_mmap(&m, NULL, 0x18, 0, NULL) == VA(0x70), name,
+            "best fit into smaller gap");
+    check(mymap_mmap(&m, NULL, 0x30, 0, NULL) == VA(0x20), name,
+            "best fit into larger gap");
+    check(mymap_mmap(&m, NULL, 0x100, 0, NULL) == VA(0xc0), name,
+            "best fit into the last gap");
+    check(mymap_mmap(&m, NULL, 0x1000, 0, NULL) == MYMAP_FAILED, name,
+            "best fit larger than any gap");
+#else
+    /* Without the index best fit would have to scan all gaps */
+    check(mymap_set_policy(&m, MYMAP_BEST_FIT) != MYMAP_OK, name,
+            "best fit without the index");
+    check(mymap_mmap(&m, NULL, 0x10, 0, NULL) == VA(0x20), name,
+            "policy is kept if best fit is rejected");
+#endif
+
+    mymap_destroy(&m);
+}
+
+static void test_gap_queries(map_backend_t backend) {
+    const char *name = map_name(backend);
+    size_t size;
+    map_t m;
+
+    init_map(&m, backend);
+
+    /* Gaps of 0x40, 0x20 and 0x10 bytes between regions and the last gap of
+     * 0xf41 bytes, as it is stored */
+    mymap_mmap(&m, VA(0x10), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x60), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x90), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0xb0), 0x10, MYMAP_READ, NULL);
+
+    check(mymap_smallest_gap(&m, 0x10, &size) == VA(0xa0) && size == 0x10,
+            name, "smallest gap of exact size");
+    check(mymap_smallest_gap(&m, 0x11, &size) == VA(0x70) && size == 0x20,
+            name, "smallest gap larger than minimum size");
+    check(mymap_smallest_gap(&m, 0x41, &size) == VA(0xc0) && size == 0xf41,
+            name, "smallest gap is the last gap");
+    check(mymap_smallest_gap(&m, 0x2000, NULL) == MYMAP_FAILED, name,
+            "no gap of minimum size");
+    check(mymap_largest_gap(&m, &size) == VA(0xc0) && size == 0xf41, name,
+            "largest gap is the last gap");
+    check(mymap_count_gaps(&m, 0) == 4 && mymap_count_gaps(&m, 0x11) == 3
+            && mymap_count_gaps(&m, 0x21) == 2
+            && mymap_count_gaps(&m, 0x41) == 1
+            && mymap_count_gaps(&m, 0x2000) == 0, name, "count gaps");
+
+    /* After filling the last gap and splitting the largest one there are two
+     * gaps of 0x20 bytes, and the lowest one is returned */
+    mymap_mmap(&m, VA(0xc0), 0x1000 - 0xc0, MYMAP_READ, NULL);
+    check(mymap_largest_gap(&m, &size) == VA(0x20) && size == 0x40, name,
+            "largest gap between regions");
+    mymap_mmap(&m, VA(0x40), 0x20, MYMAP_READ, NULL);
+    check(mymap_smallest_gap(&m, 0x11, &size) == VA(0x20) && size == 0x20,
+            name, "lowest of equal smallest gaps");
+    check(mymap_largest_gap(&m, &size) == VA(0x20) && size == 0x20, name,
+            "lowest of equal largest gaps");
+    check(mymap_count_gaps(&m, 0x11) == 2 && mymap_count_gaps(&m, 0x21) == 0,
+            name, "count gaps after filling the largest one");
+
+    mymap_destroy(&m);
+}
+
+static void test_space(map_backend_t backend) {
+    const char *name = map_name(backend);
+    map_region_desc_t regions[4] = {
+        {NULL, VA(0x10), VA(0x20), MYMAP_READ},
+        {NULL, VA(0x60), VA(0x70), MYMAP_READ},
+        {NULL, VA(0x90), VA(0xa0), MYMAP_READ},
+        {NULL, VA(0xb0), VA(0xc0), MYMAP_READ},
+    };
+    map_space_t space, built;
+    unsigned i;
+    map_t m;
+
+    init_map(&m, backend);
+
+    /* Empty map is a single gap up to and including the end of the address
+     * space */
+    mymap_get_space(&m, &space);
+    check(space.mapped == 0 && space.unmapped == 0xff1 && space.regions == 0
+            && space.gaps == 1 && space.largest_gap == 0xff1
+            && space.gap_classes[11] == 1, name, "space of empty map");
+
+    /* Gaps of 0x40, 0x20 and 0x10 bytes between regions and the last gap of
+     * 0xf41 bytes fall into classes 6, 5, 4 and 11 */
+    for (i = 0; i < 4; i++) {
+        mymap_mmap(&m, regions[i].vaddr, 0x10, MYMAP_READ, NULL);
+    }
+    mymap_get_space(&m, &space);
+    check(space.mapped == 0x40 && space.unmapped == 0xfb1
+            && space.regions == 4 && space.gaps == 4
+            && space.largest_gap == 0xf41, name, "space after mmap");
+    for (i = 0; i < MYMAP_GAP_CLASSES; i++) {
+        if (space.gap_classes[i] != (i == 4 || i == 5 || i == 6 || i == 11))
+            break;
+    }
+    check(i == MYMAP_GAP_CLASSES, name, "gap classes after mmap");
+
+    /* Map built at once has the same accounting */
+    mymap_destroy(&m);
+    init_map(&m, backend);
+    mymap_build_sorted(&m, regions, 4);
+    mymap_get_space(&m, &built);
+    check(memcmp(&space, &built, sizeof(space)) == 0, name,
+            "space of map built from sorted regions");
+
+    /* Unmapping merges gaps, while empty gaps between adjacent regions are
+     * not counted */
+    mymap_munmap_range(&m, VA(0x60), 0x40);
+    mymap_mprotect(&m, VA(0x10), 0x8, MYMAP_WRITE);
+    mymap_get_space(&m, &space);
+    check(space.mapped == 0x20 && space.unmapped == 0xfd1
+            && space.regions == 3 && space.gaps == 2
+            && space.largest_gap == 0xf41 && space.gap_classes[7] == 1
+            && space.gap_classes[4] == 0, name,
+            "space after munmap and mprotect");
+
+    mymap_destroy(&m);
+}
+
+static void test_munmap_range(map_backend_t backend) {
+    const char *name = map_name(backend);
+    _mapping_t regions[4] = {
+        {VA(0x100), VA(0x110), MYMAP_READ},
+        {VA(0x120), VA(0x140), MYMAP_READ},
+        {VA(0x140), VA(0x180), MYMAP_WRITE},
+        {VA(0x200), VA(0x240), MYMAP_READ},
+    };
+    map_t m;
+
+    init_map(&m, backend);
+    mymap_mmap(&m, VA(0x100), 0x40, MYMAP_READ, VA(0x5000));
+    mymap_mmap(&m, VA(0x140), 0x40, MYMAP_WRITE, NULL);
+    mymap_mmap(&m, VA(0x200), 0x40, MYMAP_READ, VA(0x6000));
+
+    /* Range inside a single region splits it in two and the tail keeps its
+     * physical address */
+    check(mymap_munmap_range(&m, VA(0x110), 0x10) == MYMAP_OK, name,
+            "munmap range inside region");
+    check(layout_is(&m, regions, 4), name, "layout after split by munmap");
+    check(layout.regions[1].paddr == VA(0x5020), name,
+            "physical address of the tail after split");
+
+    /* Range across regions trims the ones at its ends and removes the ones
+     * inside */
+    check(mymap_munmap_range(&m, VA(0x130), 0xe0) == MYMAP_OK, name,
+            "munmap range across regions");
+    regions[1].vend = VA(0x130);
+    regions[2] = (_mapping_t){VA(0x210), VA(0x240), MYMAP_READ};
+    check(layout_is(&m, regions, 3), name, "layout after trimming by munmap");
+    check(layout.regions[2].paddr == VA(0x6010), name,
+            "physical address of region trimmed at the beginning");
+
+    /* Range without regions changes nothing and empty range is an error */
+    check(mymap_munmap_range(&m, VA(0x400), 0x100) == MYMAP_OK
+            && layout_is(&m, regions, 3), name, "munmap range without regions");
+    check(mymap_munmap_range(&m, VA(0x100), 0) != MYMAP_OK
+            && layout_is(&m, regions, 3), name, "munmap empty range");
+
+    /* Range reaching beyond the end of the address space takes the last gap
+     * back */
+    mymap_mmap(&m, VA(0xff0), 0x10, MYMAP_READ, NULL);
+    check(mymap_munmap_range(&m, VA(0x220), 0x10000) == MYMAP_OK, name,
+            "munmap range beyond the end of the address space");
+    regions[2].vend = VA(0x220);
+    check(layout_is(&m, regions, 3), name, "layout after munmap up to the end");
+
+    mymap_destroy(&m);
+}
+
+static void test_mprotect(map_backend_t backend) {
+    const char *name = map_name(backend);
+    _mapping_t regions[5] = {
+        {VA(0x100), VA(0x110), MYMAP_READ},
+        {VA(0x110), VA(0x120), MYMAP_WRITE},
+        {VA(0x120), VA(0x180), MYMAP_READ},
+    };
+    map_t m;
+
+    /* Regions split by mprotect are merged back without coalescing too */
+    init_map(&m, backend);
+    mymap_mmap(&m, VA(0x100), 0x80, MYMAP_READ, VA(0x5000));
+
+    /* Range inside a single region splits it in three */
+    check(mymap_mprotect(&m, VA(0x110), 0x10, MYMAP_WRITE) == MYMAP_OK, name,
+            "mprotect inside region");
+    check(layout_is(&m, regions, 3), name, "layout after split by mprotect");
+    check(layout.regions[1].paddr == VA(0x5010), name,
+            "physical address of region split by mprotect");
+    mymap_mprotect(&m, VA(0x130), 0x20, MYMAP_WRITE);
+
+    /* Parts of the range are merged back together */
+    check(mymap_mprotect(&m, VA(0x118), 0x20, MYMAP_EXEC) == MYMAP_OK, name,
+            "mprotect across regions");
+    regions[1].vend = VA(0x118);
+    regions[2] = (_mapping_t){VA(0x118), VA(0x138), MYMAP_EXEC};
+    regions[3] = (_mapping_t){VA(0x138), VA(0x150), MYMAP_WRITE};
+    regions[4] = (_mapping_t){VA(0x150), VA(0x180), MYMAP_READ};
+    check(layout_is(&m, regions, 5), name, "layout after mprotect across");
+
+    /* Range which isn't mapped as a whole is rejected without any change */
+    check(mymap_mprotect(&m, VA(0x170), 0x20, MYMAP_READ) != MYMAP_OK
+            && mymap_mprotect(&m, VA(0xf0), 0x20, MYMAP_READ) != MYMAP_OK
+            && mymap_mprotect(&m, VA(0x200), 0x10, MYMAP_READ) != MYMAP_OK,
+            name, "mprotect of range which isn't mapped");
+    check(layout_is(&m, regions, 5), name, "layout after failed mprotect");
+
+    /* Restoring the flags merges regions with their neighbours, so flipping
+     * flags doesn't grow the tree */
+    check(mymap_mprotect(&m, VA(0x100), 0x80, MYMAP_READ) == MYMAP_OK, name,
+            "mprotect back to original flags");
+    regions[0].vend = VA(0x180);
+    check(layout_is(&m, regions, 1), name, "regions merged by mprotect");
+
+    /* Regions which aren't contiguous in physical memory stay separate */
+    mymap_mmap(&m, VA(0x200), 0x10, MYMAP_READ, VA(0x7000));
+    mymap_mmap(&m, VA(0x210), 0x10, MYMAP_WRITE, VA(0x9000));
+    mymap_mprotect(&m, VA(0x200), 0x20, MYMAP_WRITE);
+    regions[1] = (_mapping_t){VA(0x200), VA(0x210), MYMAP_WRITE};
+    regions[2] = (_mapping_t){VA(0x210), VA(0x220), MYMAP_WRITE};
+    check(layout_is(&m, regions, 3), name,
+            "regions not contiguous in physical memory are not merged");
+
+    mymap_destroy(&m);
+}
+
+static void test_coalescing(map_backend_t backend) {
+    const char *name = map_name(backend);
+    map_region_t *region;
+    void *a, *b;
+    map_t m;
+
+    init_map(&m, backend);
+
+    /* Neighbours are separate regions by default, so unmapping one of them
+     * leaves the other one mapped */
+    a = mymap_mmap(&m, (void*)0x100, 0x10, MYMAP_READ, NULL);
+    b = mymap_mmap(&m, (void*)0x110, 0x10, MYMAP_READ, NULL);
+    check(a == (void*)0x100 && b == (void*)0x110, name, "map neighbours");
+    check(mymap_find(&m, a) != mymap_find(&m, b), name,
+            "neighbours are not merged by default");
+    mymap_munmap(&m, a);
+    check(mymap_find(&m, a) == NULL, name, "unmapped region is gone");
+    region = mymap_find(&m, b);
+    check(region != NULL && region->vaddr == b && region->vend == b + 0x10,
+            name, "neighbour survives munmap");
+    mymap_munmap(&m, b);
+
+    /* With coalescing enabled compatible neighbours make up a single region,
+     * while ones with different flags don't */
+    mymap_enable_coalescing(&m);
+    a = mymap_mmap(&m, (void*)0x100, 0x10, MYMAP_READ, NULL);
+    b = mymap_mmap(&m, (void*)0x110, 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, (void*)0x120, 0x10, MYMAP_WRITE, NULL);
+    region = mymap_find(&m, b);
+    check(region != NULL && region == mymap_find(&m, a)
+            && region->vaddr == a && region->vend == b + 0x10, name,
+            "compatible neighbours are merged");
+    check(mymap_find(&m, (void*)0x120) != region, name,
+            "neighbours with different flags are not merged");
+    mymap_munmap_range(&m, a, 0x10);
+    check(mymap_find(&m, a) == NULL && mymap_find(&m, b) == region, name,
+            "range unmapping of merged region");
+
+    /* Unmapping a merged region tears down every mapping merged into it */
+    mymap_mmap(&m, a, 0x10, MYMAP_READ, NULL);
+    check(mymap_find(&m, a) == region && region->vaddr == a, name,
+            "mapping merged into the following region");
+    mymap_munmap(&m, b);
+    check(mymap_find(&m, a) == NULL && mymap_find(&m, b) == NULL, name,
+            "munmap removes all merged mappings");
+    region = mymap_find(&m, (void*)0x120);
+    check(region != NULL && region->vaddr == (void*)0x120
+            && region->vend == (void*)0x130, name,
+            "munmap of merged region leaves other neighbours");
+
+    mymap_destroy(&m);
+}
+
+static void test_find_cache(map_backend_t backend) {
+    const char *name = map_name(backend);
+    map_region_t *region;
+    unsigned long hits;
+    map_t m;
+
+    init_map(&m, backend);
+    mymap_mmap(&m, VA(0x100), 0x40, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x200), 0x40, MYMAP_WRITE, NULL);
+
+    /* Repeated lookups are answered from the cache */
+    region = mymap_find(&m, VA(0x110));
+    check(region != NULL && region->vaddr == VA(0x100), name,
+            "find region");
+    hits = m.cache.hits;
+    check(mymap_find(&m, VA(0x13f)) == region && m.cache.hits > hits, name,
+            "find region again from the cache");
+    check(mymap_find(&m, VA(0x140)) == NULL
+            && mymap_find(&m, VA(0xff)) == NULL, name,
+            "find addresses next to cached region");
+
+    /* Cached regions don't outlive changes of the map */
+    mymap_find(&m, VA(0x210));
+    mymap_munmap(&m, VA(0x200));
+    check(mymap_find(&m, VA(0x210)) == NULL, name,
+            "find address of unmapped region");
+    mymap_find(&m, VA(0x130));
+    mymap_munmap_range(&m, VA(0x110), 0x10);
+    region = mymap_find(&m, VA(0x130));
+    check(region != NULL && region->vaddr == VA(0x120)
+            && region->vend == VA(0x140), name,
+            "find tail of region split by munmap");
+    check(mymap_find(&m, VA(0x118)) == NULL, name,
+            "find address unmapped from the middle of region");
+    mymap_find(&m, VA(0x100));
+    mymap_mprotect(&m, VA(0x108), 0x8, MYMAP_WRITE);
+    region = mymap_find(&m, VA(0x10c));
+    check(region != NULL && region->vaddr == VA(0x108)
+            && region->flags == MYMAP_WRITE, name,
+            "find region split by mprotect");
+
+    /* Thread-safe maps don't use the cache */
+    mymap_enable_locking(&m);
+    hits = m.cache.hits;
+    mymap_find(&m, VA(0x130));
+    mymap_find(&m, VA(0x130));
+    check(m.cache.hits == hits, name, "no cache in thread-safe map");
+
+    mymap_destroy(&m);
 }
 
-static rb_node_t* _build_map(_region_t *r, size_t size) {
-    unsigned index = size/2;
-    map_region_t *region = mymap_create_region(NULL, 0);
-    rb_node_t* node = region->rb_node, *child;
+static void test_find_copy(map_backend_t backend) {
+    const char *name = map_name(backend);
+    map_region_desc_t desc;
+    map_t m;
+
+    init_map(&m, backend);
+    mymap_enable_locking(&m);
 
-    /* Fill-in region structure */
-    region->vaddr = r[index].vaddr;
-    region->vend = r[index].vend;
-    region->gap = r[index].gap;
-    region->max_gap = r[index].gap;
+    mymap_mmap(&m, (void*)0x200, 0x40, MYMAP_WRITE, (void*)0x5000);
+    check(mymap_find_copy(&m, (void*)0x23f, &desc) == MYMAP_OK
+            && desc.vaddr == (void*)0x200 && desc.vend == (void*)0x240
+            && desc.flags == MYMAP_WRITE && desc.paddr == (void*)0x5000, name,
+            "copy of region found in thread-safe map");
+    check(mymap_find_copy(&m, (void*)0x240, &desc) != MYMAP_OK, name,
+            "no copy of unmapped address");
 
-    /* Build left subtree */
-    if (index > 0) {
-        child = _build_map(r, index);
-        RB_LINK_LEFT(node, child);
-        if (region->max_gap < RB_ELEMENT(child, map_region_t)->max_gap) {
-            region->max_gap = RB_ELEMENT(child, map_region_t)->max_gap;
+    mymap_destroy(&m);
+}
+
+static void test_batch(map_backend_t backend) {
+    const char *name = map_name(backend);
+    map_op_t ops[MAX_BATCH], *order[MYMAP_BATCH_CHUNK], *op;
+    map_region_t *region;
+    size_t count, start, chunk, i, j;
+    uintptr_t prev = 0;
+    unsigned batch;
+    void *result;
+    int ret, failed, ok = 1;
+    map_t m[2];
+
+    for (i = 0; i < 2; i++) init_map(&m[i], backend);
+
+    /* Batches are applied to the first map. The same operations are applied
+     * one at a time to the second map, in the order they are documented to
+     * take effect in: sorted by addresses within chunks. */
+    for (batch = 0; batch < NUM_OF_BATCHES && ok; batch++) {
+        count = 1 + rand() % MAX_BATCH;
+        for (i = 0; i < count; i++) {
+            op = &ops[i];
+            op->vaddr = VA((uintptr_t)MYMAP_VA_BASE
+                    + rand() % (MYMAP_VA_END - MYMAP_VA_BASE));
+            op->size = 1 + rand() % 8;
+            op->flags = rand() % 8;
+            op->paddr = VA((uintptr_t)(batch*MAX_BATCH + i + 1) << 20);
+            op->result = NULL;
+            if (rand() % 2) {
+                op->type = MYMAP_OP_MMAP;
+                if (rand() % 2) op->vaddr = NULL;
+                continue;
+            }
+
+            /* Unmapped addresses often follow each other, so that
+             * neighbouring regions are unmapped by the same batch */
+            op->type = MYMAP_OP_MUNMAP;
+            if (prev != 0 && rand() % 2) {
+                op->vaddr = VA(prev + rand() % 8);
+            }
+            prev = (uintptr_t)op->vaddr;
         }
+
+        ret = mymap_batch(&m[0], ops, count);
+        failed = 0;
+
+        for (start = 0; start < count; start += chunk) {
+            chunk = (count - start < MYMAP_BATCH_CHUNK) ? count - start
+                    : MYMAP_BATCH_CHUNK;
+            for (i = 0; i < chunk; i++) {
+                op = &ops[start + i];
+                for (j = i; j > 0 && order[j - 1]->vaddr > op->vaddr; j--)
+                    order[j] = order[j - 1];
+                order[j] = op;
+            }
+
+            for (i = 0; i < chunk; i++) {
+                op = order[i];
+                if (op->type == MYMAP_OP_MMAP) {
+                    result = mymap_mmap(&m[1], op->vaddr, op->size,
+                            op->flags, op->paddr);
+                } else if ((region = mymap_find(&m[1], op->vaddr)) != NULL) {
+                    result = region->vaddr;
+                    mymap_munmap(&m[1], op->vaddr);
+                } else {
+                    result = MYMAP_FAILED;
+                }
+                if (op->result != result) ok = 0;
+                if (result == MYMAP_FAILED) failed = 1;
+            }
+        }
+        if ((ret != MYMAP_OK) != failed) ok = 0;
+
+        collect_layout(&m[0]);
+        count = layout.count;
+        memcpy(expected, layout.regions, count*sizeof(_mapping_t));
+        if (!layout_is(&m[0], expected, count)
+                || !layout_is(&m[1], expected, count)) {
+            ok = 0;
+        }
+    }
+    check(ok, name, "batches match operations applied one at a time");
+
+    for (i = 0; i < 2; i++) mymap_destroy(&m[i]);
+}
+
+static void test_concurrency(map_backend_t backend) {
+    const char *name = map_name(backend);
+    worker_t workers[NUM_OF_WRITERS + NUM_OF_READERS];
+    pthread_t threads[NUM_OF_WRITERS + NUM_OF_READERS];
+    unsigned long errors = 0;
+    size_t count = 0, i, size, largest = 0;
+    void *prev_end, *gap = MYMAP_FAILED, *found;
+    int ok = 1;
+    map_t m;
+
+    init_map(&m, backend);
+    mymap_enable_locking(&m);
+
+    /* Writers race for the same areas, while readers look regions up */
+    for (i = 0; i < NUM_OF_WRITERS + NUM_OF_READERS; i++) {
+        workers[i].map = &m;
+        workers[i].seed = rand();
+        workers[i].count = 0;
+        workers[i].errors = 0;
+        if (pthread_create(&threads[i], NULL, (i < NUM_OF_WRITERS)
+                ? stress_writer : stress_reader, &workers[i]) != 0) {
+            check(0, name, "start threads sharing the map");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < NUM_OF_WRITERS + NUM_OF_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += workers[i].errors;
+        count += workers[i].count;
     }
+    check(errors == 0, name, "consistent regions under concurrent updates");
 
-    /* Build right subtree */
-    if ((size - index - 1) > 0) {
-        child = _build_map(&r[index + 1], size - index - 1);
-        RB_LINK_RIGHT(node, child);
-        if (region->max_gap < RB_ELEMENT(child, map_region_t)->max_gap) {
-            region->max_gap = RB_ELEMENT(child, map_region_t)->max_gap;
+    /* Regions left by the writers don't overlap, and gaps stored in the tree
+     * and its largest gaps agree with them */
+    collect_layout(&m);
+    prev_end = m.va_base;
+    for (i = 0; i < layout.count; i++) {
+        if (layout.regions[i].vaddr < prev_end
+                || layout.regions[i].vend - layout.regions[i].vaddr
+                        != layout.regions[i].flags) ok = 0;
+        size = layout.regions[i].vaddr - prev_end;
+        if (size > largest) {
+            largest = size;
+            gap = prev_end;
         }
+        prev_end = layout.regions[i].vend;
     }
+    if ((size_t)(m.va_end + 1 - prev_end) > largest) {
+        largest = m.va_end + 1 - prev_end;
+        gap = prev_end;
+    }
+    found = mymap_largest_gap(&m, &size);
+    check(ok && layout.gaps_ok && layout.count == count, name,
+            "layout after concurrent updates");
+    check(found == gap && size == largest, name,
+            "largest gaps after concurrent updates");
+
+    mymap_destroy(&m);
+}
+
+static void* stress_writer(void *arg) {
+    worker_t *w = arg;
+    size_t i, size;
+    void *addr;
+
+    for (i = 0; i < NUM_OF_THREAD_OPS; i++) {
+        if (w->count == MAX_THREAD_REGIONS
+                || (w->count > 0 && rand_r(&w->seed) % 2)) {
+            size = rand_r(&w->seed) % w->count;
+            mymap_munmap(w->map, w->mapped[size]);
+            w->mapped[size] = w->mapped[--w->count];
+        } else {
+            size = 1 + rand_r(&w->seed) % 8;
+            addr = mymap_mmap(w->map, NULL, size, size, NULL);
+            if (addr == MYMAP_FAILED) {
+                w->errors++;
+            } else {
+                w->mapped[w->count++] = addr;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void* stress_reader(void *arg) {
+    worker_t *w = arg;
+    map_region_desc_t desc;
+    size_t i;
+    void *addr;
+
+    for (i = 0; i < NUM_OF_THREAD_OPS; i++) {
+        addr = w->map->va_base
+                + rand_r(&w->seed) % (w->map->va_end - w->map->va_base);
+        if (mymap_find_copy(w->map, addr, &desc) != MYMAP_OK) continue;
+        if (desc.vaddr > addr || desc.vend <= addr
+                || desc.vend - desc.vaddr != desc.flags) w->errors++;
+    }
+
+    return NULL;
+}
+
+static void test_btree(map_policy_t policy) {
+    const char *name = policy_names[policy];
+    map_t m[2];
+    uintptr_t addr, end, paddr, i;
+    size_t size, peak = 0;
+    unsigned op, flags, id;
+    void *ret[2];
+    int b, err[2], ok = 1;
+
+    if ((uintptr_t)MYMAP_VA_END > MODEL_SIZE) return;
+
+    for (b = MYMAP_RBTREE; b <= MYMAP_BTREE; b++) {
+        mymap_init(&m[b]);
+        mymap_set_backend(&m[b], b);
+        if (mymap_set_policy(&m[b], policy) != MYMAP_OK) {
+            mymap_destroy(&m[0]);
+            if (b > 0) mymap_destroy(&m[1]);
+            return;
+        }
+    }
+    memset(&model, 0, sizeof(model));
+    model.ids = 1;
+
+    /* Backend can be changed only while the map is empty */
+    mymap_mmap(&m[MYMAP_BTREE], VA(0x10), 0x10, MYMAP_READ, NULL);
+    check(mymap_set_backend(&m[MYMAP_BTREE], MYMAP_RBTREE) != MYMAP_OK, name,
+            "change of backend of map which isn't empty");
+    mymap_munmap(&m[MYMAP_BTREE], VA(0x10));
+
+    /* The same random operations are applied to maps with both backends. They
+     * have to place areas at the same addresses, and their regions have to
+     * match the model after every operation. */
+    for (op = 0; op < NUM_OF_OPS && ok; op++) {
+        addr = (uintptr_t)MYMAP_VA_BASE
+                + rand() % (MYMAP_VA_END - MYMAP_VA_BASE);
+        size = 1 + rand() % 8;
+        flags = rand() % 8;
+        paddr = (uintptr_t)(op + 1) << 20;
+
+        switch (rand() % 8) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            /* Mappings get separate physical memory, so they are never merged
+             * with each other */
+            if (rand() % 2) addr = 0;
+            for (b = MYMAP_RBTREE; b <= MYMAP_BTREE; b++) {
+                ret[b] = mymap_mmap(&m[b], VA(addr), size, flags,
+                        VA(paddr));
+            }
+            if (ret[0] != ret[1]) {
+                ok = 0;
+            } else if (ret[0] != MYMAP_FAILED) {
+                addr = (uintptr_t)ret[0];
+                ok = model_is_free(addr, size);
+                for (i = 0; i < size && ok; i++)
+                    model.owner[addr + i] = model.ids;
+                model.offset[model.ids] = paddr - addr;
+                model.flags[model.ids++] = flags;
+            }
+            break;
+
+        case 4:
+            id = model.owner[addr];
+            for (b = MYMAP_RBTREE; b <= MYMAP_BTREE; b++)
+                mymap_munmap(&m[b], VA(addr));
+            for (i = 0; id != 0 && i < (uintptr_t)MYMAP_VA_END; i++) {
+                if (model.owner[i] == id) model.owner[i] = 0;
+            }
+            break;
+
+        case 5:
+            size *= 4;
+            for (b = MYMAP_RBTREE; b <= MYMAP_BTREE; b++) {
+                ok = ok && mymap_munmap_range(&m[b], VA(addr), size)
+                        == MYMAP_OK;
+            }
+            end = (addr + size < (uintptr_t)MYMAP_VA_END) ?
+                    addr + size : (uintptr_t)MYMAP_VA_END;
+            model_split(end);
+            for (i = addr; i < end; i++) model.owner[i] = 0;
+            break;
+
+        default:
+            end = addr + size;
+            for (b = MYMAP_RBTREE; b <= MYMAP_BTREE; b++)
+                err[b] = mymap_mprotect(&m[b], VA(addr), size, flags);
+            if (err[0] != err[1]) {
+                ok = 0;
+            } else if (end > (uintptr_t)MYMAP_VA_END) {
+                ok = (err[0] != MYMAP_OK);
+            } else {
+
+                /* Range has to be mapped as a whole */
+                for (i = addr; i < end && model.owner[i] != 0; i++);
+                ok = ((i < end) == (err[0] != MYMAP_OK));
+                if (i < end) break;
+
+                /* Parts of the range get new flags and then merge with
+                 * compatible neighbours */
+                model_split(addr);
+                model_split(end);
+                for (i = addr; i < end; i++)
+                    model.flags[model.owner[i]] = flags;
+                model_merge(addr, end);
+            }
+            break;
+        }
+
+        for (b = MYMAP_RBTREE; b <= MYMAP_BTREE && ok; b++)
+            ok = model_matches(&m[b]);
+        if (layout.count > peak) peak = layout.count;
+    }
+
+    check(ok, name, "random operations on maps with both backends");
+    check(peak > MYMAP_BTREE_SLOTS*MYMAP_BTREE_SLOTS, name,
+            "regions fill more than two levels of the B-tree");
+
+    mymap_destroy(&m[0]);
+    mymap_destroy(&m[1]);
+}
+
+static void model_split(uintptr_t addr) {
+    unsigned short id;
+    uintptr_t i;
+
+    if (addr == 0 || addr >= (uintptr_t)MYMAP_VA_END) return;
+    id = model.owner[addr];
+    if (id == 0 || model.owner[addr - 1] != id) return;
+
+    /* Bytes of the region from given address on get their own identifier */
+    for (i = addr; i < (uintptr_t)MYMAP_VA_END && model.owner[i] == id; i++)
+        model.owner[i] = model.ids;
+    model.offset[model.ids] = model.offset[id];
+    model.flags[model.ids++] = model.flags[id];
+}
+
+static void model_merge(uintptr_t addr, uintptr_t end) {
+    unsigned short prev, id;
+    uintptr_t i, j;
+
+    /* Regions touching the range, including the ones right before and after
+     * it, merge with their neighbours if they have the same flags and are
+     * contiguous in physical memory */
+    for (i = (addr > 0) ? addr : 1; i <= end && i < (uintptr_t)MYMAP_VA_END;
+            i++) {
+        prev = model.owner[i - 1];
+        id = model.owner[i];
+        if (prev == 0 || id == 0 || prev == id) continue;
+        if (model.flags[prev] != model.flags[id]) continue;
+        if (model.offset[prev] != model.offset[id]) continue;
+        for (j = i; j < (uintptr_t)MYMAP_VA_END && model.owner[j] == id; j++)
+            model.owner[j] = prev;
+    }
+}
+
+static int model_is_free(uintptr_t addr, size_t size) {
+    size_t i;
+
+    if (addr < (uintptr_t)MYMAP_VA_BASE) return 0;
+    if (addr + size > (uintptr_t)MYMAP_VA_END) return 0;
+    for (i = 0; i < size; i++) {
+        if (model.owner[addr + i] != 0) return 0;
+    }
+
+    return 1;
+}
+
+static int model_matches(map_t *m) {
+    uintptr_t addr = 0, vaddr, vend;
+    unsigned short id;
+    size_t i;
+
+    collect_layout(m);
+    if (!layout.gaps_ok || layout.count == MAX_LAYOUT) return 0;
+    if (m->last_gap != (unsigned long)(m->va_end - layout.prev_end) + 1)
+        return 0;
+
+    /* Every region covers the whole run of bytes of a single identifier, and
+     * bytes between regions are unmapped */
+    for (i = 0; i < layout.count; i++) {
+        vaddr = (uintptr_t)layout.regions[i].vaddr;
+        vend = (uintptr_t)layout.regions[i].vend;
+        id = model.owner[vaddr];
+        for (; addr < vaddr; addr++) {
+            if (model.owner[addr] != 0) return 0;
+        }
+        for (; addr < vend; addr++) {
+            if (model.owner[addr] != id) return 0;
+        }
+        if (id == 0 || model.flags[id] != layout.regions[i].flags) return 0;
+        if ((uintptr_t)layout.regions[i].paddr != model.offset[id] + vaddr)
+            return 0;
+        if (vend < (uintptr_t)MYMAP_VA_END && model.owner[vend] == id)
+            return 0;
+    }
+    for (; addr < (uintptr_t)MYMAP_VA_END; addr++) {
+        if (model.owner[addr] != 0) return 0;
+    }
+
+    return 1;
+}
+
+
+static void test_iterators(map_backend_t backend) {
+    const char *name = map_name(backend);
+    gaps_t gaps = {.limit = MAX_GAPS};
+    unsigned left;
+    map_t m;
+
+    init_map(&m, backend);
+    mymap_mmap(&m, VA(0x10), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x40), 0x10, MYMAP_READ, NULL);
+    mymap_mmap(&m, VA(0x80), 0x20, MYMAP_READ, NULL);
+
+    /* Iteration starts with the region containing the address or the first
+     * one after it */
+    layout.count = 0;
+    mymap_for_each_region_from(&m, VA(0x45), collect_region, &layout);
+    check(layout.count == 2 && layout.regions[0].vaddr == VA(0x40), name,
+            "regions from address inside region");
+    layout.count = 0;
+    mymap_for_each_region_from(&m, VA(0x50), collect_region, &layout);
+    check(layout.count == 1 && layout.regions[0].vaddr == VA(0x80), name,
+            "regions from address in gap");
+    layout.count = 0;
+    mymap_for_each_region_from(&m, VA(0xa0), collect_region, &layout);
+    check(layout.count == 0, name, "regions from address after all regions");
+
+    /* Function stops the iteration by returning nonzero */
+    left = 2;
+    check(mymap_for_each_region_from(&m, VA(0), stop_region, &left)
+            == MYMAP_OK && left == 0, name, "stopped iteration over regions");
+    check(mymap_for_each_region_from(&m, VA(0), NULL, NULL) != MYMAP_OK,
+            name, "iteration over regions without function");
+
+    /* Gaps come in order of addresses with the last one reported as it is
+     * stored, up to and including the end of the address space */
+    mymap_for_each_gap(&m, 0, collect_gap, &gaps);
+    check(gaps.count == 3 && gaps.start[0] == VA(0x20) && gaps.size[0] == 0x20
+            && gaps.start[1] == VA(0x50) && gaps.size[1] == 0x30
+            && gaps.start[2] == VA(0xa0) && gaps.size[2] == 0xf61, name,
+            "all gaps");
+    gaps.count = 0;
+    mymap_for_each_gap(&m, 0x21, collect_gap, &gaps);
+    check(gaps.count == 2 && gaps.start[0] == VA(0x50)
+            && gaps.start[1] == VA(0xa0), name, "gaps of minimum size");
+    gaps.count = 0;
+    gaps.limit = 1;
+    check(mymap_for_each_gap(&m, 0, collect_gap, &gaps) == MYMAP_OK
+            && gaps.count == 1 && gaps.start[0] == VA(0x20), name,
+            "stopped iteration over gaps");
+
+    /* Gaps smaller than the minimum size are skipped up to the end */
+    mymap_munmap(&m, VA(0x80));
+    mymap_mmap(&m, VA(0x50), 0x1000 - 0x50, MYMAP_READ, NULL);
+    gaps.count = 0;
+    gaps.limit = MAX_GAPS;
+    mymap_for_each_gap(&m, 0x21, collect_gap, &gaps);
+    check(gaps.count == 0, name, "no gaps of minimum size");
+
+    mymap_destroy(&m);
+}
+
+static int collect_gap(void *arg, void *start, size_t size) {
+    gaps_t *g = arg;
+
+    g->start[g->count] = start;
+    g->size[g->count] = size;
+    g->count++;
+
+    return g->count == g->limit;
+}
+
+static int stop_region(void *arg, map_region_t *region) {
+    unsigned *left = arg;
+
+    return --(*left) == 0;
+}
+
+static void test_dump(map_backend_t backend) {
+    const char *name = map_name(backend);
+    int width = 2*sizeof(void*);
+    size_t len = 0, i;
+    _mapping_t *r;
+    map_t m;
+
+    init_map(&m, backend);
+
+    memset(&dump, 0, sizeof(dump));
+    dump.limit = ~0U;
+    check(mymap_dump_regions(&m, capture_dump, &dump) == MYMAP_OK
+            && dump.writes == 0, name, "dump of empty map");
+    check(mymap_dump_regions(&m, NULL, NULL) != MYMAP_OK, name,
+            "dump without writer");
+
+    for (i = 0; i < NUM_OF_DUMPED; i++) {
+        mymap_mmap(&m, VA(0x10 + 4*i), 2, i % 8, VA((i + 1) << 12));
+    }
+
+    /* Lines have to describe the same regions as the iterator, in the same
+     * order */
+    collect_layout(&m);
+    for (i = 0; i < layout.count; i++) {
+        r = &layout.regions[i];
+        len += sprintf(dump_expected + len, "%0*lx-%0*lx %c%c%c %0*lx\n",
+                width, (unsigned long)(uintptr_t)r->vaddr,
+                width, (unsigned long)(uintptr_t)r->vend,
+                (r->flags & MYMAP_READ) ? 'r' : '-',
+                (r->flags & MYMAP_WRITE) ? 'w' : '-',
+                (r->flags & MYMAP_EXEC) ? 'x' : '-',
+                width, (unsigned long)(uintptr_t)r->paddr);
+    }
+
+    /* Output is larger than the buffer, so it's passed on in several chunks
+     * of whole lines */
+    memset(&dump, 0, sizeof(dump));
+    dump.limit = ~0U;
+    check(mymap_dump_regions(&m, capture_dump, &dump) == MYMAP_OK
+            && layout.count == NUM_OF_DUMPED && dump.len == len
+            && memcmp(dump.text, dump_expected, len) == 0, name,
+            "dumped lines match regions");
+    check(len > MYMAP_DUMP_BUFFER_SIZE && dump.writes > 1 && !dump.split_line
+            && !dump.too_long, name, "dump flushed in whole lines");
+
+    /* Failure of the writer stops the dump */
+    memset(&dump, 0, sizeof(dump));
+    dump.limit = 1;
+    check(mymap_dump_regions(&m, capture_dump, &dump) != MYMAP_OK
+            && dump.writes == 1, name, "dump stopped by failed writer");
+
+    mymap_destroy(&m);
+}
+
+static int capture_dump(void *arg, const char *buf, size_t len) {
+    dump_t *d = arg;
+
+    d->writes++;
+    if (d->writes >= d->limit) return 1;
+
+    if (len > MYMAP_DUMP_BUFFER_SIZE) d->too_long = 1;
+    if (len == 0 || buf[len - 1] != '\n') d->split_line = 1;
+    if (d->len + len > sizeof(d->text)) return 1;
+    memcpy(d->text + d->len, buf, len);
+    d->len += len;
+
+    return 0;
+}
+
+static void test_sharded_range(void) {
+    void *base = (void*)0x100000000UL, *end = (void*)0x1ffffffffUL;
+    void *bound = base + 0x40000000UL;
+    sharded_map_t smap;
+    map_region_desc_t desc;
+    void *addr;
+
+    check(mymap_sharded_init_range(&smap, 4, base, end) == MYMAP_OK,
+            "sharded", "split address space of the caller");
+
+    /* Every shard gets a quarter of the address space */
+    check(mymap_sharded_shard(&smap, base) == &smap.shards[0]
+            && mymap_sharded_shard(&smap, base + 0x40000000UL)
+                    == &smap.shards[1]
+            && mymap_sharded_shard(&smap, end) == &smap.shards[3]
+            && mymap_sharded_shard(&smap, base - 1) == NULL
+            && mymap_sharded_shard(&smap, end + 1) == NULL, "sharded",
+            "shards cover the address space");
+
+    /* Suggested address below the address space is moved to its base */
+    addr = mymap_sharded_mmap(&smap, 2, (void*)0x1000, 0x1000, MYMAP_READ,
+            NULL);
+    check(addr == base && mymap_sharded_find_copy(&smap, addr, &desc)
+            == MYMAP_OK && desc.vend == base + 0x1000, "sharded",
+            "map at the base of the address space");
+    addr = mymap_sharded_mmap(&smap, 2, NULL, 0x1000, MYMAP_READ, NULL);
+    check(addr == base + 0x80000000UL, "sharded", "map in the home shard");
+    check(mymap_sharded_get_unmapped_area(&smap, 2, NULL, 0x1000)
+            == base + 0x80001000UL, "sharded",
+            "unmapped area in the home shard");
+
+    /* Regions on both sides of the boundary between the first two shards are
+     * separated by the last byte of the first shard, which can't be mapped */
+    mymap_sharded_mmap(&smap, 0, bound - 0x1001, 0x1000, MYMAP_READ, NULL);
+    mymap_sharded_mmap(&smap, 0, bound, 0x1000, MYMAP_READ, NULL);
+    check(mymap_sharded_get_unmapped_area(&smap, 0, bound - 0x801, 0x800)
+            == bound + 0x1000, "sharded", "unmapped area in the next shard");
+    check(mymap_sharded_mprotect(&smap, bound - 0x1001, 0x2001, MYMAP_WRITE)
+            != MYMAP_OK, "sharded", "mprotect across shards");
+    check(mymap_sharded_mprotect(&smap, bound, 0x1000, MYMAP_WRITE)
+            == MYMAP_OK && mymap_sharded_find_copy(&smap, bound, &desc)
+                    == MYMAP_OK && desc.flags == MYMAP_WRITE
+            && mymap_sharded_find_copy(&smap, bound - 2, &desc) == MYMAP_OK
+            && desc.flags == MYMAP_READ, "sharded", "mprotect in a shard");
+
+    /* Range unmapping trims regions in both shards */
+    check(mymap_sharded_munmap_range(&smap, bound - 0x801, 0x1000) == MYMAP_OK,
+            "sharded", "unmap range across shards");
+    check(mymap_sharded_find_copy(&smap, bound - 0x802, &desc) == MYMAP_OK
+            && desc.vend == bound - 0x801
+            && mymap_sharded_find_copy(&smap, bound + 0x7ff, &desc) == MYMAP_OK
+            && desc.vaddr == bound + 0x7ff
+            && mymap_sharded_find(&smap, bound + 0x7fe) == NULL, "sharded",
+            "regions trimmed by range unmapping across shards");
+
+    mymap_sharded_destroy(&smap);
+
+    check(mymap_sharded_init_range(&smap, 4, end, base) != MYMAP_OK
+            && mymap_sharded_init_range(&smap, 4, NULL, end) != MYMAP_OK,
+            "sharded", "invalid address space");
+}
+
+static void test_stats(void) {
+    const char *name = "stats";
+    map_stats_t stats;
+    map_t m;
+
+    mymap_init(&m);
+
+#ifdef MYMAP_STATS
+    check(mymap_reset_stats(&m) == MYMAP_OK, name, "reset of statistics");
+
+    /* Regions mapped one after another are found only by checking the gap
+     * after the last region, and the third one makes the tree rotate once */
+    mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x100000));
+    mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x200000));
+    mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x300000));
+    check(mymap_get_stats(&m, &stats) == MYMAP_OK && stats.searches == 3
+            && stats.last_gap_checks == 3 && stats.insert_rotations == 1
+            && stats.allocations == 3, name,
+            "counters after mapping regions one after another");
+
+    /* Gap left by the middle region is found in the tree. After the root is
+     * deleted, the region is mapped back under its red left child, so the
+     * tree rotates twice. */
+    mymap_reset_stats(&m);
+    mymap_munmap(&m, VA(0x20));
+    check(mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x400000)) == VA(0x20)
+            && mymap_get_stats(&m, &stats) == MYMAP_OK
+            && stats.searches == 1 && stats.last_gap_checks == 0
+            && stats.insert_rotations == 2 && stats.delete_rotations == 0
+            && stats.allocations == 1, name,
+            "counters after mapping region into a gap");
+    mymap_destroy(&m);
+
+    /* Pool allocates whole slabs */
+    mymap_init_pool(&m, 2);
+    mymap_reset_stats(&m);
+    mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x100000));
+    mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x200000));
+    mymap_mmap(&m, NULL, 0x10, MYMAP_READ, VA(0x300000));
+    check(mymap_get_stats(&m, &stats) == MYMAP_OK && stats.allocations == 2,
+            name, "allocations of pooled map");
+#else
+    check(mymap_get_stats(&m, &stats) != MYMAP_OK
+            && mymap_reset_stats(&m) != MYMAP_OK, name,
+            "statistics of map built without MYMAP_STATS");
+#endif
 
-    return node;
+    mymap_destroy(&m);
 }
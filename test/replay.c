@@ -0,0 +1,317 @@
+/*
+ * replay.c
+ *
+ * Replays a trace recorded with mymap_set_trace and mymap_trace_write on a
+ * fresh map at full speed. The map is built from the initial state stored at
+ * the beginning of the trace, then every recorded operation is applied and its
+ * result is compared with the recorded one. Since the backend isn't part of
+ * the trace, the same sequence of operations can be replayed with each of
+ * them.
+ *
+ * Usage: replay trace_file [rbtree|btree] [repeat]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mymap.h"
+
+/* Number of mismatches printed before the rest is only counted */
+#define MAX_REPORTED                (10)
+
+/* Addresses stored in trace records */
+#define REC_PTR(addr)               ((void*)(uintptr_t)(addr))
+
+typedef struct {
+    map_trace_rec_t *recs; /* Records of the trace */
+    size_t count; /* Number of records */
+    size_t max_batch; /* Number of operations in the largest batch */
+    size_t max_build; /* Number of regions in the largest built map */
+} trace_t;
+
+/* Private functions -------------------------------------------------------- */
+static int load_trace(trace_t *trace, const char *path);
+static size_t build_map(map_t *m, trace_t *trace, map_backend_t backend);
+static size_t replay(map_t *m, trace_t *trace, size_t first, map_op_t *ops,
+        map_region_desc_t *desc);
+static void* replay_op(map_t *m, const map_trace_rec_t *rec);
+static void check(size_t index, const map_trace_rec_t *rec, void *result,
+        size_t *mismatches);
+static double now(void);
+
+/* Main --------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+    map_backend_t backend = MYMAP_RBTREE;
+    unsigned repeat = 1, i;
+    size_t first, mismatches = 0;
+    double start, elapsed, best = 0;
+    map_op_t *ops;
+    map_region_desc_t *desc;
+    trace_t trace;
+    map_t m;
+
+    if (argc < 2) {
+        printf("Usage: %s trace_file [rbtree|btree] [repeat]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 2 && strcmp(argv[2], "btree") == 0) backend = MYMAP_BTREE;
+    if (argc > 3) repeat = atoi(argv[3]);
+    if (repeat < 1) repeat = 1;
+
+    if (load_trace(&trace, argv[1]) != 0) return EXIT_FAILURE;
+
+    ops = malloc((trace.max_batch + 1)*sizeof(map_op_t));
+    if (ops == NULL) {
+        printf("Can't allocate batch of %zu operations\n", trace.max_batch);
+        return EXIT_FAILURE;
+    }
+    desc = malloc((trace.max_build + 1)*sizeof(map_region_desc_t));
+    if (desc == NULL) {
+        printf("Can't allocate %zu regions\n", trace.max_build);
+        return EXIT_FAILURE;
+    }
+
+    /* Every run starts from the same state, so only the fastest one is
+     * reported */
+    for (i = 0; i < repeat; i++) {
+        first = build_map(&m, &trace, backend);
+        if (first == 0) return EXIT_FAILURE;
+
+        start = now();
+        mismatches = replay(&m, &trace, first, ops, desc);
+        elapsed = now() - start;
+        if (i == 0 || elapsed < best) best = elapsed;
+
+        mymap_destroy(&m);
+    }
+
+    printf("%s: %zu operations in %.3f s (%.0f ops/s), %zu mismatches\n",
+            (backend == MYMAP_BTREE) ? "btree" : "rbtree", trace.count - first,
+            best, (trace.count - first)/best, mismatches);
+
+    free(ops);
+    free(desc);
+    free(trace.recs);
+
+    return (mismatches > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Private functions -------------------------------------------------------- */
+static int load_trace(trace_t *trace, const char *path) {
+    FILE *f;
+    long len;
+    size_t i;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("Can't open %s\n", path);
+        return -1;
+    }
+
+    /* Whole trace is read up front, so that reading the file doesn't slow
+     * down the replay */
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    trace->count = (len > 0) ? len/sizeof(map_trace_rec_t) : 0;
+    if (trace->count == 0) {
+        printf("%s is empty\n", path);
+        fclose(f);
+        return -1;
+    }
+    trace->recs = malloc(trace->count*sizeof(map_trace_rec_t));
+    if (trace->recs == NULL || fread(trace->recs, sizeof(map_trace_rec_t),
+            trace->count, f) != trace->count) {
+        printf("Can't read %s\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if (trace->recs[0].op != MYMAP_TRACE_INIT) {
+        printf("%s is not a trace of the map\n", path);
+        return -1;
+    }
+
+    trace->max_batch = 0;
+    trace->max_build = 0;
+    for (i = 0; i < trace->count; i++) {
+        if (trace->recs[i].op == MYMAP_TRACE_BATCH
+                && trace->recs[i].size > trace->max_batch) {
+            trace->max_batch = trace->recs[i].size;
+        }
+        if (trace->recs[i].op == MYMAP_TRACE_BUILD
+                && trace->recs[i].size > trace->max_build) {
+            trace->max_build = trace->recs[i].size;
+        }
+    }
+
+    return 0;
+}
+
+static size_t build_map(map_t *m, trace_t *trace, map_backend_t backend) {
+    const map_trace_rec_t *init = &trace->recs[0], *rec;
+    map_region_desc_t *desc;
+    size_t i, count = 0;
+
+    if (mymap_init_range(m, REC_PTR(init->vaddr), REC_PTR(init->result))
+            != MYMAP_OK || mymap_set_backend(m, backend) != MYMAP_OK
+            || mymap_set_policy(m, init->flags) != MYMAP_OK) {
+        printf("Can't initialize the map\n");
+        return 0;
+    }
+
+    /* Regions mapped when the trace was started follow the first record in
+     * order of their addresses */
+    for (i = 1; i < trace->count; i++) {
+        if (trace->recs[i].op != MYMAP_TRACE_REGION) break;
+    }
+    desc = malloc(i*sizeof(map_region_desc_t));
+    if (desc == NULL) {
+        printf("Can't allocate %zu regions\n", i - 1);
+        return 0;
+    }
+    for (rec = init + 1; rec < init + i; rec++, count++) {
+        desc[count].paddr = REC_PTR(rec->paddr);
+        desc[count].vaddr = REC_PTR(rec->vaddr);
+        desc[count].vend = REC_PTR(rec->vaddr + rec->size);
+        desc[count].flags = rec->flags;
+    }
+    if (mymap_build_sorted(m, desc, count) != MYMAP_OK) {
+        printf("Can't build the map of %zu regions\n", count);
+        free(desc);
+        return 0;
+    }
+    free(desc);
+
+    return i;
+}
+
+static size_t replay(map_t *m, trace_t *trace, size_t first, map_op_t *ops,
+        map_region_desc_t *desc) {
+    const map_trace_rec_t *rec;
+    size_t i, j, count, mismatches = 0;
+    void *result;
+
+    for (i = first; i < trace->count; i++) {
+        rec = &trace->recs[i];
+
+        /* The initial state is only allowed at the beginning */
+        if (rec->op == MYMAP_TRACE_INIT || rec->op == MYMAP_TRACE_REGION) {
+            if (mismatches < MAX_REPORTED) {
+                printf("Record %zu: unexpected initial state\n", i);
+            }
+            mismatches++;
+            continue;
+        }
+
+        /* Regions of a map built with mymap_build_sorted follow its
+         * record */
+        if (rec->op == MYMAP_TRACE_BUILD) {
+            count = rec->size;
+            if (count > trace->count - i - 1) count = trace->count - i - 1;
+            for (j = 0; j < count; j++) {
+                rec = &trace->recs[i + 1 + j];
+                desc[j].paddr = REC_PTR(rec->paddr);
+                desc[j].vaddr = REC_PTR(rec->vaddr);
+                desc[j].vend = REC_PTR(rec->vaddr + rec->size);
+                desc[j].flags = rec->flags;
+            }
+            result = (mymap_build_sorted(m, desc, count) == MYMAP_OK) ? NULL
+                    : MYMAP_FAILED;
+            check(i, &trace->recs[i], result, &mismatches);
+            i += count;
+            continue;
+        }
+
+        if (rec->op != MYMAP_TRACE_BATCH) {
+            check(i, rec, replay_op(m, rec), &mismatches);
+            continue;
+        }
+
+        /* Operations of the batch follow its record */
+        count = rec->size;
+        if (count > trace->count - i - 1) count = trace->count - i - 1;
+        for (j = 0; j < count; j++) {
+            rec = &trace->recs[i + 1 + j];
+            ops[j].type = (rec->op == MYMAP_TRACE_MMAP) ? MYMAP_OP_MMAP
+                    : MYMAP_OP_MUNMAP;
+            ops[j].vaddr = REC_PTR(rec->vaddr);
+            ops[j].size = rec->size;
+            ops[j].flags = rec->flags;
+            ops[j].paddr = REC_PTR(rec->paddr);
+        }
+        result = (mymap_batch(m, ops, count) == MYMAP_OK) ? NULL : MYMAP_FAILED;
+        check(i, &trace->recs[i], result, &mismatches);
+        for (j = 0; j < count; j++) {
+            check(i + 1 + j, &trace->recs[i + 1 + j], ops[j].result,
+                    &mismatches);
+        }
+        i += count;
+    }
+
+    return mismatches;
+}
+
+static void* replay_op(map_t *m, const map_trace_rec_t *rec) {
+    void *vaddr = REC_PTR(rec->vaddr);
+    map_region_t *region;
+
+    switch (rec->op) {
+    case MYMAP_TRACE_POLICY:
+        return (mymap_set_policy(m, rec->flags) == MYMAP_OK) ? NULL
+                : MYMAP_FAILED;
+
+    case MYMAP_TRACE_COALESCING:
+        return (mymap_enable_coalescing(m) == MYMAP_OK) ? NULL : MYMAP_FAILED;
+
+    case MYMAP_TRACE_MMAP:
+        return mymap_mmap_aligned(m, vaddr, rec->size, 1UL << rec->align_shift,
+                rec->flags, REC_PTR(rec->paddr));
+
+    case MYMAP_TRACE_MUNMAP:
+
+        /* Recorded result is the beginning of the unmapped region, which
+         * mymap_munmap doesn't return */
+        region = mymap_find(m, vaddr);
+        mymap_munmap(m, vaddr);
+        return (region != NULL) ? REC_PTR(rec->result) : MYMAP_FAILED;
+
+    case MYMAP_TRACE_MUNMAP_RANGE:
+        return (mymap_munmap_range(m, vaddr, rec->size) == MYMAP_OK) ? NULL
+                : MYMAP_FAILED;
+
+    case MYMAP_TRACE_MPROTECT:
+        return (mymap_mprotect(m, vaddr, rec->size, rec->flags) == MYMAP_OK)
+                ? NULL : MYMAP_FAILED;
+
+    case MYMAP_TRACE_UNMAPPED_AREA:
+        return mymap_get_unmapped_area_aligned(m, vaddr, rec->size,
+                1UL << rec->align_shift);
+
+    default:
+        return MYMAP_FAILED;
+    }
+}
+
+static void check(size_t index, const map_trace_rec_t *rec, void *result,
+        size_t *mismatches) {
+
+    if (result == REC_PTR(rec->result)) return;
+
+    if (*mismatches < MAX_REPORTED) {
+        printf("Record %zu (operation %u, vaddr %p, size %lu): returned %p "
+                "instead of %p\n", index, rec->op, REC_PTR(rec->vaddr),
+                (unsigned long)rec->size, result, REC_PTR(rec->result));
+    }
+    (*mismatches)++;
+}
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec*1e-9;
+}